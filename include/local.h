@@ -10,6 +10,13 @@
 #ifndef LOCAL_H
 #define LOCAL_H
 
+#include <interface/mmal/mmal.h>
+#include "trace.h"
+#include "stats.h"
+
+#define MAX_CAMERAS MMAL_PARAMETER_CAMERA_INFO_MAX_CAMERAS
+#define NUM_SPLITTER_OUTPUTS 4
+
     struct priv_rpigrafx_called {
         int main, mmal, dispmanx;
     } priv_rpigrafx_called;
@@ -21,12 +28,140 @@
     void print_error_core(const char *file, const int line, const char *func,
                           const char *fmt, ...);
 
+    /* trace.c */
+
+    /*
+     * Events at a level above RPIGRAFX_TRACE_LEVEL are compiled out.
+     * 1: per-frame events on the caller's thread.
+     * 2: events from VideoCore callback threads.
+     */
+#ifndef RPIGRAFX_TRACE_LEVEL
+#define RPIGRAFX_TRACE_LEVEL 2
+#endif
+
+    void priv_rpigrafx_trace(const uint16_t id, const void *ptr,
+                             const uint32_t length, const uint32_t flags);
+
+#define TRACE(level, id, ptr) \
+    do { \
+        if ((level) <= RPIGRAFX_TRACE_LEVEL && priv_rpigrafx_verbose) \
+            priv_rpigrafx_trace((id), (ptr), 0, 0); \
+    } while (0)
+
+#define TRACE_HEADER(level, id, header) \
+    do { \
+        if ((level) <= RPIGRAFX_TRACE_LEVEL && priv_rpigrafx_verbose) \
+            priv_rpigrafx_trace((id), (header), (header)->length, \
+                                (header)->flags); \
+    } while (0)
+
+    /* sched.c */
+    struct timespec;
+    extern __thread _Bool priv_rpigrafx_thread_is_entered;
+    void priv_rpigrafx_thread_enter(const rpigrafx_thread_t thread);
+    void priv_rpigrafx_thread_wakeup(const rpigrafx_thread_t thread,
+                                     const struct timespec *expected);
+    void priv_rpigrafx_thread_delivered(const rpigrafx_thread_t thread,
+                                        struct callback_context *ctx,
+                                        const int64_t pts);
+
+#define THREAD_ENTER(thread) \
+    do { \
+        if (!priv_rpigrafx_thread_is_entered) \
+            priv_rpigrafx_thread_enter(thread); \
+    } while (0)
+
+    /* stats.c */
+    extern struct priv_rpigrafx_stats_page *priv_rpigrafx_stats_page;
+    int priv_rpigrafx_stats_register();
+    void priv_rpigrafx_stats_label(const int idx,
+                                   const int32_t camera_number,
+                                   const int32_t output);
+    int priv_rpigrafx_stats_finalize();
+
+#define STATS_SET(ctx, field, val) \
+    do { \
+        if ((ctx)->stats_index >= 0) \
+            __atomic_store_n(&priv_rpigrafx_stats_page->outputs[(ctx)->stats_index].field, \
+                             (val), __ATOMIC_RELAXED); \
+    } while (0)
+
+#define STATS_ADD(ctx, field, n) \
+    do { \
+        if ((ctx)->stats_index >= 0) \
+            __atomic_fetch_add(&priv_rpigrafx_stats_page->outputs[(ctx)->stats_index].field, \
+                               (n), __ATOMIC_RELAXED); \
+    } while (0)
+
+#define STATS_ERROR(ctx, status) \
+    do { \
+        STATS_ADD(ctx, num_errors, 1); \
+        STATS_SET(ctx, last_status, (status)); \
+    } while (0)
+
     /* mmal.c */
     int priv_rpigrafx_mmal_init();
     int priv_rpigrafx_mmal_finalize();
+    struct callback_context *priv_rpigrafx_mmal_context_create();
+    int priv_rpigrafx_mmal_enable_port_to_context(MMAL_PORT_T *port,
+                                                  struct callback_context *ctx);
+    MMAL_STATUS_T priv_rpigrafx_mmal_config_port(MMAL_PORT_T *port,
+                                                 const MMAL_FOURCC_T encoding,
+                                                 const int width,
+                                                 const int height);
+    int priv_rpigrafx_mmal_get_output_format(const rpigrafx_frame_config_t *fcp,
+                                             int32_t *widthp, int32_t *heightp,
+                                             MMAL_FOURCC_T *encodingp);
+    int priv_rpigrafx_mmal_set_camera_group(const int32_t camera_number,
+                                            const int32_t leader);
+    int priv_rpigrafx_mmal_set_adaptive(const rpigrafx_frame_config_t *fcp);
+    int priv_rpigrafx_mmal_set_camera_fps(const int32_t camera_number,
+                                          const double fps);
+    int priv_rpigrafx_mmal_set_slice(const rpigrafx_frame_config_t *fcp,
+                                     const int32_t slice_y,
+                                     const int32_t frame_height);
+    int priv_rpigrafx_mmal_get_camera_stc(const int32_t camera_number,
+                                          int64_t *stcp);
+    void priv_rpigrafx_mmal_capture_until(rpigrafx_frame_config_t *fcp,
+                                          const int64_t pts);
+    void priv_rpigrafx_mmal_drop_until(rpigrafx_frame_config_t *fcp,
+                                       const int64_t pts);
+
+    /* replay.c */
+    _Bool priv_rpigrafx_replay_is_used(const int32_t camera_number);
+    void priv_rpigrafx_replay_get_size(const int32_t camera_number,
+                                       int32_t *widthp, int32_t *heightp);
+    int priv_rpigrafx_replay_start(const int32_t camera_number,
+                                   MMAL_PORT_T *port);
+    int priv_rpigrafx_replay_finalize();
+
+    /* motion.c */
+    int priv_rpigrafx_motion_wait(rpigrafx_frame_config_t *fcp, int64_t *ptsp);
+    int priv_rpigrafx_motion_finalize();
+
+    /* measure.c */
+    int priv_rpigrafx_measure_update(rpigrafx_frame_config_t *fcp);
+    int priv_rpigrafx_measure_finalize();
+
+    /* overload.c */
+    int priv_rpigrafx_overload_update(rpigrafx_frame_config_t *fcp,
+                                      const unsigned backlog);
+    int priv_rpigrafx_overload_finalize();
+
+    /* present.c */
+    _Bool priv_rpigrafx_present_is_used(const rpigrafx_frame_config_t *fcp);
+    _Bool priv_rpigrafx_present_is_camera_used(const int32_t camera_number);
+    int priv_rpigrafx_present_start();
+    int priv_rpigrafx_present_queue(rpigrafx_frame_config_t *fcp);
+    int priv_rpigrafx_present_finalize();
+
+    /* copyout.c */
+    void priv_rpigrafx_copy(void *dst, const void *src, const size_t n);
 
     /* dispmanx.c */
     int priv_rpigrafx_dispmanx_init();
     int priv_rpigrafx_dispmanx_finalize();
+    /* func is called on each vsync of the display; NULL stops it. */
+    int priv_rpigrafx_dispmanx_set_vsync(void (*func)(void *arg), void *arg);
 
 #endif /* LOCAL_H */
@@ -14,10 +14,26 @@
 #include <bcm_host.h>
 #include <interface/mmal/mmal.h>
 
+#ifdef __cplusplus
+#define _Bool bool
+extern "C" {
+#endif
+
     struct callback_context {
         MMAL_STATUS_T status;
         MMAL_BUFFER_HEADER_T *header;
         _Bool is_header_passed_to_render;
+        /* Non-empty headers filtered by the connection callback. */
+        MMAL_QUEUE_T *queue;
+        /* Connection whose headers are passed through the application. */
+        struct MMAL_CONNECTION_T *conn;
+        /* Output port read by ARM only, and its pool. */
+        MMAL_PORT_T *port;
+        MMAL_POOL_T *pool;
+        /* Slot in the statistics page; -1 if there is none. */
+        int stats_index;
+        /* Previous frame queued by a callback, for delivery jitter. */
+        int64_t last_pts, last_time;
     };
 
     typedef struct {
@@ -27,11 +43,117 @@
         struct callback_context *ctx;
     } rpigrafx_frame_config_t;
 
+#define RPIGRAFX_MAX_FRAME_GROUP 4
+
+    /* Frames of several cameras paired by sensor timestamp. */
+    typedef struct {
+        int num;
+        rpigrafx_frame_config_t fcs[RPIGRAFX_MAX_FRAME_GROUP];
+        int64_t tolerance;
+        /*
+         * Pairing statistics; timestamps and skews are in us.  Groups with
+         * a frame without pts are not paired or counted.
+         */
+        uint64_t num_groups, num_dropped;
+        int64_t skew_last, skew_max, skew_sum;
+    } rpigrafx_frame_group_t;
+
+/* Each band takes an output of the video_splitter of the camera. */
+#define RPIGRAFX_MAX_SLICES 3
+
+    /* Horizontal bands of a frame, each scaled by its own isp. */
+    typedef struct {
+        int num;
+        rpigrafx_frame_config_t fcs[RPIGRAFX_MAX_SLICES];
+        int32_t ys[RPIGRAFX_MAX_SLICES + 1];
+        int next;
+        int64_t pts;
+        /* Bands captured ahead of a frame that lost them, not yet delivered. */
+        unsigned held;
+        /* Stale bands replaced to stay on one frame. */
+        uint64_t num_dropped;
+    } rpigrafx_frame_slices_t;
+
+    /* Rows [y, y + height) of a frame; data holds a width x height image. */
+    typedef struct {
+        void *data;
+        int32_t y, height;
+        int index, num;
+        int64_t pts;
+    } rpigrafx_slice_t;
+
+    /* Channels are R, G, B, or Y, U, V for I420 frames. */
+    typedef struct {
+        uint32_t num_pixels;
+        uint32_t histogram[256]; /* Luma. */
+        uint64_t sums[3];
+        double means[3];
+        double mean_luma;
+    } rpigrafx_frame_stats_t;
+
+    /*
+     * Bounds of adaptive overload control.  A lag above lag_high (us) for
+     * hold_frames frames doubles the rate divisor up to max_divisor, then
+     * halves the sensor rate from fps down to min_fps (fps <= 0: never);
+     * a lag below lag_low undoes the steps.
+     */
+    typedef struct {
+        int64_t lag_high, lag_low;
+        unsigned hold_frames;
+        unsigned max_divisor;
+        double fps, min_fps;
+    } rpigrafx_overload_config_t;
+
+    typedef struct {
+        int64_t lag; /* Smoothed, in us. */
+        unsigned divisor;
+        double fps;
+        uint64_t num_degrades, num_recovers;
+    } rpigrafx_overload_state_t;
+
+    typedef struct {
+        int64_t latency; /* From sensor to display of the last frame, in us. */
+        int64_t refresh_period; /* Measured, in us. */
+        uint64_t num_presented, num_dropped;
+    } rpigrafx_present_state_t;
+
+    /* Threads which run library code, for rpigrafx_config_thread. */
+    typedef enum {
+        RPIGRAFX_THREAD_CALLBACK, /* MMAL callbacks delivering frames. */
+        RPIGRAFX_THREAD_REPLAY,
+        RPIGRAFX_THREAD_WORKER,
+        RPIGRAFX_THREAD_PRESENT,
+        RPIGRAFX_THREAD_MAX
+    } rpigrafx_thread_t;
+
+    /*
+     * Component scaling the frames of an output.  AUTO uses vc.ril.resize
+     * for RGB24 downscales and no component for RGB24 frames of the camera
+     * size, which leaves the isp to outputs that convert encodings.
+     */
+    typedef enum {
+        RPIGRAFX_SCALER_AUTO,
+        RPIGRAFX_SCALER_ISP,
+        RPIGRAFX_SCALER_RESIZE,
+        RPIGRAFX_SCALER_NONE
+    } rpigrafx_scaler_t;
+
     typedef enum {
         RPIGRAFX_CAMERA_PORT_PREVIEW,
-        RPIGRAFX_CAMERA_PORT_CAPTURE
+        RPIGRAFX_CAMERA_PORT_CAPTURE,
+        /* Capture port armed once at rpigrafx_finish_config. */
+        RPIGRAFX_CAMERA_PORT_CAPTURE_STREAM
     } rpigrafx_camera_port_t;
 
+    /*
+     * Fills one RGB24 frame of width x height into data whose lines are pitch
+     * bytes apart.  Returns non-zero at the end of the stream.
+     */
+    typedef int (*rpigrafx_replay_read_t)(uint8_t *data, const int32_t pitch,
+                                          const int32_t width,
+                                          const int32_t height,
+                                          void *arg);
+
     int rpigrafx_init()     __attribute__((constructor));
     int rpigrafx_finalize() __attribute__((destructor));
 
@@ -40,25 +162,344 @@
                                      const MMAL_FOURCC_T encoding,
                                      const _Bool is_zero_copy_rendering,
                                      rpigrafx_frame_config_t *fcp);
+    int rpigrafx_config_camera_frame_h264(const int32_t camera_number,
+                                          const int32_t width, const int32_t height,
+                                          const uint32_t bitrate,
+                                          const uint32_t intra_period,
+                                          rpigrafx_frame_config_t *fcp);
+    /*
+     * Feed a camera from read instead of the sensor; call before
+     * rpigrafx_config_camera_frame of that camera.  fps <= 0 feeds frames
+     * as fast as the downstream accepts them.
+     */
+    int rpigrafx_config_camera_replay(const int32_t camera_number,
+                                      const int32_t width, const int32_t height,
+                                      const double fps,
+                                      rpigrafx_replay_read_t read, void *arg);
+    int rpigrafx_config_camera_replay_file(const int32_t camera_number,
+                                           const int32_t width, const int32_t height,
+                                           const double fps, const char *path);
+    int rpigrafx_config_camera_replay_memory(const int32_t camera_number,
+                                             const int32_t width, const int32_t height,
+                                             const double fps,
+                                             const void *frames,
+                                             const size_t nframes);
+    /* The port config of camera_numbers[0] is used for all cameras. */
+    int rpigrafx_config_camera_frame_group(const int32_t *camera_numbers,
+                                           const int num,
+                                           const int32_t width, const int32_t height,
+                                           const MMAL_FOURCC_T encoding,
+                                           const _Bool is_zero_copy_rendering,
+                                           const int64_t tolerance,
+                                           rpigrafx_frame_group_t *fgp);
+    /*
+     * Split width x height frames of a camera into num bands of rows which
+     * are delivered one by one by rpigrafx_capture_next_slice.
+     */
+    int rpigrafx_config_camera_frame_slices(const int32_t camera_number,
+                                            const int num,
+                                            const int32_t width, const int32_t height,
+                                            const MMAL_FOURCC_T encoding,
+                                            rpigrafx_frame_slices_t *fsp);
+    /*
+     * Second, smaller frame of the same isp pass as fcp, from isp output[1].
+     * It is read by ARM only and cannot be rendered.  The isp stalls both
+     * outputs when either is not consumed, so capture lowres_fcp as often
+     * as fcp.
+     */
+    int rpigrafx_config_camera_frame_lowres(const int32_t width,
+                                            const int32_t height,
+                                            const MMAL_FOURCC_T encoding,
+                                            const rpigrafx_frame_config_t *fcp,
+                                            rpigrafx_frame_config_t *lowres_fcp);
     int rpigrafx_config_camera_port(const int32_t camera_number,
                                     const rpigrafx_camera_port_t camera_port);
+    /*
+     * Rotate (0, 90, 180 or 270 degrees) and flip the frames of a camera
+     * in the sensor pipeline; every output of the camera is affected.
+     */
+    int rpigrafx_config_camera_orientation(const int32_t camera_number,
+                                           const int32_t rotation,
+                                           const _Bool is_hflipped,
+                                           const _Bool is_vflipped);
     int rpigrafx_config_camera_frame_render(const _Bool is_fullscreen,
                                             const int32_t x, const int32_t y,
                                             const int32_t width, const int32_t height,
                                             const int32_t layer,
                                             rpigrafx_frame_config_t *fcp);
+    /* Transform of the displayed frame only; frames read by ARM are as is. */
+    int rpigrafx_config_camera_frame_render_transform(const MMAL_DISPLAYTRANSFORM_T transform,
+                                                      rpigrafx_frame_config_t *fcp);
+    int rpigrafx_config_camera_frame_rate_divisor(const unsigned divisor,
+                                                  rpigrafx_frame_config_t *fcp);
+    /* Number of headers the application may hold on a rendered output. */
+    int rpigrafx_config_camera_frame_depth(const unsigned buffer_num,
+                                           rpigrafx_frame_config_t *fcp);
+    int rpigrafx_config_camera_frame_scaler(const rpigrafx_scaler_t scaler,
+                                            rpigrafx_frame_config_t *fcp);
+    /*
+     * Deliver frames of fcp in cached ARM memory instead of zero-copy
+     * buffers.  Reads by ARM are faster at the cost of a DMA copy per
+     * frame to and from VideoCore, which also maintains the caches.
+     */
+    int rpigrafx_config_camera_frame_cached(const _Bool is_cached,
+                                            rpigrafx_frame_config_t *fcp);
+    /*
+     * Compute rpigrafx_frame_stats_t of each captured frame, on the frame
+     * itself if width or height is 0, or else on a width x height branch.
+     */
+    int rpigrafx_config_camera_frame_stats(const int32_t width,
+                                           const int32_t height,
+                                           rpigrafx_frame_config_t *fcp);
+    /* The sensor rate is shared by all outputs of the camera. */
+    int rpigrafx_config_camera_frame_overload(const rpigrafx_overload_config_t *ocfg,
+                                              rpigrafx_frame_config_t *fcp);
+    /*
+     * Make rpigrafx_render_frame schedule frames to be displayed at their
+     * sensor pts plus delay (us), on the vsync of the display; frames
+     * which cannot make it in time are dropped.  The camera then stamps
+     * its frames with the raw STC.
+     */
+    int rpigrafx_config_camera_frame_present(const int64_t delay,
+                                             rpigrafx_frame_config_t *fcp);
+    /*
+     * Gate an output on motion measured on an extra width x height branch:
+     * blocks whose mean absolute luma difference exceeds threshold are
+     * changed, and with is_suppressing rpigrafx_capture_next_frame skips
+     * frames with fewer than min_blocks changed blocks.
+     */
+    int rpigrafx_config_camera_frame_motion_gate(const int32_t width,
+                                                 const int32_t height,
+                                                 const int32_t block_size,
+                                                 const uint32_t threshold,
+                                                 const unsigned min_blocks,
+                                                 const _Bool is_suppressing,
+                                                 rpigrafx_frame_config_t *fcp);
     int rpigrafx_finish_config();
+    int rpigrafx_get_topology(const int32_t camera_number,
+                              char *buf, const size_t size);
+
+    /*
+     * Memory which rpigrafx_finish_config would allocate for the pending
+     * configuration.  Buffers are zero-copy, so every payload is in GPU
+     * memory; arm_bytes counts the part of it mapped to ARM.
+     */
+#define RPIGRAFX_PLAN_MAX_ENTRIES 64
+    typedef struct {
+        int32_t camera_number;
+        int32_t output; /* -1 for components shared by a camera. */
+        char port[32];
+        uint32_t buffer_num, buffer_size;
+        size_t gpu_bytes, arm_bytes;
+    } rpigrafx_plan_entry_t;
+    typedef struct {
+        int num_entries;
+        rpigrafx_plan_entry_t entries[RPIGRAFX_PLAN_MAX_ENTRIES];
+        size_t gpu_total, arm_total;
+        uint32_t buffer_total;
+        /* Free relocatable GPU heap; 0 if it could not be queried. */
+        size_t gpu_available;
+    } rpigrafx_plan_t;
+
+    /*
+     * Returns non-zero if the configuration does not fit gpu_available.
+     * The configuration itself is left as is.
+     */
+    int rpigrafx_plan_config(rpigrafx_plan_t *plan);
 
     void rpigrafx_set_verbose(const int verbose);
 
+    /*
+     * Pin a class of threads to cpu (-1: any) with SCHED_FIFO priority
+     * (0: default scheduler).  Call before rpigrafx_finish_config.
+     */
+    int rpigrafx_config_thread(const rpigrafx_thread_t thread,
+                               const int cpu, const int priority);
+    /* Apply the config of a class to the calling thread. */
+    int rpigrafx_apply_thread_config(const rpigrafx_thread_t thread);
+    int rpigrafx_lock_memory();
+    /*
+     * Jitter in ns: lateness of timed wakeups of replay and present
+     * threads, and absolute deviation of frame deliveries by callbacks
+     * from the sensor frame interval.
+     */
+    int rpigrafx_get_thread_jitter(const rpigrafx_thread_t thread,
+                                   uint64_t *num_wakeupsp,
+                                   int64_t *jitter_maxp, int64_t *jitter_meanp);
+    int rpigrafx_trace_dump(const char *path);
+    /* Export frame counters to shared memory, e.g. "/rpigrafx", for rpigrafx-stats. */
+    int rpigrafx_stats_export(const char *name);
+
     int rpigrafx_capture_next_frame(rpigrafx_frame_config_t *fcp);
     void* rpigrafx_get_frame(rpigrafx_frame_config_t *fcp);
+    uint32_t rpigrafx_get_frame_length(rpigrafx_frame_config_t *fcp);
+    uint32_t rpigrafx_get_frame_flags(rpigrafx_frame_config_t *fcp);
+    int64_t rpigrafx_get_frame_pts(rpigrafx_frame_config_t *fcp);
+    int rpigrafx_get_frame_stats(rpigrafx_frame_config_t *fcp,
+                                 rpigrafx_frame_stats_t *statsp);
+    /* Change mask of the last captured frame; num_suppressedp may be NULL. */
+    int rpigrafx_get_frame_motion(rpigrafx_frame_config_t *fcp,
+                                  const uint8_t **maskp,
+                                  int32_t *mask_widthp, int32_t *mask_heightp,
+                                  uint32_t *scorep, uint64_t *num_suppressedp);
+    int rpigrafx_get_frame_overload(rpigrafx_frame_config_t *fcp,
+                                    rpigrafx_overload_state_t *statep);
+    int rpigrafx_get_frame_present(rpigrafx_frame_config_t *fcp,
+                                   rpigrafx_present_state_t *statep);
+    int rpigrafx_capture_next_frame_group(rpigrafx_frame_group_t *fgp);
+    /*
+     * A slice is valid until the same band of the next frame is captured.
+     * If a frame lost a band, delivery restarts with index 0 of a newer
+     * frame and the bands already delivered are to be discarded.
+     */
+    int rpigrafx_capture_next_slice(rpigrafx_frame_slices_t *fsp,
+                                    rpigrafx_slice_t *slicep);
     /*void* rpigrafx_get_output_buffer(rpigrafx_frame_config_t *fcp);*/
     /*void* rpigrafx_get_input_buffer(rpigrafx_frame_config_t *fcp);*/
     int rpigrafx_register_frame_pool_to_qmkl(rpigrafx_frame_config_t *fcp);
 
     int rpigrafx_render_frame(rpigrafx_frame_config_t *fcp);
 
+    /*
+     * Process frames of an output on num_workers threads.  Each frame is
+     * split into num_tiles calls of work, up to depth frames are in flight,
+     * and frames are rendered (or released) in capture order.  The output
+     * needs at least depth + 1 headers, see rpigrafx_config_camera_frame_depth.
+     */
+    typedef struct {
+        void *data;
+        uint32_t length;
+        int64_t pts;
+        uint64_t seq;
+        int tile, num_tiles;
+    } rpigrafx_work_t;
+    typedef int rpigrafx_worker_t(const rpigrafx_work_t *work, void *arg);
+    typedef struct rpigrafx_engine rpigrafx_engine_t;
+
+    rpigrafx_engine_t* rpigrafx_engine_create(rpigrafx_frame_config_t *fcp,
+                                              const int num_workers,
+                                              const int num_tiles,
+                                              const unsigned depth,
+                                              const _Bool is_rendering,
+                                              rpigrafx_worker_t *work,
+                                              void *arg);
+    int rpigrafx_engine_run(rpigrafx_engine_t *e, const uint64_t nframes);
+    int rpigrafx_engine_destroy(rpigrafx_engine_t *e);
+
+    /*
+     * Copy frames of an output into num_slots application buffers, cropped
+     * to width x height at x, y (0: to the frame edge) with rows pitch bytes
+     * apart (0: packed).  Frames of more than a few hundred KiB are split
+     * over num_threads threads, including the caller.
+     */
+    typedef struct {
+        void *data;
+        uint32_t length, flags;
+        int64_t pts;
+        uint64_t seq;
+        int32_t width, height, pitch;
+        MMAL_FOURCC_T encoding;
+        unsigned slot;
+    } rpigrafx_copied_frame_t;
+    typedef struct rpigrafx_copy_ring rpigrafx_copy_ring_t;
+
+    rpigrafx_copy_ring_t* rpigrafx_copy_ring_create(rpigrafx_frame_config_t *fcp,
+                                                    const int32_t x,
+                                                    const int32_t y,
+                                                    const int32_t width,
+                                                    const int32_t height,
+                                                    const int32_t pitch,
+                                                    const unsigned num_slots,
+                                                    const int num_threads);
+    int rpigrafx_copy_ring_destroy(rpigrafx_copy_ring_t *r);
+    /*
+     * Copy the last captured frame to a free slot and release its header.
+     * frame->data is NULL if every slot is held; the frame is dropped then.
+     */
+    int rpigrafx_copy_out_frame(rpigrafx_copy_ring_t *r,
+                                rpigrafx_copied_frame_t *frame);
+    int rpigrafx_copy_ring_release(rpigrafx_copy_ring_t *r,
+                                   const rpigrafx_copied_frame_t *frame);
+
+    /*
+     * Publish frames of the owning process to subscriber processes through
+     * a shared ring of num_slots slots.  Subscribers always get the newest
+     * frame and hold it until rpigrafx_subscriber_release.
+     */
+    typedef struct rpigrafx_publisher rpigrafx_publisher_t;
+    typedef struct rpigrafx_subscriber rpigrafx_subscriber_t;
+
+    typedef struct {
+        const void *data;
+        uint32_t length, flags;
+        int64_t pts;
+        uint64_t seq, num_missed;
+        int32_t width, height;
+        MMAL_FOURCC_T encoding;
+        unsigned slot;
+    } rpigrafx_shared_frame_t;
+
+    rpigrafx_publisher_t* rpigrafx_publisher_create(const char *path,
+                                                    const int32_t width,
+                                                    const int32_t height,
+                                                    const MMAL_FOURCC_T encoding,
+                                                    const uint32_t slot_size,
+                                                    const unsigned num_slots);
+    int rpigrafx_publisher_destroy(rpigrafx_publisher_t *pub);
+    int rpigrafx_publish_frame(rpigrafx_publisher_t *pub,
+                               rpigrafx_frame_config_t *fcp);
+    rpigrafx_subscriber_t* rpigrafx_subscriber_create(const char *path);
+    int rpigrafx_subscriber_destroy(rpigrafx_subscriber_t *sub);
+    /* frame->data is NULL on timeout; timeout_ms < 0 waits forever. */
+    int rpigrafx_subscriber_next(rpigrafx_subscriber_t *sub,
+                                 rpigrafx_shared_frame_t *frame,
+                                 const int timeout_ms);
+    int rpigrafx_subscriber_release(rpigrafx_subscriber_t *sub,
+                                    rpigrafx_shared_frame_t *frame);
+
     int rpigrafx_get_screen_size(int *widthp, int *heightp);
 
+    /*
+     * Graph of arbitrary MMAL components, used instead of the fixed topology
+     * of rpigrafx_finish_config.  Frames of tapped connections and sinks are
+     * accessed with rpigrafx_capture_next_frame and friends.
+     */
+    typedef struct rpigrafx_graph rpigrafx_graph_t;
+
+    rpigrafx_graph_t* rpigrafx_graph_create();
+    int rpigrafx_graph_destroy(rpigrafx_graph_t *g);
+    int rpigrafx_graph_add_component(rpigrafx_graph_t *g, const char *name,
+                                     const char *component);
+    int rpigrafx_graph_config_camera(rpigrafx_graph_t *g, const char *name,
+                                     const int32_t camera_number);
+    int rpigrafx_graph_config_port(rpigrafx_graph_t *g, const char *name,
+                                   const MMAL_PORT_TYPE_T type,
+                                   const unsigned index,
+                                   const MMAL_FOURCC_T encoding,
+                                   const int32_t width, const int32_t height);
+    int rpigrafx_graph_config_render(rpigrafx_graph_t *g, const char *name,
+                                     const _Bool is_fullscreen,
+                                     const int32_t x, const int32_t y,
+                                     const int32_t width, const int32_t height,
+                                     const int32_t layer);
+    int rpigrafx_graph_config_capture(rpigrafx_graph_t *g, const char *name,
+                                      const unsigned index);
+    /* fcp may be NULL; otherwise the non-tunnelled connection is tapped. */
+    int rpigrafx_graph_connect(rpigrafx_graph_t *g,
+                               const char *out_name, const unsigned out_index,
+                               const char *in_name, const unsigned in_index,
+                               const _Bool is_tunnelling,
+                               rpigrafx_frame_config_t *fcp);
+    int rpigrafx_graph_add_sink(rpigrafx_graph_t *g, const char *name,
+                                const unsigned index,
+                                rpigrafx_frame_config_t *fcp);
+    int rpigrafx_graph_load(rpigrafx_graph_t *g, const char *path,
+                            rpigrafx_frame_config_t *fcps, const int num_fcps);
+    int rpigrafx_graph_build(rpigrafx_graph_t *g);
+
+#ifdef __cplusplus
+}
+#undef _Bool
+#endif
+
 #endif /* RPIGRAFX2_H */
@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#ifndef RPIGRAFX2_HPP
+#define RPIGRAFX2_HPP
+
+/*
+ * C++11 wrapper of librpigrafx.
+ *
+ * A Frame owns the MMAL header it was captured with and returns it to the
+ * pool on destruction, so several frames of an Output may be held at once,
+ * up to the pool depth.  Pixels are accessed through views typed on the
+ * encoding of the Output; there is no virtual dispatch and no copy.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <interface/mmal/mmal.h>
+#include "rpigrafx.h"
+
+namespace rpigrafx {
+
+    class Error : public std::runtime_error {
+    public:
+        explicit Error(const std::string &what) : std::runtime_error(what) {}
+    };
+
+    inline void check(const int ret, const char *what)
+    {
+        if (ret)
+            throw Error(std::string(what) + " failed");
+    }
+
+    /* Contiguous elements, like std::span. */
+    template <typename T>
+    class Span {
+    public:
+        Span(T *data, const std::size_t size) : data_(data), size_(size) {}
+        T *data() const { return data_; }
+        std::size_t size() const { return size_; }
+        T *begin() const { return data_; }
+        T *end() const { return data_ + size_; }
+        T &operator[](const std::size_t i) const { return data_[i]; }
+
+    private:
+        T *data_;
+        std::size_t size_;
+    };
+
+    /* Rows of width elements, pitch elements apart. */
+    template <typename T>
+    class Plane {
+    public:
+        Plane(T *data, const int32_t width, const int32_t height,
+              const int32_t pitch)
+            : data_(data), width_(width), height_(height), pitch_(pitch) {}
+        int32_t width() const { return width_; }
+        int32_t height() const { return height_; }
+        int32_t pitch() const { return pitch_; }
+        T *data() const { return data_; }
+        Span<T> row(const int32_t y) const
+        {
+            return Span<T>(data_ + static_cast<std::ptrdiff_t>(y) * pitch_,
+                           width_);
+        }
+        T &operator()(const int32_t x, const int32_t y) const
+        {
+            return data_[static_cast<std::ptrdiff_t>(y) * pitch_ + x];
+        }
+
+    private:
+        T *data_;
+        int32_t width_, height_, pitch_;
+    };
+
+    struct RGB24 { uint8_t r, g, b; };
+    struct BGR24 { uint8_t b, g, r; };
+    struct RGBA32 { uint8_t r, g, b, a; };
+
+    /* Ports are configured with width aligned to 32 and height to 16. */
+    inline int32_t aligned_width(const int32_t width)
+    {
+        return (width + 31) & ~31;
+    }
+
+    inline int32_t aligned_height(const int32_t height)
+    {
+        return (height + 15) & ~15;
+    }
+
+    template <typename Pixel>
+    struct PackedImage {
+        Plane<Pixel> pixels;
+
+        static PackedImage map(uint8_t *data,
+                               const int32_t width, const int32_t height)
+        {
+            PackedImage image = {
+                Plane<Pixel>(reinterpret_cast<Pixel*>(data), width, height,
+                             aligned_width(width))
+            };
+            return image;
+        }
+    };
+
+    struct I420Image {
+        Plane<uint8_t> y, u, v;
+
+        static I420Image map(uint8_t *data,
+                             const int32_t width, const int32_t height)
+        {
+            const int32_t pitch = aligned_width(width);
+            const std::ptrdiff_t luma = static_cast<std::ptrdiff_t>(pitch)
+                                        * aligned_height(height);
+            uint8_t *u = data + luma;
+            uint8_t *v = u + luma / 4;
+            I420Image image = {
+                Plane<uint8_t>(data, width, height, pitch),
+                Plane<uint8_t>(u, width / 2, height / 2, pitch / 2),
+                Plane<uint8_t>(v, width / 2, height / 2, pitch / 2)
+            };
+            return image;
+        }
+    };
+
+    template <MMAL_FOURCC_T Encoding> struct Traits;
+    template <> struct Traits<MMAL_ENCODING_RGB24> {
+        typedef PackedImage<RGB24> Image;
+    };
+    template <> struct Traits<MMAL_ENCODING_BGR24> {
+        typedef PackedImage<BGR24> Image;
+    };
+    template <> struct Traits<MMAL_ENCODING_RGBA> {
+        typedef PackedImage<RGBA32> Image;
+    };
+    template <> struct Traits<MMAL_ENCODING_I420> {
+        typedef I420Image Image;
+    };
+
+    template <MMAL_FOURCC_T Encoding> class Output;
+
+    /* Move-only owner of a captured header. */
+    template <MMAL_FOURCC_T Encoding>
+    class Frame {
+    public:
+        typedef typename Traits<Encoding>::Image Image;
+
+        Frame() : header_(NULL), width_(0), height_(0) {}
+        Frame(Frame &&other)
+            : header_(other.header_),
+              width_(other.width_), height_(other.height_)
+        {
+            other.header_ = NULL;
+        }
+        Frame &operator=(Frame &&other)
+        {
+            if (this != &other) {
+                reset();
+                header_ = other.header_;
+                width_ = other.width_;
+                height_ = other.height_;
+                other.header_ = NULL;
+            }
+            return *this;
+        }
+        Frame(const Frame&) = delete;
+        Frame &operator=(const Frame&) = delete;
+        ~Frame() { reset(); }
+
+        explicit operator bool() const { return header_ != NULL; }
+        uint8_t *data() const { return header_->data; }
+        uint32_t length() const { return header_->length; }
+        uint32_t flags() const { return header_->flags; }
+        int64_t pts() const { return header_->pts; }
+        int32_t width() const { return width_; }
+        int32_t height() const { return height_; }
+        Image view() const { return Image::map(header_->data, width_, height_); }
+
+        void reset()
+        {
+            if (header_ != NULL)
+                mmal_buffer_header_release(header_);
+            header_ = NULL;
+        }
+
+    private:
+        friend class Output<Encoding>;
+
+        Frame(MMAL_BUFFER_HEADER_T *header,
+              const int32_t width, const int32_t height)
+            : header_(header), width_(width), height_(height) {}
+
+        MMAL_BUFFER_HEADER_T *header_;
+        int32_t width_, height_;
+    };
+
+    /* An output of a camera, valid while its Pipeline is alive. */
+    template <MMAL_FOURCC_T Encoding>
+    class Output {
+    public:
+        Output(const int32_t camera_number,
+               const int32_t width, const int32_t height,
+               const bool is_zero_copy_rendering = false)
+            : width_(width), height_(height)
+        {
+            check(rpigrafx_config_camera_frame(camera_number, width, height,
+                                               Encoding, is_zero_copy_rendering,
+                                               &fc_),
+                  "rpigrafx_config_camera_frame");
+        }
+
+        void config_render(const bool is_fullscreen,
+                           const int32_t x, const int32_t y,
+                           const int32_t width, const int32_t height,
+                           const int32_t layer)
+        {
+            check(rpigrafx_config_camera_frame_render(is_fullscreen, x, y,
+                                                      width, height, layer,
+                                                      &fc_),
+                  "rpigrafx_config_camera_frame_render");
+        }
+
+        void config_render_transform(const MMAL_DISPLAYTRANSFORM_T transform)
+        {
+            check(rpigrafx_config_camera_frame_render_transform(transform, &fc_),
+                  "rpigrafx_config_camera_frame_render_transform");
+        }
+
+        void config_rate_divisor(const unsigned divisor)
+        {
+            check(rpigrafx_config_camera_frame_rate_divisor(divisor, &fc_),
+                  "rpigrafx_config_camera_frame_rate_divisor");
+        }
+
+        void config_present(const int64_t delay)
+        {
+            check(rpigrafx_config_camera_frame_present(delay, &fc_),
+                  "rpigrafx_config_camera_frame_present");
+        }
+
+        void config_scaler(const rpigrafx_scaler_t scaler)
+        {
+            check(rpigrafx_config_camera_frame_scaler(scaler, &fc_),
+                  "rpigrafx_config_camera_frame_scaler");
+        }
+
+        void config_cached(const bool is_cached)
+        {
+            check(rpigrafx_config_camera_frame_cached(is_cached, &fc_),
+                  "rpigrafx_config_camera_frame_cached");
+        }
+
+        /* The header is taken from the library; the Frame owns it. */
+        Frame<Encoding> capture()
+        {
+            MMAL_BUFFER_HEADER_T *header = NULL;
+
+            check(rpigrafx_capture_next_frame(&fc_),
+                  "rpigrafx_capture_next_frame");
+            header = fc_.ctx->header;
+            fc_.ctx->header = NULL;
+            return Frame<Encoding>(header, width_, height_);
+        }
+
+        /* Pass the frame to video_render, which returns it to the pool. */
+        void render(Frame<Encoding> &&frame)
+        {
+            fc_.ctx->header = frame.header_;
+            fc_.ctx->is_header_passed_to_render = 0;
+            frame.header_ = NULL;
+            check(rpigrafx_render_frame(&fc_), "rpigrafx_render_frame");
+        }
+
+        rpigrafx_frame_config_t *config() { return &fc_; }
+        int32_t width() const { return width_; }
+        int32_t height() const { return height_; }
+
+    private:
+        rpigrafx_frame_config_t fc_;
+        int32_t width_, height_;
+    };
+
+    /* Initializes the library for its lifetime. */
+    class Pipeline {
+    public:
+        Pipeline() { check(rpigrafx_init(), "rpigrafx_init"); }
+        Pipeline(const Pipeline&) = delete;
+        Pipeline &operator=(const Pipeline&) = delete;
+        ~Pipeline() { rpigrafx_finalize(); }
+
+        template <MMAL_FOURCC_T Encoding>
+        Output<Encoding> add_output(const int32_t camera_number,
+                                    const int32_t width, const int32_t height,
+                                    const bool is_zero_copy_rendering = false)
+        {
+            return Output<Encoding>(camera_number, width, height,
+                                    is_zero_copy_rendering);
+        }
+
+        void config_camera_port(const int32_t camera_number,
+                                const rpigrafx_camera_port_t port)
+        {
+            check(rpigrafx_config_camera_port(camera_number, port),
+                  "rpigrafx_config_camera_port");
+        }
+
+        void finish_config()
+        {
+            check(rpigrafx_finish_config(), "rpigrafx_finish_config");
+        }
+    };
+
+} /* namespace rpigrafx */
+
+#endif /* RPIGRAFX2_HPP */
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+    /* Layout of the rpigrafx_stats_export() page, shared with rpigrafx-stats. */
+
+#define PRIV_RPIGRAFX_STATS_MAGIC "RPGSTA01"
+#define PRIV_RPIGRAFX_STATS_MAX_OUTPUTS 32
+
+    struct priv_rpigrafx_stats_output {
+        int32_t camera_number, output;
+        uint32_t num_captured, num_rendered;
+        uint32_t num_empty, num_dropped;
+        /* Lengths of conn->queue and conn->pool->queue at the last capture. */
+        uint32_t queue_length, pool_length;
+        uint32_t num_errors, last_status;
+    };
+
+    struct priv_rpigrafx_stats_page {
+        char magic[8];
+        int32_t pid;
+        uint32_t num_outputs;
+        struct priv_rpigrafx_stats_output outputs[PRIV_RPIGRAFX_STATS_MAX_OUTPUTS];
+    };
+
+#endif /* STATS_H */
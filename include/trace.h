@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+    /* Layout of rpigrafx_trace_dump() files, shared with the decoder. */
+
+#define PRIV_RPIGRAFX_TRACE_MAGIC "RPGTRC01"
+
+    enum priv_rpigrafx_trace_id {
+        TRACE_CAPTURE_RELEASE = 1,
+        TRACE_CAPTURE_SEND,
+        TRACE_CAPTURE_GOT,
+        TRACE_CAPTURE_EMPTY,
+        TRACE_RENDER_SEND,
+        TRACE_CALLBACK_CONTROL,
+        TRACE_CALLBACK_CONN,
+        TRACE_STREAM_QUEUE,
+        TRACE_STREAM_EMPTY,
+        TRACE_DECIMATE_PASS,
+        TRACE_DECIMATE_DROP,
+        TRACE_PORT_OUTPUT,
+        TRACE_REPLAY_SEND,
+        TRACE_OVERLOAD_DEGRADE,
+        TRACE_OVERLOAD_RECOVER,
+        TRACE_PRESENT_DROP,
+        TRACE_ID_MAX
+    };
+
+    /* Written to the dump file as is. */
+    struct priv_rpigrafx_trace_event {
+        uint64_t timestamp; /* CLOCK_MONOTONIC in ns. */
+        uint64_t ptr;       /* Header, or connection/port for callbacks. */
+        uint32_t length;
+        uint32_t flags;
+        uint16_t id;
+        uint16_t thread;
+        uint32_t reserved;
+    };
+
+#endif /* TRACE_H */
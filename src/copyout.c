@@ -0,0 +1,406 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * A copy ring owns num_slots buffers of the application.  Each captured
+ * frame is cropped and repacked into a free slot and its header goes back
+ * to the pool at once, so a slow consumer holding slots never holds the
+ * headers the isp needs.  Frames arriving while every slot is held are
+ * dropped.  Large frames are split into bands of rows copied by helper
+ * threads.
+ */
+
+/* Frames smaller than this are copied by the caller only. */
+#define COPY_SPLIT_MIN (256 * 1024)
+#define COPY_PREFETCH  256
+
+struct copy_plane {
+    const uint8_t *src;
+    uint8_t *dst;
+    int32_t src_pitch, dst_pitch;
+    int32_t row_bytes, rows;
+};
+
+struct copy_slot {
+    uint8_t *data;
+    uint32_t is_held;
+};
+
+struct copy_helper {
+    struct rpigrafx_copy_ring *r;
+    int part;
+    sem_t start_sem;
+    pthread_t thread;
+};
+
+struct rpigrafx_copy_ring {
+    rpigrafx_frame_config_t *fcp;
+    int32_t x, y, width, height, pitch;
+    int32_t src_width, src_height;
+    MMAL_FOURCC_T encoding;
+    int bpp;
+    uint32_t slot_size;
+    unsigned num_slots, next_slot;
+    struct copy_slot *slots;
+    uint64_t seq;
+
+    /* The job being copied, read by helpers between start and done. */
+    struct copy_plane planes[3];
+    int num_planes, num_parts;
+    struct copy_helper *helpers;
+    int num_helpers;
+    sem_t done_sem;
+    int stop;
+};
+
+/*
+ * Copy n bytes, prefetching the source ahead.  On x86 the destination is
+ * written around the cache when aligned; the consumer reads it later.
+ */
+void priv_rpigrafx_copy(void *dst, const void *src, const size_t n)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    size_t i = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; i + 64 <= n; i += 64) {
+        const uint8x16_t a = vld1q_u8(s + i), b = vld1q_u8(s + i + 16);
+        const uint8x16_t c = vld1q_u8(s + i + 32), e = vld1q_u8(s + i + 48);
+
+        __builtin_prefetch(s + i + COPY_PREFETCH);
+        vst1q_u8(d + i, a);
+        vst1q_u8(d + i + 16, b);
+        vst1q_u8(d + i + 32, c);
+        vst1q_u8(d + i + 48, e);
+    }
+#elif defined(__SSE2__)
+    if (((uintptr_t) d & 15) == 0) {
+        for (; i + 64 <= n; i += 64) {
+            const __m128i a = _mm_loadu_si128((const __m128i*) (s + i));
+            const __m128i b = _mm_loadu_si128((const __m128i*) (s + i + 16));
+            const __m128i c = _mm_loadu_si128((const __m128i*) (s + i + 32));
+            const __m128i e = _mm_loadu_si128((const __m128i*) (s + i + 48));
+
+            __builtin_prefetch(s + i + COPY_PREFETCH);
+            _mm_stream_si128((__m128i*) (d + i), a);
+            _mm_stream_si128((__m128i*) (d + i + 16), b);
+            _mm_stream_si128((__m128i*) (d + i + 32), c);
+            _mm_stream_si128((__m128i*) (d + i + 48), e);
+        }
+        _mm_sfence();
+    }
+#endif
+    memcpy(d + i, s + i, n - i);
+}
+
+static void copy_part(struct rpigrafx_copy_ring *r, const int part)
+{
+    int k;
+
+    for (k = 0; k < r->num_planes; k ++) {
+        const struct copy_plane *p = &r->planes[k];
+        const int32_t y0 = p->rows * part / r->num_parts;
+        const int32_t y1 = p->rows * (part + 1) / r->num_parts;
+        int32_t y;
+
+        if (p->src_pitch == p->dst_pitch && p->row_bytes == p->src_pitch) {
+            priv_rpigrafx_copy(p->dst + (size_t) y0 * p->dst_pitch,
+                               p->src + (size_t) y0 * p->src_pitch,
+                               (size_t) (y1 - y0) * p->row_bytes);
+            continue;
+        }
+        for (y = y0; y < y1; y ++)
+            priv_rpigrafx_copy(p->dst + (size_t) y * p->dst_pitch,
+                               p->src + (size_t) y * p->src_pitch,
+                               p->row_bytes);
+    }
+}
+
+static void *helper_thread(void *arg)
+{
+    struct copy_helper *h = arg;
+    struct rpigrafx_copy_ring *r = h->r;
+
+    rpigrafx_apply_thread_config(RPIGRAFX_THREAD_WORKER);
+
+    for (;;) {
+        while (sem_wait(&h->start_sem) && errno == EINTR)
+            ;
+        if (__atomic_load_n(&r->stop, __ATOMIC_RELAXED))
+            break;
+        copy_part(r, h->part);
+        sem_post(&r->done_sem);
+    }
+    return NULL;
+}
+
+rpigrafx_copy_ring_t* rpigrafx_copy_ring_create(rpigrafx_frame_config_t *fcp,
+                                                const int32_t x, const int32_t y,
+                                                const int32_t width,
+                                                const int32_t height,
+                                                const int32_t pitch,
+                                                const unsigned num_slots,
+                                                const int num_threads)
+{
+    struct rpigrafx_copy_ring *r = NULL;
+    unsigned k;
+    int reti;
+
+    if (num_slots == 0 || num_threads <= 0) {
+        print_error("Invalid copy ring config: %u slots, %d threads",
+                    num_slots, num_threads);
+        goto err;
+    }
+
+    r = calloc(1, sizeof(*r));
+    if (r == NULL) {
+        print_error("Failed to allocate copy ring");
+        goto err;
+    }
+    sem_init(&r->done_sem, 0, 0);
+    r->fcp = fcp;
+    if (priv_rpigrafx_mmal_get_output_format(fcp, &r->src_width, &r->src_height,
+                                             &r->encoding))
+        goto err;
+
+    switch (r->encoding) {
+        case MMAL_ENCODING_RGB24:
+        case MMAL_ENCODING_BGR24:
+            r->bpp = 3;
+            break;
+        case MMAL_ENCODING_RGBA:
+        case MMAL_ENCODING_BGRA:
+            r->bpp = 4;
+            break;
+        case MMAL_ENCODING_I420:
+            r->bpp = 1;
+            break;
+        default:
+            print_error("Copying encoding 0x%08x is not supported", r->encoding);
+            goto err;
+    }
+
+    /* A zero width or height copies the whole frame. */
+    r->x = x;
+    r->y = y;
+    r->width = width > 0 ? width : r->src_width - x;
+    r->height = height > 0 ? height : r->src_height - y;
+    if (x < 0 || y < 0 || r->width <= 0 || r->height <= 0
+            || x + r->width > r->src_width || y + r->height > r->src_height) {
+        print_error("Crop %dx%d+%d+%d exceeds frame of %dx%d",
+                    r->width, r->height, x, y, r->src_width, r->src_height);
+        goto err;
+    }
+    if (r->encoding == MMAL_ENCODING_I420
+            && ((x | y | r->width | r->height) & 1)) {
+        print_error("Crop of I420 frames must be even");
+        goto err;
+    }
+    r->pitch = pitch > 0 ? pitch : r->width * r->bpp;
+    if (r->pitch < r->width * r->bpp) {
+        print_error("Pitch(%d) is smaller than a row of %d bytes",
+                    r->pitch, r->width * r->bpp);
+        goto err;
+    }
+    r->slot_size = r->encoding == MMAL_ENCODING_I420
+                   ? r->pitch * r->height * 3 / 2
+                   : r->pitch * r->height;
+
+    r->slots = calloc(num_slots, sizeof(*r->slots));
+    if (r->slots == NULL) {
+        print_error("Failed to allocate copy ring slots");
+        goto err;
+    }
+    r->num_slots = num_slots;
+    for (k = 0; k < num_slots; k ++) {
+        if (posix_memalign((void**) &r->slots[k].data, 64, r->slot_size)) {
+            print_error("Failed to allocate copy ring slot %u", k);
+            goto err;
+        }
+    }
+
+    r->helpers = calloc(num_threads, sizeof(*r->helpers));
+    if (r->helpers == NULL) {
+        print_error("Failed to allocate copy helpers");
+        goto err;
+    }
+    for (r->num_helpers = 0; r->num_helpers < num_threads - 1; r->num_helpers ++) {
+        struct copy_helper *h = &r->helpers[r->num_helpers];
+
+        h->r = r;
+        h->part = r->num_helpers + 1;
+        sem_init(&h->start_sem, 0, 0);
+        reti = pthread_create(&h->thread, NULL, helper_thread, h);
+        if (reti != 0) {
+            print_error("Creating copy helper %d failed: %s",
+                        r->num_helpers, strerror(reti));
+            sem_destroy(&h->start_sem);
+            goto err;
+        }
+    }
+
+    return r;
+
+err:
+    if (r != NULL)
+        rpigrafx_copy_ring_destroy(r);
+    return NULL;
+}
+
+int rpigrafx_copy_ring_destroy(rpigrafx_copy_ring_t *r)
+{
+    unsigned k;
+    int i;
+
+    __atomic_store_n(&r->stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < r->num_helpers; i ++)
+        sem_post(&r->helpers[i].start_sem);
+    for (i = 0; i < r->num_helpers; i ++) {
+        pthread_join(r->helpers[i].thread, NULL);
+        sem_destroy(&r->helpers[i].start_sem);
+    }
+    sem_destroy(&r->done_sem);
+    for (k = 0; k < r->num_slots; k ++)
+        free(r->slots[k].data);
+    free(r->slots);
+    free(r->helpers);
+    free(r);
+    return 0;
+}
+
+/* Fill r->planes for the source frame at data. */
+static void setup_planes(struct rpigrafx_copy_ring *r, const uint8_t *data,
+                         uint8_t *dst)
+{
+    const int32_t src_pitch = VCOS_ALIGN_UP(r->src_width, 32);
+    struct copy_plane *p = r->planes;
+
+    p[0].src = data + (size_t) r->y * src_pitch * r->bpp + r->x * r->bpp;
+    p[0].dst = dst;
+    p[0].src_pitch = src_pitch * r->bpp;
+    p[0].dst_pitch = r->pitch;
+    p[0].row_bytes = r->width * r->bpp;
+    p[0].rows = r->height;
+    r->num_planes = 1;
+
+    if (r->encoding == MMAL_ENCODING_I420) {
+        const size_t luma = (size_t) src_pitch * VCOS_ALIGN_UP(r->src_height, 16);
+        const uint8_t *u = data + luma;
+        const uint8_t *v = u + luma / 4;
+        const size_t off = (size_t) r->y / 2 * (src_pitch / 2) + r->x / 2;
+        const size_t dst_chroma = (size_t) r->pitch / 2 * r->height / 2;
+        int c;
+
+        for (c = 1; c <= 2; c ++) {
+            p[c].src = (c == 1 ? u : v) + off;
+            p[c].dst = dst + (size_t) r->pitch * r->height + (c - 1) * dst_chroma;
+            p[c].src_pitch = src_pitch / 2;
+            p[c].dst_pitch = r->pitch / 2;
+            p[c].row_bytes = r->width / 2;
+            p[c].rows = r->height / 2;
+        }
+        r->num_planes = 3;
+    }
+}
+
+int rpigrafx_copy_out_frame(rpigrafx_copy_ring_t *r,
+                            rpigrafx_copied_frame_t *frame)
+{
+    struct callback_context *ctx = r->fcp->ctx;
+    const uint8_t *data = rpigrafx_get_frame(r->fcp);
+    struct copy_slot *s = NULL;
+    unsigned k, idx = 0;
+    int i;
+    int ret = 0;
+
+    frame->data = NULL;
+    if (data == NULL) {
+        ret = 1;
+        goto end;
+    }
+
+    for (k = 0; k < r->num_slots; k ++) {
+        uint32_t expected = 0;
+
+        idx = (r->next_slot + k) % r->num_slots;
+        s = &r->slots[idx];
+        if (__atomic_compare_exchange_n(&s->is_held, &expected, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (k == r->num_slots) {
+        /* Every slot is held by the consumer. */
+        STATS_ADD(ctx, num_dropped, 1);
+        goto release;
+    }
+    r->next_slot = idx + 1;
+
+    setup_planes(r, data, s->data);
+    r->num_parts = r->slot_size >= COPY_SPLIT_MIN ? r->num_helpers + 1 : 1;
+    for (i = 1; i < r->num_parts; i ++)
+        sem_post(&r->helpers[i - 1].start_sem);
+    copy_part(r, 0);
+    for (i = 1; i < r->num_parts; i ++)
+        while (sem_wait(&r->done_sem) && errno == EINTR)
+            ;
+
+    frame->data = s->data;
+    frame->length = r->slot_size;
+    frame->width = r->width;
+    frame->height = r->height;
+    frame->pitch = r->pitch;
+    frame->encoding = r->encoding;
+    frame->pts = ctx->header->pts;
+    frame->flags = ctx->header->flags;
+    frame->seq = r->seq ++;
+    frame->slot = idx;
+
+release:
+    /* The frame is ours now; give the header back to the isp. */
+    if (!ctx->is_header_passed_to_render) {
+        TRACE_HEADER(1, TRACE_CAPTURE_RELEASE, ctx->header);
+        mmal_buffer_header_release(ctx->header);
+    }
+    ctx->header = NULL;
+    ctx->is_header_passed_to_render = 0;
+
+end:
+    return ret;
+}
+
+int rpigrafx_copy_ring_release(rpigrafx_copy_ring_t *r,
+                               const rpigrafx_copied_frame_t *frame)
+{
+    int ret = 0;
+
+    if (frame->data == NULL || frame->slot >= r->num_slots
+            || r->slots[frame->slot].data != frame->data) {
+        print_error("Frame is not a slot of the copy ring");
+        ret = 1;
+        goto end;
+    }
+    __atomic_store_n(&r->slots[frame->slot].is_held, 0, __ATOMIC_RELEASE);
+
+end:
+    return ret;
+}
@@ -13,6 +13,8 @@
 
 static DISPMANX_DISPLAY_HANDLE_T display = 0;
 static DISPMANX_MODEINFO_T info;
+static void (*vsync_func)(void *arg) = NULL;
+static void *vsync_arg = NULL;
 
 int priv_rpigrafx_dispmanx_init()
 {
@@ -75,3 +77,30 @@ int rpigrafx_get_screen_size(int *widthp, int *heightp)
 
     return ret;
 }
+
+static void callback_vsync(DISPMANX_UPDATE_HANDLE_T update, void *arg)
+{
+    (void) update;
+    (void) arg;
+    vsync_func(vsync_arg);
+}
+
+int priv_rpigrafx_dispmanx_set_vsync(void (*func)(void *arg), void *arg)
+{
+    int status = 0;
+    int ret = 0;
+
+    vsync_func = func;
+    vsync_arg = arg;
+    status = vc_dispmanx_vsync_callback(display,
+                                        func == NULL ? NULL : callback_vsync,
+                                        NULL);
+    if (status != DISPMANX_SUCCESS) {
+        print_error("Failed to set vsync callback: 0x%08x", status);
+        ret = 1;
+        goto end;
+    }
+
+end:
+    return ret;
+}
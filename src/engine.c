@@ -0,0 +1,357 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <interface/mmal/mmal.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * The engine keeps up to depth frames of an output in flight.  The caller
+ * thread captures frames, detaches their headers from the output context
+ * and pushes one item per tile to the work ring.  Idle workers take the
+ * next item whichever frame it belongs to, so tiles of a slow frame are
+ * spread over all cores.  The worker finishing the last tile of a frame
+ * pushes it to the done ring, and the caller renders or releases frames in
+ * capture order.
+ *
+ * Both rings are bounded MPMC queues with a sequence number per cell;
+ * semaphores only put idle threads to sleep.
+ */
+
+struct ring_cell {
+    uint32_t seq;
+    void *data;
+};
+
+struct ring {
+    struct ring_cell *cells;
+    uint32_t mask;
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+};
+
+struct engine_job {
+    MMAL_BUFFER_HEADER_T *header;
+    uint64_t seq;
+    int remaining;
+    _Bool is_done, has_error;
+};
+
+struct engine_item {
+    struct engine_job *job;
+    int tile;
+};
+
+struct rpigrafx_engine {
+    rpigrafx_frame_config_t *fcp;
+    rpigrafx_worker_t *work;
+    void *arg;
+    int num_workers, num_tiles;
+    unsigned depth;
+    _Bool is_rendering;
+
+    struct engine_job *jobs;
+    struct engine_item *items;
+    struct ring work_ring, done_ring;
+    sem_t work_sem, done_sem;
+    pthread_t *threads;
+    int num_threads;
+    int stop;
+};
+
+static int ring_init(struct ring *r, const unsigned min_size)
+{
+    uint32_t size = 1, i;
+
+    while (size < min_size)
+        size <<= 1;
+    r->cells = calloc(size, sizeof(*r->cells));
+    if (r->cells == NULL)
+        return 1;
+    for (i = 0; i < size; i ++)
+        r->cells[i].seq = i;
+    r->mask = size - 1;
+    r->head = r->tail = 0;
+    return 0;
+}
+
+static int ring_push(struct ring *r, void *data)
+{
+    uint32_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    struct ring_cell *cell = NULL;
+
+    for (;;) {
+        int32_t diff;
+
+        cell = &r->cells[pos & r->mask];
+        diff = (int32_t) (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0)
+            return 1;
+        else
+            pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    }
+    cell->data = data;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void *ring_pop(struct ring *r)
+{
+    uint32_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    struct ring_cell *cell = NULL;
+    void *data = NULL;
+
+    for (;;) {
+        int32_t diff;
+
+        cell = &r->cells[pos & r->mask];
+        diff = (int32_t) (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0)
+            return NULL;
+        else
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    }
+    data = cell->data;
+    __atomic_store_n(&cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+    return data;
+}
+
+static void *worker_thread(void *arg)
+{
+    struct rpigrafx_engine *e = arg;
+
+    rpigrafx_apply_thread_config(RPIGRAFX_THREAD_WORKER);
+
+    for (;;) {
+        struct engine_item *item = NULL;
+        struct engine_job *job = NULL;
+        rpigrafx_work_t w;
+
+        while (sem_wait(&e->work_sem) && errno == EINTR)
+            ;
+        if (__atomic_load_n(&e->stop, __ATOMIC_RELAXED))
+            break;
+        item = ring_pop(&e->work_ring);
+        if (item == NULL)
+            continue;
+        job = item->job;
+
+        w.data = job->header->data;
+        w.length = job->header->length;
+        w.pts = job->header->pts;
+        w.seq = job->seq;
+        w.tile = item->tile;
+        w.num_tiles = e->num_tiles;
+        if (e->work(&w, e->arg))
+            __atomic_store_n(&job->has_error, !0, __ATOMIC_RELAXED);
+
+        if (__atomic_sub_fetch(&job->remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+            ring_push(&e->done_ring, job);
+            sem_post(&e->done_sem);
+        }
+    }
+    return NULL;
+}
+
+rpigrafx_engine_t* rpigrafx_engine_create(rpigrafx_frame_config_t *fcp,
+                                          const int num_workers,
+                                          const int num_tiles,
+                                          const unsigned depth,
+                                          const _Bool is_rendering,
+                                          rpigrafx_worker_t *work, void *arg)
+{
+    struct rpigrafx_engine *e = NULL;
+    int reti;
+
+    if (num_workers <= 0 || num_tiles <= 0 || depth == 0) {
+        print_error("Invalid engine config: %d workers, %d tiles, depth %u",
+                    num_workers, num_tiles, depth);
+        goto err;
+    }
+
+    e = calloc(1, sizeof(*e));
+    if (e == NULL) {
+        print_error("Failed to allocate engine");
+        goto err;
+    }
+    e->fcp = fcp;
+    e->work = work;
+    e->arg = arg;
+    e->num_workers = num_workers;
+    e->num_tiles = num_tiles;
+    e->depth = depth;
+    e->is_rendering = is_rendering;
+    sem_init(&e->work_sem, 0, 0);
+    sem_init(&e->done_sem, 0, 0);
+
+    e->jobs = calloc(depth, sizeof(*e->jobs));
+    e->items = calloc(depth * num_tiles, sizeof(*e->items));
+    e->threads = calloc(num_workers, sizeof(*e->threads));
+    if (e->jobs == NULL || e->items == NULL || e->threads == NULL
+            || ring_init(&e->work_ring, depth * num_tiles)
+            || ring_init(&e->done_ring, depth)) {
+        print_error("Failed to allocate engine rings");
+        goto err;
+    }
+
+    for (e->num_threads = 0; e->num_threads < num_workers; e->num_threads ++) {
+        reti = pthread_create(&e->threads[e->num_threads], NULL,
+                              worker_thread, e);
+        if (reti != 0) {
+            print_error("Creating worker thread %d failed: %s",
+                        e->num_threads, strerror(reti));
+            goto err;
+        }
+    }
+
+    return e;
+
+err:
+    if (e != NULL)
+        rpigrafx_engine_destroy(e);
+    return NULL;
+}
+
+int rpigrafx_engine_destroy(rpigrafx_engine_t *e)
+{
+    int i;
+
+    __atomic_store_n(&e->stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < e->num_threads; i ++)
+        sem_post(&e->work_sem);
+    for (i = 0; i < e->num_threads; i ++)
+        pthread_join(e->threads[i], NULL);
+    sem_destroy(&e->work_sem);
+    sem_destroy(&e->done_sem);
+    free(e->work_ring.cells);
+    free(e->done_ring.cells);
+    free(e->threads);
+    free(e->items);
+    free(e->jobs);
+    free(e);
+    return 0;
+}
+
+/*
+ * Workers push to the done ring concurrently, so the semaphore may be
+ * posted for a later cell before an earlier one is published; the head
+ * cell is then published shortly and popping is retried.
+ */
+static struct engine_job *wait_done_job(struct rpigrafx_engine *e)
+{
+    struct engine_job *job = NULL;
+
+    while (sem_wait(&e->done_sem) && errno == EINTR)
+        ;
+    while ((job = ring_pop(&e->done_ring)) == NULL)
+        sched_yield();
+    return job;
+}
+
+static int finish_job(struct rpigrafx_engine *e, struct engine_job *job)
+{
+    struct callback_context *ctx = e->fcp->ctx;
+    int ret = 0;
+
+    if (e->is_rendering) {
+        ctx->header = job->header;
+        ctx->is_header_passed_to_render = 0;
+        /* The header is left to us if rendering failed. */
+        if ((ret = rpigrafx_render_frame(e->fcp))) {
+            mmal_buffer_header_release(ctx->header);
+            ctx->header = NULL;
+        }
+    } else
+        mmal_buffer_header_release(job->header);
+    job->header = NULL;
+    return ret;
+}
+
+int rpigrafx_engine_run(rpigrafx_engine_t *e, const uint64_t nframes)
+{
+    struct callback_context *ctx = e->fcp->ctx;
+    uint64_t next_capture = 0, next_finish = 0;
+    _Bool has_error = 0;
+    int t;
+    int ret = 0;
+
+    while (next_finish < nframes) {
+        struct engine_job *job = NULL;
+
+        while (next_capture < nframes && next_capture - next_finish < e->depth) {
+            const unsigned k = next_capture % e->depth;
+
+            if ((ret = rpigrafx_capture_next_frame(e->fcp)))
+                goto end;
+            /* The job owns the header from now on. */
+            job = &e->jobs[k];
+            job->header = ctx->header;
+            job->seq = next_capture ++;
+            job->remaining = e->num_tiles;
+            job->is_done = job->has_error = 0;
+            ctx->header = NULL;
+            for (t = 0; t < e->num_tiles; t ++) {
+                struct engine_item *item = &e->items[k * e->num_tiles + t];
+
+                item->job = job;
+                item->tile = t;
+                ring_push(&e->work_ring, item);
+                sem_post(&e->work_sem);
+            }
+        }
+
+        job = wait_done_job(e);
+        job->is_done = !0;
+
+        /* Restore capture order. */
+        for (;;) {
+            job = &e->jobs[next_finish % e->depth];
+            if (next_finish == next_capture || !job->is_done)
+                break;
+            has_error |= job->has_error;
+            ret = finish_job(e, job);
+            next_finish ++;
+            if (ret)
+                goto end;
+        }
+    }
+
+end:
+    if (ret != 0) {
+        /* Wait for frames still in workers and return their headers. */
+        while (next_finish < next_capture) {
+            struct engine_job *job = &e->jobs[next_finish % e->depth];
+
+            while (!job->is_done)
+                wait_done_job(e)->is_done = !0;
+            if (job->header != NULL)
+                mmal_buffer_header_release(job->header);
+            job->header = NULL;
+            next_finish ++;
+        }
+    } else if (has_error) {
+        print_error("Worker failed on some frames");
+        ret = 1;
+    }
+    return ret;
+}
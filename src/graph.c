@@ -0,0 +1,835 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <interface/mmal/mmal.h>
+#include <interface/mmal/util/mmal_util.h>
+#include <interface/mmal/util/mmal_util_params.h>
+#include <interface/mmal/util/mmal_connection.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * A graph is an arbitrary set of MMAL components and connections, built in
+ * the same order as rpigrafx_finish_config builds the fixed topology:
+ * create components, commit port formats, enable components, then create
+ * and enable connections downstream first.
+ *
+ * Port formats which are not configured explicitly are negotiated:
+ * an input port takes the format of the output port connected to it, and
+ * an output port takes the format of input[0] of its own component.
+ */
+
+#define GRAPH_MAX_COMPONENTS  16
+#define GRAPH_MAX_PORTS       48
+#define GRAPH_MAX_CONNECTIONS 32
+#define GRAPH_MAX_SINKS       8
+#define GRAPH_NAME_LEN        32
+
+struct graph_component {
+    char name[GRAPH_NAME_LEN];
+    char component[64];
+    int32_t camera_number;
+    _Bool has_region;
+    MMAL_DISPLAYREGION_T region;
+    MMAL_COMPONENT_T *cp;
+};
+
+struct graph_port {
+    int component;
+    MMAL_PORT_TYPE_T type;
+    unsigned index;
+    _Bool is_explicit;
+    MMAL_FOURCC_T encoding;
+    int32_t width, height;
+    _Bool is_capture;
+    _Bool is_committed;
+};
+
+struct graph_connection {
+    int out, in;
+    unsigned out_index, in_index;
+    _Bool is_tunnelling;
+    struct callback_context *ctx;
+    MMAL_CONNECTION_T *conn;
+};
+
+struct graph_sink {
+    int component;
+    unsigned index;
+    struct callback_context *ctx;
+};
+
+struct rpigrafx_graph {
+    struct graph_component components[GRAPH_MAX_COMPONENTS];
+    int num_components;
+    struct graph_port ports[GRAPH_MAX_PORTS];
+    int num_ports;
+    struct graph_connection connections[GRAPH_MAX_CONNECTIONS];
+    int num_connections;
+    struct graph_sink sinks[GRAPH_MAX_SINKS];
+    int num_sinks;
+    _Bool is_built;
+};
+
+static void callback_control(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *header)
+{
+    TRACE(2, TRACE_CALLBACK_CONTROL, port);
+    mmal_buffer_header_release(header);
+}
+
+static void callback_conn(MMAL_CONNECTION_T *conn)
+{
+    THREAD_ENTER(RPIGRAFX_THREAD_CALLBACK);
+    TRACE(2, TRACE_CALLBACK_CONN, conn);
+}
+
+/* Used on non-tunnelled connections which are not tapped by the application. */
+static void callback_conn_forward(MMAL_CONNECTION_T *conn)
+{
+    MMAL_BUFFER_HEADER_T *header = NULL;
+
+    THREAD_ENTER(RPIGRAFX_THREAD_CALLBACK);
+
+    while ((header = mmal_queue_get(conn->queue)) != NULL)
+        if (mmal_port_send_buffer(conn->in, header) != MMAL_SUCCESS)
+            mmal_buffer_header_release(header);
+    while ((header = mmal_queue_get(conn->pool->queue)) != NULL) {
+        if (mmal_port_send_buffer(conn->out, header) != MMAL_SUCCESS) {
+            mmal_queue_put_back(conn->pool->queue, header);
+            break;
+        }
+    }
+}
+
+static int find_component(const rpigrafx_graph_t *g, const char *name)
+{
+    int i;
+
+    for (i = 0; i < g->num_components; i ++)
+        if (!strcmp(g->components[i].name, name))
+            return i;
+    print_error("Unknown component %s", name);
+    return -1;
+}
+
+static struct graph_port *find_port(rpigrafx_graph_t *g, const int component,
+                                    const MMAL_PORT_TYPE_T type,
+                                    const unsigned index)
+{
+    struct graph_port *p = NULL;
+    int i;
+
+    for (i = 0; i < g->num_ports; i ++) {
+        p = &g->ports[i];
+        if (p->component == component && p->type == type && p->index == index)
+            return p;
+    }
+    if (g->num_ports == GRAPH_MAX_PORTS) {
+        print_error("Too many ports(%d) in graph", g->num_ports);
+        return NULL;
+    }
+    p = &g->ports[g->num_ports ++];
+    memset(p, 0, sizeof(*p));
+    p->component = component;
+    p->type = type;
+    p->index = index;
+    return p;
+}
+
+static MMAL_PORT_T *get_port(rpigrafx_graph_t *g, const struct graph_port *p)
+{
+    MMAL_PORT_T *port = mmal_util_get_port(g->components[p->component].cp,
+                                           p->type, p->index);
+
+    if (port == NULL)
+        print_error("Getting %s port %u of %s failed",
+                    p->type == MMAL_PORT_TYPE_INPUT ? "input" : "output",
+                    p->index, g->components[p->component].name);
+    return port;
+}
+
+rpigrafx_graph_t* rpigrafx_graph_create()
+{
+    rpigrafx_graph_t *g = calloc(1, sizeof(*g));
+
+    if (g == NULL)
+        print_error("Failed to allocate graph");
+    return g;
+}
+
+int rpigrafx_graph_add_component(rpigrafx_graph_t *g, const char *name,
+                                 const char *component)
+{
+    struct graph_component *c = NULL;
+    int ret = 0;
+
+    if (g->num_components == GRAPH_MAX_COMPONENTS) {
+        print_error("Too many components(%d) in graph", g->num_components);
+        ret = 1;
+        goto end;
+    }
+    if (strlen(name) >= GRAPH_NAME_LEN
+            || strlen(component) >= sizeof(c->component)) {
+        print_error("Name of component %s is too long", name);
+        ret = 1;
+        goto end;
+    }
+
+    c = &g->components[g->num_components ++];
+    memset(c, 0, sizeof(*c));
+    strcpy(c->name, name);
+    strcpy(c->component, component);
+    c->camera_number = -1;
+
+end:
+    return ret;
+}
+
+int rpigrafx_graph_config_camera(rpigrafx_graph_t *g, const char *name,
+                                 const int32_t camera_number)
+{
+    const int i = find_component(g, name);
+
+    if (i < 0)
+        return 1;
+    g->components[i].camera_number = camera_number;
+    return 0;
+}
+
+int rpigrafx_graph_config_port(rpigrafx_graph_t *g, const char *name,
+                               const MMAL_PORT_TYPE_T type,
+                               const unsigned index,
+                               const MMAL_FOURCC_T encoding,
+                               const int32_t width, const int32_t height)
+{
+    const int i = find_component(g, name);
+    struct graph_port *p = NULL;
+
+    if (i < 0 || (p = find_port(g, i, type, index)) == NULL)
+        return 1;
+    p->is_explicit = !0;
+    p->encoding = encoding;
+    p->width = width;
+    p->height = height;
+    return 0;
+}
+
+int rpigrafx_graph_config_render(rpigrafx_graph_t *g, const char *name,
+                                 const _Bool is_fullscreen,
+                                 const int32_t x, const int32_t y,
+                                 const int32_t width, const int32_t height,
+                                 const int32_t layer)
+{
+    const int i = find_component(g, name);
+    MMAL_DISPLAYREGION_T region = {
+        .fullscreen = is_fullscreen,
+        .dest_rect = {
+            .x = x, .y = y,
+            .width = width, .height = height
+        },
+        .layer = layer,
+        .set =   MMAL_DISPLAY_SET_FULLSCREEN
+               | MMAL_DISPLAY_SET_DEST_RECT
+               | MMAL_DISPLAY_SET_LAYER
+    };
+
+    if (i < 0)
+        return 1;
+    g->components[i].has_region = !0;
+    memcpy(&g->components[i].region, &region, sizeof(region));
+    return 0;
+}
+
+int rpigrafx_graph_config_capture(rpigrafx_graph_t *g, const char *name,
+                                  const unsigned index)
+{
+    const int i = find_component(g, name);
+    struct graph_port *p = NULL;
+
+    if (i < 0 || (p = find_port(g, i, MMAL_PORT_TYPE_OUTPUT, index)) == NULL)
+        return 1;
+    p->is_capture = !0;
+    return 0;
+}
+
+int rpigrafx_graph_connect(rpigrafx_graph_t *g,
+                           const char *out_name, const unsigned out_index,
+                           const char *in_name, const unsigned in_index,
+                           const _Bool is_tunnelling,
+                           rpigrafx_frame_config_t *fcp)
+{
+    struct graph_connection *c = NULL;
+    const int out = find_component(g, out_name);
+    const int in = find_component(g, in_name);
+    int ret = 0;
+
+    if (out < 0 || in < 0) {
+        ret = 1;
+        goto end;
+    }
+    if (g->num_connections == GRAPH_MAX_CONNECTIONS) {
+        print_error("Too many connections(%d) in graph", g->num_connections);
+        ret = 1;
+        goto end;
+    }
+    if (is_tunnelling && fcp != NULL) {
+        print_error("Tunnelled connection %s:%u-%s:%u cannot be tapped",
+                    out_name, out_index, in_name, in_index);
+        ret = 1;
+        goto end;
+    }
+
+    c = &g->connections[g->num_connections];
+    memset(c, 0, sizeof(*c));
+    c->out = out;
+    c->out_index = out_index;
+    c->in = in;
+    c->in_index = in_index;
+    c->is_tunnelling = is_tunnelling;
+    if (fcp != NULL) {
+        c->ctx = priv_rpigrafx_mmal_context_create();
+        if (c->ctx == NULL) {
+            ret = 1;
+            goto end;
+        }
+        fcp->camera_number = -1;
+        fcp->splitter_output_port_index = g->num_connections;
+        fcp->is_zero_copy_rendering = !0;
+        fcp->ctx = c->ctx;
+    }
+    g->num_connections ++;
+
+end:
+    return ret;
+}
+
+int rpigrafx_graph_add_sink(rpigrafx_graph_t *g, const char *name,
+                            const unsigned index,
+                            rpigrafx_frame_config_t *fcp)
+{
+    struct graph_sink *s = NULL;
+    const int i = find_component(g, name);
+    int ret = 0;
+
+    if (i < 0) {
+        ret = 1;
+        goto end;
+    }
+    if (g->num_sinks == GRAPH_MAX_SINKS) {
+        print_error("Too many sinks(%d) in graph", g->num_sinks);
+        ret = 1;
+        goto end;
+    }
+
+    s = &g->sinks[g->num_sinks];
+    s->component = i;
+    s->index = index;
+    s->ctx = priv_rpigrafx_mmal_context_create();
+    if (s->ctx == NULL) {
+        ret = 1;
+        goto end;
+    }
+    fcp->camera_number = -1;
+    fcp->splitter_output_port_index = GRAPH_MAX_CONNECTIONS + g->num_sinks;
+    fcp->is_zero_copy_rendering = 0;
+    fcp->ctx = s->ctx;
+    g->num_sinks ++;
+
+end:
+    return ret;
+}
+
+static int commit_port(rpigrafx_graph_t *g, struct graph_port *p,
+                       MMAL_PORT_T *from)
+{
+    MMAL_PORT_T *port = get_port(g, p);
+    MMAL_STATUS_T status;
+    int ret = 0;
+
+    if (port == NULL) {
+        ret = 1;
+        goto end;
+    }
+
+    if (from == NULL)
+        status = priv_rpigrafx_mmal_config_port(port, p->encoding,
+                                                p->width, p->height);
+    else if ((status = mmal_format_full_copy(port->format, from->format))
+             == MMAL_SUCCESS)
+        status = mmal_port_format_commit(port);
+    if (status != MMAL_SUCCESS) {
+        print_error("Setting format of %s failed: 0x%08x", port->name, status);
+        ret = 1;
+        goto end;
+    }
+
+    status = mmal_port_parameter_set_boolean(port,
+                                             MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+    if (status != MMAL_SUCCESS) {
+        print_error("Setting zero-copy on %s failed: 0x%08x",
+                    port->name, status);
+        ret = 1;
+        goto end;
+    }
+    p->is_committed = !0;
+
+end:
+    return ret;
+}
+
+/* Returns 1 if a format was negotiated, 0 if nothing changed, -1 on error. */
+static int negotiate_output(rpigrafx_graph_t *g, const int component,
+                            const unsigned index)
+{
+    struct graph_port *p = find_port(g, component, MMAL_PORT_TYPE_OUTPUT, index);
+    struct graph_port *in = NULL;
+
+    if (p == NULL)
+        return -1;
+    if (p->is_committed)
+        return 0;
+    in = find_port(g, component, MMAL_PORT_TYPE_INPUT, 0);
+    if (in == NULL)
+        return -1;
+    if (!in->is_committed)
+        return 0;
+    return commit_port(g, p, g->components[component].cp->input[0]) ? -1 : 1;
+}
+
+static int negotiate_formats(rpigrafx_graph_t *g)
+{
+    int i, k, r;
+    _Bool changed;
+    int ret = 0;
+
+    do {
+        changed = 0;
+        for (i = 0; i < g->num_connections; i ++) {
+            struct graph_connection *c = &g->connections[i];
+            struct graph_port *out = NULL, *in = NULL;
+
+            if ((r = negotiate_output(g, c->out, c->out_index)) < 0) {
+                ret = 1;
+                goto end;
+            }
+            changed |= r;
+
+            out = find_port(g, c->out, MMAL_PORT_TYPE_OUTPUT, c->out_index);
+            in = find_port(g, c->in, MMAL_PORT_TYPE_INPUT, c->in_index);
+            if (out == NULL || in == NULL) {
+                ret = 1;
+                goto end;
+            }
+            if (in->is_committed || !out->is_committed)
+                continue;
+            if (commit_port(g, in, g->components[c->out].cp->output[c->out_index])) {
+                ret = 1;
+                goto end;
+            }
+            changed = !0;
+        }
+        for (i = 0; i < g->num_sinks; i ++) {
+            if ((r = negotiate_output(g, g->sinks[i].component,
+                                      g->sinks[i].index)) < 0) {
+                ret = 1;
+                goto end;
+            }
+            changed |= r;
+        }
+    } while (changed);
+
+    for (k = 0; k < g->num_ports; k ++) {
+        if (!g->ports[k].is_committed) {
+            print_error("Cannot negotiate format of %s port %u of %s",
+                        g->ports[k].type == MMAL_PORT_TYPE_INPUT
+                        ? "input" : "output",
+                        g->ports[k].index,
+                        g->components[g->ports[k].component].name);
+            ret = 1;
+            goto end;
+        }
+    }
+
+end:
+    return ret;
+}
+
+static int setup_component(struct graph_component *c)
+{
+    MMAL_PORT_T *control = NULL;
+    MMAL_STATUS_T status;
+    int ret = 0;
+
+    status = mmal_component_create(c->component, &c->cp);
+    if (status != MMAL_SUCCESS) {
+        print_error("Creating %s component %s failed: 0x%08x",
+                    c->component, c->name, status);
+        c->cp = NULL;
+        ret = 1;
+        goto end;
+    }
+
+    control = mmal_util_get_port(c->cp, MMAL_PORT_TYPE_CONTROL, 0);
+    if (control == NULL) {
+        print_error("Getting control port of %s failed", c->name);
+        ret = 1;
+        goto end;
+    }
+    if (c->camera_number >= 0) {
+        status = mmal_port_parameter_set_int32(control, MMAL_PARAMETER_CAMERA_NUM,
+                                               c->camera_number);
+        if (status != MMAL_SUCCESS) {
+            print_error("Setting camera_num of %s failed: 0x%08x",
+                        c->name, status);
+            ret = 1;
+            goto end;
+        }
+    }
+    status = mmal_port_enable(control, callback_control);
+    if (status != MMAL_SUCCESS) {
+        print_error("Enabling control port of %s failed: 0x%08x",
+                    c->name, status);
+        ret = 1;
+        goto end;
+    }
+
+end:
+    return ret;
+}
+
+int rpigrafx_graph_build(rpigrafx_graph_t *g)
+{
+    int i;
+    MMAL_STATUS_T status;
+    int ret = 0;
+
+    if (g->is_built) {
+        print_error("Graph is already built");
+        ret = 1;
+        goto end;
+    }
+
+    for (i = 0; i < g->num_components; i ++)
+        if ((ret = setup_component(&g->components[i])))
+            goto end;
+
+    for (i = 0; i < g->num_ports; i ++)
+        if (g->ports[i].is_explicit)
+            if ((ret = commit_port(g, &g->ports[i], NULL)))
+                goto end;
+    for (i = 0; i < g->num_connections; i ++) {
+        if (find_port(g, g->connections[i].out, MMAL_PORT_TYPE_OUTPUT,
+                      g->connections[i].out_index) == NULL
+                || find_port(g, g->connections[i].in, MMAL_PORT_TYPE_INPUT,
+                             g->connections[i].in_index) == NULL) {
+            ret = 1;
+            goto end;
+        }
+    }
+    if ((ret = negotiate_formats(g)))
+        goto end;
+
+    for (i = 0; i < g->num_components; i ++) {
+        struct graph_component *c = &g->components[i];
+
+        if (c->has_region) {
+            status = mmal_util_set_display_region(c->cp->input[0], &c->region);
+            if (status != MMAL_SUCCESS) {
+                print_error("Setting region of %s failed: 0x%08x",
+                            c->name, status);
+                ret = 1;
+                goto end;
+            }
+        }
+        status = mmal_component_enable(c->cp);
+        if (status != MMAL_SUCCESS) {
+            print_error("Enabling component %s failed: 0x%08x",
+                        c->name, status);
+            ret = 1;
+            goto end;
+        }
+    }
+
+    for (i = 0; i < g->num_connections; i ++) {
+        struct graph_connection *c = &g->connections[i];
+
+        status = mmal_connection_create(&c->conn,
+                                        g->components[c->out].cp->output[c->out_index],
+                                        g->components[c->in].cp->input[c->in_index],
+                                        c->is_tunnelling
+                                        ? MMAL_CONNECTION_FLAG_TUNNELLING : 0);
+        if (status != MMAL_SUCCESS) {
+            print_error("Connecting %s:%u and %s:%u failed: 0x%08x",
+                        g->components[c->out].name, c->out_index,
+                        g->components[c->in].name, c->in_index, status);
+            c->conn = NULL;
+            ret = 1;
+            goto end;
+        }
+        if (c->ctx != NULL) {
+            c->ctx->conn = c->conn;
+            c->conn->callback = callback_conn;
+        } else if (!c->is_tunnelling)
+            c->conn->callback = callback_conn_forward;
+        else
+            c->conn->callback = callback_conn;
+    }
+    /* Enable downstream connections first. */
+    for (i = g->num_connections - 1; i >= 0; i --) {
+        status = mmal_connection_enable(g->connections[i].conn);
+        if (status != MMAL_SUCCESS) {
+            print_error("Enabling connection %s failed: 0x%08x",
+                        g->connections[i].conn->name, status);
+            ret = 1;
+            goto end;
+        }
+    }
+    for (i = 0; i < g->num_connections; i ++) {
+        MMAL_CONNECTION_T *conn = g->connections[i].conn;
+        MMAL_BUFFER_HEADER_T *header = NULL;
+
+        if (g->connections[i].is_tunnelling)
+            continue;
+        while ((header = mmal_queue_get(conn->pool->queue)) != NULL) {
+            status = mmal_port_send_buffer(conn->out, header);
+            if (status != MMAL_SUCCESS) {
+                print_error("Sending pool buffer to %s failed: 0x%08x",
+                            conn->name, status);
+                ret = 1;
+                goto end;
+            }
+        }
+    }
+
+    for (i = 0; i < g->num_sinks; i ++) {
+        MMAL_PORT_T *port = g->components[g->sinks[i].component].cp->output[g->sinks[i].index];
+
+        port->buffer_num = MMAL_MAX(port->buffer_num_recommended,
+                                    port->buffer_num_min);
+        port->buffer_size = MMAL_MAX(port->buffer_size_recommended,
+                                     port->buffer_size_min);
+        if ((ret = priv_rpigrafx_mmal_enable_port_to_context(port,
+                                                             g->sinks[i].ctx)))
+            goto end;
+    }
+
+    for (i = 0; i < g->num_ports; i ++) {
+        MMAL_PORT_T *port = NULL;
+
+        if (!g->ports[i].is_capture)
+            continue;
+        if ((port = get_port(g, &g->ports[i])) == NULL) {
+            ret = 1;
+            goto end;
+        }
+        status = mmal_port_parameter_set_boolean(port, MMAL_PARAMETER_CAPTURE,
+                                                 MMAL_TRUE);
+        if (status != MMAL_SUCCESS) {
+            print_error("Starting capture on %s failed: 0x%08x",
+                        port->name, status);
+            ret = 1;
+            goto end;
+        }
+    }
+
+    g->is_built = !0;
+
+end:
+    return ret;
+}
+
+int rpigrafx_graph_destroy(rpigrafx_graph_t *g)
+{
+    int i;
+    int ret = 0;
+
+    for (i = 0; i < g->num_sinks; i ++) {
+        struct callback_context *ctx = g->sinks[i].ctx;
+
+        if (ctx->port != NULL)
+            mmal_port_disable(ctx->port);
+        if (ctx->pool != NULL)
+            mmal_port_pool_destroy(ctx->port, ctx->pool);
+        if (ctx->queue != NULL)
+            mmal_queue_destroy(ctx->queue);
+        free(ctx);
+    }
+    for (i = 0; i < g->num_connections; i ++) {
+        if (g->connections[i].conn != NULL
+                && mmal_connection_destroy(g->connections[i].conn) != MMAL_SUCCESS) {
+            print_error("Destroying connection %d failed", i);
+            ret = 1;
+        }
+        free(g->connections[i].ctx);
+    }
+    for (i = 0; i < g->num_components; i ++) {
+        MMAL_COMPONENT_T *cp = g->components[i].cp;
+
+        if (cp == NULL)
+            continue;
+        mmal_component_disable(cp);
+        if (mmal_component_destroy(cp) != MMAL_SUCCESS) {
+            print_error("Destroying component %s failed",
+                        g->components[i].name);
+            ret = 1;
+        }
+    }
+    free(g);
+
+    return ret;
+}
+
+static int parse_encoding(const char *s, MMAL_FOURCC_T *encodingp)
+{
+    static const struct {
+        const char *name;
+        MMAL_FOURCC_T encoding;
+    } encodings[] = {
+        {"rgb24",  MMAL_ENCODING_RGB24},
+        {"bgr24",  MMAL_ENCODING_BGR24},
+        {"rgba",   MMAL_ENCODING_RGBA},
+        {"i420",   MMAL_ENCODING_I420},
+        {"opaque", MMAL_ENCODING_OPAQUE},
+        {"h264",   MMAL_ENCODING_H264},
+    };
+    unsigned k;
+
+    for (k = 0; k < sizeof(encodings) / sizeof(encodings[0]); k ++) {
+        if (!strcasecmp(s, encodings[k].name)) {
+            *encodingp = encodings[k].encoding;
+            return 0;
+        }
+    }
+    /* Otherwise a literal FourCC such as RGB3. */
+    if (strlen(s) != 4)
+        return 1;
+    *encodingp = MMAL_FOURCC(s[0], s[1], s[2], s[3]);
+    return 0;
+}
+
+static int parse_endpoint(const char *s, char *name, unsigned *indexp)
+{
+    return sscanf(s, "%31[^:]:%u", name, indexp) != 2;
+}
+
+/*
+ * Load a graph description.  One statement per line; '#' starts a comment.
+ *
+ *   component NAME MMAL_COMPONENT [camera=N]
+ *   port NAME input|output INDEX ENCODING WIDTH HEIGHT
+ *   render NAME FULLSCREEN X Y WIDTH HEIGHT LAYER
+ *   capture NAME INDEX
+ *   connect NAME:INDEX NAME:INDEX tunnel|forward|tap=N
+ *   sink NAME:INDEX N
+ *
+ * ENCODING is rgb24, bgr24, rgba, i420, opaque, h264 or a FourCC.
+ * tap=N and sink bind the frame config fcps[N].
+ */
+int rpigrafx_graph_load(rpigrafx_graph_t *g, const char *path,
+                        rpigrafx_frame_config_t *fcps, const int num_fcps)
+{
+    FILE *fp = NULL;
+    char line[256];
+    int lineno = 0;
+    int ret = 0;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        print_error("Opening graph file %s failed", path);
+        ret = 1;
+        goto end;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char cmd[16], a[GRAPH_NAME_LEN], b[64], c[GRAPH_NAME_LEN], d[16];
+        char name_a[GRAPH_NAME_LEN], name_b[GRAPH_NAME_LEN];
+        unsigned index_a, index_b;
+        int32_t x, y, w, h, layer, n;
+        char *p = strchr(line, '#');
+        int nf;
+
+        lineno ++;
+        if (p != NULL)
+            *p = '\0';
+        if (sscanf(line, "%15s", cmd) != 1)
+            continue;
+
+        if (!strcmp(cmd, "component")) {
+            nf = sscanf(line, "%*s %31s %63s %15s", a, b, d);
+            if (nf < 2 || rpigrafx_graph_add_component(g, a, b))
+                goto syntax;
+            if (nf == 3) {
+                if (sscanf(d, "camera=%d", &n) != 1
+                        || rpigrafx_graph_config_camera(g, a, n))
+                    goto syntax;
+            }
+        } else if (!strcmp(cmd, "port")) {
+            MMAL_FOURCC_T encoding;
+
+            if (sscanf(line, "%*s %31s %31s %u %15s %d %d",
+                       a, c, &index_a, d, &w, &h) != 6
+                    || parse_encoding(d, &encoding)
+                    || (strcmp(c, "input") && strcmp(c, "output"))
+                    || rpigrafx_graph_config_port(g, a,
+                                                  strcmp(c, "input")
+                                                  ? MMAL_PORT_TYPE_OUTPUT
+                                                  : MMAL_PORT_TYPE_INPUT,
+                                                  index_a, encoding, w, h))
+                goto syntax;
+        } else if (!strcmp(cmd, "render")) {
+            if (sscanf(line, "%*s %31s %d %d %d %d %d %d",
+                       a, &n, &x, &y, &w, &h, &layer) != 7
+                    || rpigrafx_graph_config_render(g, a, !!n, x, y, w, h,
+                                                    layer))
+                goto syntax;
+        } else if (!strcmp(cmd, "capture")) {
+            if (sscanf(line, "%*s %31s %u", a, &index_a) != 2
+                    || rpigrafx_graph_config_capture(g, a, index_a))
+                goto syntax;
+        } else if (!strcmp(cmd, "connect")) {
+            rpigrafx_frame_config_t *fcp = NULL;
+
+            if (sscanf(line, "%*s %31s %31s %15s", a, c, d) != 3
+                    || parse_endpoint(a, name_a, &index_a)
+                    || parse_endpoint(c, name_b, &index_b))
+                goto syntax;
+            if (sscanf(d, "tap=%d", &n) == 1) {
+                if (n < 0 || n >= num_fcps)
+                    goto syntax;
+                fcp = &fcps[n];
+            } else if (strcmp(d, "tunnel") && strcmp(d, "forward"))
+                goto syntax;
+            if (rpigrafx_graph_connect(g, name_a, index_a, name_b, index_b,
+                                       !strcmp(d, "tunnel"), fcp))
+                goto syntax;
+        } else if (!strcmp(cmd, "sink")) {
+            if (sscanf(line, "%*s %31s %d", a, &n) != 2
+                    || parse_endpoint(a, name_a, &index_a)
+                    || n < 0 || n >= num_fcps
+                    || rpigrafx_graph_add_sink(g, name_a, index_a, &fcps[n]))
+                goto syntax;
+        } else
+            goto syntax;
+        continue;
+
+syntax:
+        print_error("%s:%d: Invalid statement", path, lineno);
+        ret = 1;
+        goto end;
+    }
+
+end:
+    if (fp != NULL)
+        fclose(fp);
+    return ret;
+}
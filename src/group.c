@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include "rpigrafx.h"
+#include "local.h"
+
+int rpigrafx_config_camera_frame_group(const int32_t *camera_numbers,
+                                       const int num,
+                                       const int32_t width, const int32_t height,
+                                       const MMAL_FOURCC_T encoding,
+                                       const _Bool is_zero_copy_rendering,
+                                       const int64_t tolerance,
+                                       rpigrafx_frame_group_t *fgp)
+{
+    int k;
+    int ret = 0;
+
+    if (num < 2 || num > RPIGRAFX_MAX_FRAME_GROUP) {
+        print_error("Number of cameras(%d) in a group must be 2 to %d",
+                    num, RPIGRAFX_MAX_FRAME_GROUP);
+        ret = 1;
+        goto end;
+    }
+    if (tolerance < 0) {
+        print_error("Tolerance(%lld) must not be negative",
+                    (long long) tolerance);
+        ret = 1;
+        goto end;
+    }
+
+    fgp->num = num;
+    fgp->tolerance = tolerance;
+    fgp->num_groups = fgp->num_dropped = 0;
+    fgp->skew_last = fgp->skew_max = fgp->skew_sum = 0;
+    for (k = 0; k < num; k ++) {
+        if ((ret = rpigrafx_config_camera_frame(camera_numbers[k],
+                                                width, height, encoding,
+                                                is_zero_copy_rendering,
+                                                &fgp->fcs[k])))
+            goto end;
+        if ((ret = priv_rpigrafx_mmal_set_camera_group(camera_numbers[k],
+                                                       camera_numbers[0])))
+            goto end;
+    }
+
+end:
+    return ret;
+}
+
+/*
+ * Capture one frame from every camera, then keep replacing frames older
+ * than the newest one by more than the tolerance until all of them are
+ * within the tolerance.  Frames without a pts cannot be paired and are
+ * returned as captured.
+ */
+int rpigrafx_capture_next_frame_group(rpigrafx_frame_group_t *fgp)
+{
+    int64_t pts[RPIGRAFX_MAX_FRAME_GROUP];
+    int64_t newest, oldest;
+    int k;
+    _Bool is_paired, is_unknown = 0;
+    int ret = 0;
+
+    for (k = 0; k < fgp->num; k ++) {
+        if ((ret = rpigrafx_capture_next_frame(&fgp->fcs[k])))
+            goto end;
+        pts[k] = rpigrafx_get_frame_pts(&fgp->fcs[k]);
+        is_unknown |= pts[k] == MMAL_TIME_UNKNOWN;
+    }
+    if (is_unknown)
+        goto end;
+
+    do {
+        newest = pts[0];
+        for (k = 1; k < fgp->num; k ++)
+            newest = pts[k] > newest ? pts[k] : newest;
+
+        is_paired = !0;
+        for (k = 0; k < fgp->num; k ++) {
+            if (newest - pts[k] <= fgp->tolerance)
+                continue;
+            is_paired = 0;
+            fgp->num_dropped ++;
+            if ((ret = rpigrafx_capture_next_frame(&fgp->fcs[k])))
+                goto end;
+            pts[k] = rpigrafx_get_frame_pts(&fgp->fcs[k]);
+            if (pts[k] == MMAL_TIME_UNKNOWN)
+                goto end;
+        }
+    } while (!is_paired);
+
+    oldest = pts[0];
+    for (k = 1; k < fgp->num; k ++)
+        oldest = pts[k] < oldest ? pts[k] : oldest;
+    fgp->num_groups ++;
+    fgp->skew_last = newest - oldest;
+    fgp->skew_sum += fgp->skew_last;
+    if (fgp->skew_last > fgp->skew_max)
+        fgp->skew_max = fgp->skew_last;
+
+end:
+    return ret;
+}
@@ -48,6 +48,11 @@ int rpigrafx_finalize()
     if (priv_rpigrafx_called.main != 1)
         goto end;
 
+    ret = priv_rpigrafx_present_finalize();
+    if (ret) {
+        print_error("Finalizing presentation failed: 0x%08x", ret);
+        goto end;
+    }
     ret = priv_rpigrafx_dispmanx_finalize();
     if (ret) {
         print_error("Finalizing mmal failed: 0x%08x", ret);
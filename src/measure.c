@@ -0,0 +1,375 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <string.h>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * Per-frame statistics of an output: a luma histogram and channel sums.
+ * They are computed either on the frame itself or, to touch fewer bytes,
+ * on an extra RGB24 branch of the same camera captured alongside it:
+ * video_splitter [k] --- [0] isp [0] --- ARM
+ */
+
+static struct measures_config {
+    _Bool is_used;
+    _Bool has_branch;
+    rpigrafx_frame_config_t fc;
+    int32_t width, height;
+    MMAL_FOURCC_T encoding;
+    rpigrafx_frame_stats_t stats;
+} measures_config[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
+
+/* ITU-R BT.601 luma in 8-bit fixed point. */
+#define LUMA(r, g, b) ((77 * (r) + 150 * (g) + 29 * (b)) >> 8)
+
+/*
+ * Four sub-histograms break the store-to-load dependency between
+ * neighbouring pixels of the same value.
+ */
+static void histogram_row(uint32_t hist[4][256], const uint8_t *y,
+                          const int32_t width)
+{
+    int32_t x;
+
+    for (x = 0; x + 4 <= width; x += 4) {
+        hist[0][y[x + 0]] ++;
+        hist[1][y[x + 1]] ++;
+        hist[2][y[x + 2]] ++;
+        hist[3][y[x + 3]] ++;
+    }
+    for (; x < width; x ++)
+        hist[0][y[x]] ++;
+}
+
+/*
+ * Luma and byte-channel sums of the leading pixels of a 24-bit row,
+ * deinterleaved in vector registers.  Returns the number of pixels done;
+ * n is at most 2048, so 32-bit lanes do not overflow.
+ */
+static int32_t measure_rgb24_row(uint8_t *luma, uint64_t sums[3],
+                                 const uint8_t *q, const int32_t n,
+                                 const int ri)
+{
+    int32_t x = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const uint8x8_t w0 = vdup_n_u8(ri == 0 ? 77 : 29);
+    const uint8x8_t w1 = vdup_n_u8(150);
+    const uint8x8_t w2 = vdup_n_u8(ri == 0 ? 29 : 77);
+    uint32x4_t acc[3] = { vdupq_n_u32(0), vdupq_n_u32(0), vdupq_n_u32(0) };
+    int c;
+
+    for (; x + 16 <= n; x += 16) {
+        const uint8x16x3_t v = vld3q_u8(q + x * 3);
+        uint16x8_t lo, hi;
+
+        lo = vmull_u8(vget_low_u8(v.val[0]), w0);
+        lo = vmlal_u8(lo, vget_low_u8(v.val[1]), w1);
+        lo = vmlal_u8(lo, vget_low_u8(v.val[2]), w2);
+        hi = vmull_u8(vget_high_u8(v.val[0]), w0);
+        hi = vmlal_u8(hi, vget_high_u8(v.val[1]), w1);
+        hi = vmlal_u8(hi, vget_high_u8(v.val[2]), w2);
+        vst1q_u8(luma + x, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+        for (c = 0; c < 3; c ++)
+            acc[c] = vpadalq_u16(acc[c], vpaddlq_u8(v.val[c]));
+    }
+    for (c = 0; c < 3; c ++)
+        sums[c] += (uint64_t) vgetq_lane_u32(acc[c], 0) + vgetq_lane_u32(acc[c], 1)
+                 + vgetq_lane_u32(acc[c], 2) + vgetq_lane_u32(acc[c], 3);
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i w0 = _mm_set1_epi16(ri == 0 ? 77 : 29);
+    const __m128i w1 = _mm_set1_epi16(150);
+    const __m128i w2 = _mm_set1_epi16(ri == 0 ? 29 : 77);
+    __m128i acc[3] = { zero, zero, zero };
+    int c, k, l;
+
+    for (; x + 32 <= n; x += 32) {
+        __m128i v[6], t[6];
+
+        for (k = 0; k < 6; k ++)
+            v[k] = _mm_loadu_si128((const __m128i*) (q + x * 3 + k * 16));
+        /*
+         * Five rounds of byte interleaving of the first and second halves
+         * turn 32 packed pixels into two registers per channel.
+         */
+        for (l = 0; l < 5; l ++) {
+            for (k = 0; k < 3; k ++) {
+                t[k * 2 + 0] = _mm_unpacklo_epi8(v[k], v[k + 3]);
+                t[k * 2 + 1] = _mm_unpackhi_epi8(v[k], v[k + 3]);
+            }
+            memcpy(v, t, sizeof(v));
+        }
+        /* v[0..1], v[2..3] and v[4..5] now hold channels 0, 1 and 2. */
+        for (k = 0; k < 2; k ++) {
+            const __m128i c0 = v[k], c1 = v[2 + k], c2 = v[4 + k];
+            __m128i lo, hi;
+
+            lo = _mm_add_epi16(_mm_add_epi16(
+                    _mm_mullo_epi16(_mm_unpacklo_epi8(c0, zero), w0),
+                    _mm_mullo_epi16(_mm_unpacklo_epi8(c1, zero), w1)),
+                    _mm_mullo_epi16(_mm_unpacklo_epi8(c2, zero), w2));
+            hi = _mm_add_epi16(_mm_add_epi16(
+                    _mm_mullo_epi16(_mm_unpackhi_epi8(c0, zero), w0),
+                    _mm_mullo_epi16(_mm_unpackhi_epi8(c1, zero), w1)),
+                    _mm_mullo_epi16(_mm_unpackhi_epi8(c2, zero), w2));
+            _mm_storeu_si128((__m128i*) (luma + x + k * 16),
+                             _mm_packus_epi16(_mm_srli_epi16(lo, 8),
+                                              _mm_srli_epi16(hi, 8)));
+            acc[0] = _mm_add_epi64(acc[0], _mm_sad_epu8(c0, zero));
+            acc[1] = _mm_add_epi64(acc[1], _mm_sad_epu8(c1, zero));
+            acc[2] = _mm_add_epi64(acc[2], _mm_sad_epu8(c2, zero));
+        }
+    }
+    for (c = 0; c < 3; c ++)
+        sums[c] += (uint32_t) _mm_cvtsi128_si32(acc[c])
+                 + (uint32_t) _mm_cvtsi128_si32(_mm_srli_si128(acc[c], 8));
+#else
+    (void) luma;
+    (void) sums;
+    (void) q;
+    (void) n;
+    (void) ri;
+#endif
+    return x;
+}
+
+static void measure_rgb(rpigrafx_frame_stats_t *st, uint32_t hist[4][256],
+                        const uint8_t *data, const int32_t pitch,
+                        const int32_t width, const int32_t height,
+                        const int bpp, const int ri, const int bi)
+{
+    uint8_t luma[2048];
+    int32_t x, y, x0;
+
+    for (y = 0; y < height; y ++) {
+        const uint8_t *p = data + (size_t) y * pitch;
+
+        for (x0 = 0; x0 < width; x0 += sizeof(luma)) {
+            const int32_t n = MMAL_MIN(width - x0, (int32_t) sizeof(luma));
+            const uint8_t *q = p + x0 * bpp;
+
+            x = 0;
+            if (bpp == 3) {
+                uint64_t sums[3] = { 0, 0, 0 };
+
+                x = measure_rgb24_row(luma, sums, q, n, ri);
+                st->sums[0] += sums[ri];
+                st->sums[1] += sums[1];
+                st->sums[2] += sums[bi];
+            }
+            for (; x < n; x ++) {
+                const uint8_t *px = q + x * bpp;
+
+                luma[x] = LUMA(px[ri], px[1], px[bi]);
+                st->sums[0] += px[ri];
+                st->sums[1] += px[1];
+                st->sums[2] += px[bi];
+            }
+            histogram_row(hist, luma, n);
+        }
+    }
+}
+
+static void measure_i420(rpigrafx_frame_stats_t *st, uint32_t hist[4][256],
+                         const uint8_t *data, const int32_t pitch,
+                         const int32_t aligned_height,
+                         const int32_t width, const int32_t height)
+{
+    const uint8_t *u = data + (size_t) pitch * aligned_height;
+    const uint8_t *v = u + (size_t) pitch / 2 * aligned_height / 2;
+    int32_t x, y;
+
+    for (y = 0; y < height; y ++) {
+        const uint8_t *p = data + (size_t) y * pitch;
+        uint32_t sum = 0;
+
+        histogram_row(hist, p, width);
+        for (x = 0; x < width; x ++)
+            sum += p[x];
+        st->sums[0] += sum;
+    }
+    /* Chroma planes are subsampled; scale to per-pixel sums. */
+    for (y = 0; y < height / 2; y ++) {
+        uint32_t su = 0, sv = 0;
+
+        for (x = 0; x < width / 2; x ++) {
+            su += u[(size_t) y * pitch / 2 + x];
+            sv += v[(size_t) y * pitch / 2 + x];
+        }
+        st->sums[1] += su * 4;
+        st->sums[2] += sv * 4;
+    }
+}
+
+static int measure(struct measures_config *mcfg, rpigrafx_frame_config_t *fcp)
+{
+    rpigrafx_frame_stats_t *st = &mcfg->stats;
+    const uint8_t *data = rpigrafx_get_frame(fcp);
+    const int32_t pitch = (mcfg->width + 31) & ~31;
+    const int32_t aligned_height = (mcfg->height + 15) & ~15;
+    uint32_t hist[4][256];
+    int c, i;
+    int ret = 0;
+
+    if (data == NULL) {
+        ret = 1;
+        goto end;
+    }
+
+    memset(st, 0, sizeof(*st));
+    memset(hist, 0, sizeof(hist));
+    switch (mcfg->encoding) {
+        case MMAL_ENCODING_RGB24:
+            measure_rgb(st, hist, data, pitch * 3,
+                        mcfg->width, mcfg->height, 3, 0, 2);
+            break;
+        case MMAL_ENCODING_BGR24:
+            measure_rgb(st, hist, data, pitch * 3,
+                        mcfg->width, mcfg->height, 3, 2, 0);
+            break;
+        case MMAL_ENCODING_RGBA:
+            measure_rgb(st, hist, data, pitch * 4,
+                        mcfg->width, mcfg->height, 4, 0, 2);
+            break;
+        case MMAL_ENCODING_BGRA:
+            measure_rgb(st, hist, data, pitch * 4,
+                        mcfg->width, mcfg->height, 4, 2, 0);
+            break;
+        case MMAL_ENCODING_I420:
+            measure_i420(st, hist, data, pitch, aligned_height,
+                         mcfg->width, mcfg->height);
+            break;
+        default:
+            print_error("Statistics of encoding 0x%08x are not supported",
+                        mcfg->encoding);
+            ret = 1;
+            goto end;
+    }
+
+    st->num_pixels = mcfg->width * mcfg->height;
+    for (i = 0; i < 256; i ++) {
+        st->histogram[i] = hist[0][i] + hist[1][i] + hist[2][i] + hist[3][i];
+        st->mean_luma += (double) i * st->histogram[i];
+    }
+    st->mean_luma /= st->num_pixels;
+    for (c = 0; c < 3; c ++)
+        st->means[c] = (double) st->sums[c] / st->num_pixels;
+
+end:
+    return ret;
+}
+
+int rpigrafx_config_camera_frame_stats(const int32_t width,
+                                       const int32_t height,
+                                       rpigrafx_frame_config_t *fcp)
+{
+    struct measures_config *mcfg = NULL;
+    int ret = 0;
+
+    if (fcp->camera_number < 0) {
+        print_error("Statistics are not supported on graph outputs");
+        ret = 1;
+        goto end;
+    }
+    mcfg = &measures_config[fcp->camera_number][fcp->splitter_output_port_index];
+
+    if (width > 0 && height > 0) {
+        if ((ret = rpigrafx_config_camera_frame(fcp->camera_number,
+                                                width, height,
+                                                MMAL_ENCODING_RGB24, 0,
+                                                &mcfg->fc)))
+            goto end;
+        mcfg->has_branch = !0;
+        mcfg->width = width;
+        mcfg->height = height;
+        mcfg->encoding = MMAL_ENCODING_RGB24;
+    } else {
+        mcfg->has_branch = 0;
+        if ((ret = priv_rpigrafx_mmal_get_output_format(fcp, &mcfg->width,
+                                                        &mcfg->height,
+                                                        &mcfg->encoding)))
+            goto end;
+    }
+    mcfg->is_used = !0;
+
+end:
+    return ret;
+}
+
+/* Called by rpigrafx_capture_next_frame after capturing fcp. */
+int priv_rpigrafx_measure_update(rpigrafx_frame_config_t *fcp)
+{
+    struct measures_config *mcfg =
+        &measures_config[fcp->camera_number][fcp->splitter_output_port_index];
+    int ret = 0;
+
+    if (!mcfg->is_used)
+        goto end;
+
+    if (mcfg->has_branch) {
+        if ((ret = rpigrafx_capture_next_frame(&mcfg->fc)))
+            goto end;
+        /*
+         * Pair the branch frame with the delivered one by pts as frame
+         * groups do, replacing whichever of them is older.
+         */
+        for (;;) {
+            const int64_t pts = rpigrafx_get_frame_pts(fcp);
+            const int64_t branch_pts = rpigrafx_get_frame_pts(&mcfg->fc);
+
+            if (pts == MMAL_TIME_UNKNOWN || branch_pts == MMAL_TIME_UNKNOWN
+                    || pts == branch_pts)
+                break;
+            if (branch_pts < pts) {
+                if ((ret = rpigrafx_capture_next_frame(&mcfg->fc)))
+                    goto end;
+            } else
+                priv_rpigrafx_mmal_capture_until(fcp, branch_pts);
+        }
+        ret = measure(mcfg, &mcfg->fc);
+    } else
+        ret = measure(mcfg, fcp);
+
+end:
+    return ret;
+}
+
+int rpigrafx_get_frame_stats(rpigrafx_frame_config_t *fcp,
+                             rpigrafx_frame_stats_t *statsp)
+{
+    int ret = 0;
+
+    if (fcp->camera_number < 0
+            || !measures_config[fcp->camera_number][fcp->splitter_output_port_index].is_used) {
+        print_error("Output %d,%d has no statistics",
+                    fcp->camera_number, fcp->splitter_output_port_index);
+        ret = 1;
+        goto end;
+    }
+    memcpy(statsp,
+           &measures_config[fcp->camera_number][fcp->splitter_output_port_index].stats,
+           sizeof(*statsp));
+
+end:
+    return ret;
+}
+
+int priv_rpigrafx_measure_finalize()
+{
+    memset(measures_config, 0, sizeof(measures_config));
+    return 0;
+}
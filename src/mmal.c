@@ -12,11 +12,15 @@
 #include <interface/mmal/util/mmal_util_params.h>
 #include <interface/mmal/util/mmal_connection.h>
 #include <interface/mmal/util/mmal_default_components.h>
+#include <interface/vmcs_host/vc_gencmd.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include "rpigrafx.h"
 #include "local.h"
 
-#define MAX_CAMERAS          MMAL_PARAMETER_CAMERA_INFO_MAX_CAMERAS
-#define NUM_SPLITTER_OUTPUTS 4
 #define CAMERA_PREVIEW_PORT 0
 #define CAMERA_CAPTURE_PORT 2
 
@@ -36,6 +40,16 @@ static int32_t num_cameras = 0;
  *                                   [1] --- [0] isp [0] --- [0] video_render
  *                                   [2] --- [0] isp [0] --- [0] video_render
  *                                   [3] --- [0] isp [0] --- [0] video_render
+ *
+ * An output configured by rpigrafx_config_camera_frame_h264 terminates in
+ * video_encode instead of video_render, and its output port is read by ARM:
+ * video_splitter [j] --- [0] isp [0] --- [0] video_encode [0] --- ARM
+ *
+ * prune_topology removes the video_splitter when a camera has a single
+ * output, and then the isp when the camera port can produce the requested
+ * encoding by itself, e.g.:
+ * camera [0] --- [0] video_render
+ * The conn_* arrays then start from the nearest upstream port.
  */
 
 static MMAL_COMPONENT_T *cp_cameras[MAX_CAMERAS];
@@ -45,6 +59,14 @@ static struct cameras_config {
     int32_t max_width, max_height;
     unsigned camera_output_port_index;
     _Bool use_camera_capture_port;
+    _Bool is_capture_streaming;
+    /* Set by prune_topology on rpigrafx_finish_config. */
+    _Bool has_splitter, has_isp;
+    /* Cameras of a frame group share the port config of the leader. */
+    int32_t group_leader;
+    /* Applied by the camera to all of its outputs. */
+    int32_t rotation;
+    MMAL_PARAM_MIRROR_T mirror;
 } cameras_config[MAX_CAMERAS];
 
 static MMAL_COMPONENT_T *cp_splitters[MAX_CAMERAS];
@@ -54,37 +76,85 @@ static struct splitters_config {
 
 static MMAL_COMPONENT_T *cp_nulls[MAX_CAMERAS];
 
+/*
+ * Splitter outputs with divisor > 1 are connected to the isp without
+ * tunnelling so that dropped headers never reach the isp.  Adaptive
+ * outputs are connected so from the start as their divisor changes while
+ * running.
+ */
+static struct decimations_config {
+    unsigned divisor;
+    unsigned count;
+    _Bool is_adaptive;
+    struct callback_context *ctx;
+} decimations_config[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
+
+#define IS_DECIMATING(i, j) \
+    (decimations_config[i][j].divisor > 1 || decimations_config[i][j].is_adaptive)
+
+#define HAS_SCALER(i, j) (isps_config[i][j].scaler_used != RPIGRAFX_SCALER_NONE)
+
+static const char *scaler_names[] = {
+    [RPIGRAFX_SCALER_AUTO]   = "auto",
+    [RPIGRAFX_SCALER_ISP]    = "isp",
+    [RPIGRAFX_SCALER_RESIZE] = "resize",
+    [RPIGRAFX_SCALER_NONE]   = "none"
+};
+
+/* The scaler of each output: vc.ril.isp or vc.ril.resize. */
 static MMAL_COMPONENT_T *cp_isps[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
 static struct isps_config {
     int32_t width, height;
     MMAL_FOURCC_T encoding;
     _Bool is_zero_copy_rendering;
+    /* Headers of the ARM connection; 0 keeps the port default. */
+    unsigned buffer_num;
+    /* The isp-render connection copies frames instead of zero-copy. */
+    _Bool is_cached;
+    /* Band of rows [slice_y, slice_y + height) of a frame_height frame. */
+    _Bool is_slice;
+    int32_t slice_y, frame_height;
+    /* Requested, and resolved by resolve_camera. */
+    rpigrafx_scaler_t scaler, scaler_used;
 } isps_config[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
 
+/*
+ * isp output[1], read by ARM only.  The isp fills both outputs in one pass,
+ * so it stalls when either runs out of headers: one held by the
+ * application, one being filled and one spare.
+ */
+#define LOWRES_BUFFER_NUM 3
+
+static struct lowres_config {
+    _Bool is_used;
+    int32_t width, height;
+    MMAL_FOURCC_T encoding;
+    struct callback_context *ctx;
+} lowres_config[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
+
 static MMAL_COMPONENT_T *cp_renders[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
 static struct renders_config {
     MMAL_DISPLAYREGION_T region;
+    /* Merged into region by setup_cp_render. */
+    _Bool has_transform;
+    MMAL_DISPLAYTRANSFORM_T transform;
 } renders_config[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
 
+static MMAL_COMPONENT_T *cp_encoders[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
+static struct encoders_config {
+    _Bool is_used;
+    uint32_t bitrate;
+    uint32_t intra_period;
+} encoders_config[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
+
 static MMAL_CONNECTION_T *conn_camera_nulls[MAX_CAMERAS];
 static MMAL_CONNECTION_T *conn_camera_splitters[MAX_CAMERAS];
 static MMAL_CONNECTION_T *conn_splitters_isps[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
 static MMAL_CONNECTION_T *conn_isps_renders[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
+static MMAL_CONNECTION_T *conn_isps_encoders[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
 
 static struct callback_context *ctxs[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
 
-#define WARN_HEADER(pre, header, post) \
-    do { \
-        if (header != NULL) { \
-            print_error("%s%p %p %d 0x%08x%s", \
-                        pre, \
-                        header, header->data, header->length, header->flags, \
-                        post); \
-       } else { \
-            print_error("%s%p%s", pre, header, post); \
-       } \
-    } while (0)
-
 static MMAL_STATUS_T config_port(MMAL_PORT_T *port, const MMAL_FOURCC_T encoding,
                                  const int width, const int height)
 {
@@ -98,6 +168,13 @@ static MMAL_STATUS_T config_port(MMAL_PORT_T *port, const MMAL_FOURCC_T encoding
     return mmal_port_format_commit(port);
 }
 
+MMAL_STATUS_T priv_rpigrafx_mmal_config_port(MMAL_PORT_T *port,
+                                             const MMAL_FOURCC_T encoding,
+                                             const int width, const int height)
+{
+    return config_port(port, encoding, width, height);
+}
+
 int priv_rpigrafx_mmal_init()
 {
     int i, j;
@@ -110,6 +187,9 @@ int priv_rpigrafx_mmal_init()
     for (i = 0; i < MAX_CAMERAS; i ++) {
         cp_cameras[i] = NULL;
         cameras_config[i].is_used = 0;
+        cameras_config[i].group_leader = -1;
+        cameras_config[i].rotation = 0;
+        cameras_config[i].mirror = MMAL_PARAM_MIRROR_NONE;
         if ((ret = rpigrafx_config_camera_port(i,
                                                RPIGRAFX_CAMERA_PORT_PREVIEW)))
             goto end;
@@ -119,8 +199,16 @@ int priv_rpigrafx_mmal_init()
         conn_camera_splitters[i] = NULL;
 
         for (j = 0; j < NUM_SPLITTER_OUTPUTS; j ++) {
+            decimations_config[i][j].divisor = 1;
+            decimations_config[i][j].count = 0;
+            decimations_config[i][j].is_adaptive = 0;
+            decimations_config[i][j].ctx = NULL;
             cp_isps[i][j] = NULL;
             conn_splitters_isps[i][j] = NULL;
+            cp_encoders[i][j] = NULL;
+            encoders_config[i][j].is_used = 0;
+            conn_isps_encoders[i][j] = NULL;
+            memset(&renders_config[i][j], 0, sizeof(renders_config[i][j]));
         }
     }
 
@@ -150,11 +238,9 @@ int priv_rpigrafx_mmal_init()
         }
 
         num_cameras = camera_info.num_cameras;
-        if (num_cameras <= 0) {
+        /* Not fatal; replay sources can still be used without a sensor. */
+        if (num_cameras <= 0)
             print_error("No cameras found: 0x%08x", num_cameras);
-            ret = 1;
-            goto end;
-        }
 
         for (i = 0; i < num_cameras; i ++) {
             cameras_config[i].max_width  = camera_info.cameras[i].max_width;
@@ -188,6 +274,17 @@ int priv_rpigrafx_mmal_finalize()
     if (priv_rpigrafx_called.mmal != 1)
         goto skip;
 
+    if ((ret = priv_rpigrafx_replay_finalize()))
+        goto skip;
+    if ((ret = priv_rpigrafx_motion_finalize()))
+        goto skip;
+    if ((ret = priv_rpigrafx_measure_finalize()))
+        goto skip;
+    if ((ret = priv_rpigrafx_overload_finalize()))
+        goto skip;
+    if ((ret = priv_rpigrafx_stats_finalize()))
+        goto skip;
+
     for (i = 0; i < MAX_CAMERAS; i ++) {
         cp_cameras[i] = cp_splitters[i] = NULL;
         for (j = 0; j < NUM_SPLITTER_OUTPUTS; j ++)
@@ -206,16 +303,185 @@ skip:
 
 static void callback_control(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *header)
 {
-    if (priv_rpigrafx_verbose)
-        print_error("Called by a port %s", port->name);
+    TRACE(2, TRACE_CALLBACK_CONTROL, port);
     mmal_buffer_header_release(header);
 }
 
+static void callback_port_to_context(MMAL_PORT_T *port,
+                                     MMAL_BUFFER_HEADER_T *header)
+{
+    struct callback_context *ctx = (struct callback_context*) port->userdata;
+
+    THREAD_ENTER(RPIGRAFX_THREAD_CALLBACK);
+
+    TRACE_HEADER(2, TRACE_PORT_OUTPUT, header);
+    if (header->length != 0)
+        priv_rpigrafx_thread_delivered(RPIGRAFX_THREAD_CALLBACK, ctx,
+                                       header->pts);
+    mmal_queue_put(ctx->queue, header);
+}
+
 static void callback_conn(MMAL_CONNECTION_T *conn)
 {
-    if (priv_rpigrafx_verbose)
-        print_error("Called by a connection %s between %s and %s",
-                    conn->name, conn->out->name, conn->in->name);
+    THREAD_ENTER(RPIGRAFX_THREAD_CALLBACK);
+    TRACE(2, TRACE_CALLBACK_CONN, conn);
+}
+
+/*
+ * Used on splitter-isp connections of decimated outputs.
+ * Only every divisor-th header is passed to the isp; the others are sent
+ * back to the splitter output as is.
+ */
+static void callback_conn_decimate(MMAL_CONNECTION_T *conn)
+{
+    struct decimations_config *dcfg = conn->user_data;
+    MMAL_BUFFER_HEADER_T *header = NULL;
+    MMAL_STATUS_T status;
+
+    THREAD_ENTER(RPIGRAFX_THREAD_CALLBACK);
+
+    while ((header = mmal_queue_get(conn->queue)) != NULL) {
+        if (header->length != 0
+                && dcfg->count ++ % __atomic_load_n(&dcfg->divisor, __ATOMIC_RELAXED) == 0) {
+            TRACE_HEADER(2, TRACE_DECIMATE_PASS, header);
+            status = mmal_port_send_buffer(conn->in, header);
+        } else {
+            TRACE_HEADER(2, TRACE_DECIMATE_DROP, header);
+            if (header->length == 0)
+                STATS_ADD(dcfg->ctx, num_empty, 1);
+            else
+                STATS_ADD(dcfg->ctx, num_dropped, 1);
+            status = mmal_port_send_buffer(conn->out, header);
+        }
+        if (status != MMAL_SUCCESS) {
+            dcfg->ctx->status = status;
+            STATS_ERROR(dcfg->ctx, status);
+            mmal_buffer_header_release(header);
+        }
+    }
+    while ((header = mmal_queue_get(conn->pool->queue)) != NULL) {
+        status = mmal_port_send_buffer(conn->out, header);
+        if (status != MMAL_SUCCESS) {
+            dcfg->ctx->status = status;
+            STATS_ERROR(dcfg->ctx, status);
+            mmal_queue_put_back(conn->pool->queue, header);
+            break;
+        }
+    }
+}
+
+/*
+ * Used on isp-render connections of a streaming capture port.
+ * camera[2] returns empty headers once every two headers, so drop them here
+ * and hand them straight back to the isp instead of waking up the consumer.
+ */
+static void callback_conn_stream(MMAL_CONNECTION_T *conn)
+{
+    struct callback_context *ctx = conn->user_data;
+    MMAL_BUFFER_HEADER_T *header = NULL;
+    MMAL_STATUS_T status;
+
+    THREAD_ENTER(RPIGRAFX_THREAD_CALLBACK);
+
+    while ((header = mmal_queue_get(conn->queue)) != NULL) {
+        if (header->length != 0) {
+            TRACE_HEADER(2, TRACE_STREAM_QUEUE, header);
+            priv_rpigrafx_thread_delivered(RPIGRAFX_THREAD_CALLBACK, ctx,
+                                           header->pts);
+            mmal_queue_put(ctx->queue, header);
+            continue;
+        }
+        TRACE_HEADER(2, TRACE_STREAM_EMPTY, header);
+        STATS_ADD(ctx, num_empty, 1);
+        status = mmal_port_send_buffer(conn->out, header);
+        if (status != MMAL_SUCCESS) {
+            ctx->status = status;
+            STATS_ERROR(ctx, status);
+            mmal_buffer_header_release(header);
+        }
+    }
+    while ((header = mmal_queue_get(conn->pool->queue)) != NULL) {
+        status = mmal_port_send_buffer(conn->out, header);
+        if (status != MMAL_SUCCESS) {
+            ctx->status = status;
+            STATS_ERROR(ctx, status);
+            mmal_queue_put_back(conn->pool->queue, header);
+            break;
+        }
+    }
+}
+
+struct callback_context *priv_rpigrafx_mmal_context_create()
+{
+    struct callback_context *ctx = NULL;
+
+    ctx = malloc(sizeof(*ctx));
+    if (ctx == NULL) {
+        print_error("Failed to allocate context");
+        goto end;
+    }
+    ctx->status = MMAL_SUCCESS;
+    ctx->header = NULL;
+    ctx->is_header_passed_to_render = 0;
+    ctx->queue = NULL;
+    ctx->conn = NULL;
+    ctx->port = NULL;
+    ctx->pool = NULL;
+    ctx->stats_index = priv_rpigrafx_stats_register();
+    ctx->last_pts = MMAL_TIME_UNKNOWN;
+    ctx->last_time = 0;
+
+end:
+    return ctx;
+}
+
+/*
+ * Enable an output port to be read by ARM only.
+ * Headers are queued to ctx->queue and returned to ctx->pool on release.
+ */
+int priv_rpigrafx_mmal_enable_port_to_context(MMAL_PORT_T *port,
+                                              struct callback_context *ctx)
+{
+    MMAL_BUFFER_HEADER_T *header = NULL;
+    MMAL_STATUS_T status;
+    int ret = 0;
+
+    ctx->pool = mmal_port_pool_create(port, port->buffer_num,
+                                      port->buffer_size);
+    if (ctx->pool == NULL) {
+        print_error("Creating pool of %s failed", port->name);
+        ret = 1;
+        goto end;
+    }
+
+    ctx->queue = mmal_queue_create();
+    if (ctx->queue == NULL) {
+        print_error("Creating queue of %s failed", port->name);
+        ret = 1;
+        goto end;
+    }
+
+    port->userdata = (struct MMAL_PORT_USERDATA_T*) ctx;
+    status = mmal_port_enable(port, callback_port_to_context);
+    if (status != MMAL_SUCCESS) {
+        print_error("Enabling %s failed: 0x%08x", port->name, status);
+        ret = 1;
+        goto end;
+    }
+    ctx->port = port;
+
+    while ((header = mmal_queue_get(ctx->pool->queue)) != NULL) {
+        status = mmal_port_send_buffer(port, header);
+        if (status != MMAL_SUCCESS) {
+            print_error("Sending pool buffer to %s failed: 0x%08x",
+                        port->name, status);
+            ret = 1;
+            goto end;
+        }
+    }
+
+end:
+    return ret;
 }
 
 int rpigrafx_config_camera_frame(const int32_t camera_number,
@@ -229,6 +495,10 @@ int rpigrafx_config_camera_frame(const int32_t camera_number,
     struct callback_context *ctx = NULL;
     int ret = 0;
 
+    /* Replayed frames are scaled by the isp; there is no sensor limit. */
+    if (priv_rpigrafx_replay_is_used(camera_number))
+        goto skip_camera_check;
+
     if (camera_number >= num_cameras) {
         print_error("camera_number(%d) exceeds num_cameras(%d)",
                     camera_number, num_cameras);
@@ -249,6 +519,8 @@ int rpigrafx_config_camera_frame(const int32_t camera_number,
         goto end;
     }
 
+skip_camera_check:
+
     /*
      * Only set use flag here.
      * cameras_config[camera_number].{width,height}
@@ -269,17 +541,32 @@ int rpigrafx_config_camera_frame(const int32_t camera_number,
     isps_config[camera_number][idx].height = height;
     isps_config[camera_number][idx].encoding = encoding;
     isps_config[camera_number][idx].is_zero_copy_rendering = is_zero_copy_rendering;
-
-    ctx = malloc(sizeof(*ctx));
+    isps_config[camera_number][idx].buffer_num = 0;
+    isps_config[camera_number][idx].is_cached = 0;
+    isps_config[camera_number][idx].is_slice = 0;
+    isps_config[camera_number][idx].slice_y = 0;
+    isps_config[camera_number][idx].frame_height = height;
+    isps_config[camera_number][idx].scaler = RPIGRAFX_SCALER_AUTO;
+    isps_config[camera_number][idx].scaler_used = RPIGRAFX_SCALER_ISP;
+
+    ctx = priv_rpigrafx_mmal_context_create();
     if (ctx == NULL) {
-        print_error("Failed to allocate context");
         ret = 1;
         goto end;
     }
-    ctx->status = MMAL_SUCCESS;
-    ctx->header = NULL;
-    ctx->is_header_passed_to_render = 0;
     ctxs[camera_number][idx] = ctx;
+    priv_rpigrafx_stats_label(ctx->stats_index, camera_number, idx);
+
+    decimations_config[camera_number][idx].divisor = 1;
+    decimations_config[camera_number][idx].is_adaptive = 0;
+    decimations_config[camera_number][idx].count = 0;
+    decimations_config[camera_number][idx].ctx = ctx;
+
+    encoders_config[camera_number][idx].is_used = 0;
+    lowres_config[camera_number][idx].is_used = 0;
+    /* Region and transform of the render, set by config_camera_frame_render*. */
+    memset(&renders_config[camera_number][idx], 0,
+           sizeof(renders_config[camera_number][idx]));
 
     fcp->camera_number = camera_number;
     fcp->splitter_output_port_index = idx;
@@ -290,6 +577,76 @@ end:
     return ret;
 }
 
+int rpigrafx_config_camera_frame_h264(const int32_t camera_number,
+                                      const int32_t width, const int32_t height,
+                                      const uint32_t bitrate,
+                                      const uint32_t intra_period,
+                                      rpigrafx_frame_config_t *fcp)
+{
+    struct encoders_config *ecfg = NULL;
+    int ret = 0;
+
+    /* The isp converts the frame to I420, the native input of video_encode. */
+    if ((ret = rpigrafx_config_camera_frame(camera_number, width, height,
+                                            MMAL_ENCODING_I420, 0, fcp)))
+        goto end;
+
+    ecfg = &encoders_config[camera_number][fcp->splitter_output_port_index];
+    ecfg->is_used = !0;
+    ecfg->bitrate = bitrate;
+    ecfg->intra_period = intra_period;
+
+end:
+    return ret;
+}
+
+int rpigrafx_config_camera_frame_lowres(const int32_t width,
+                                        const int32_t height,
+                                        const MMAL_FOURCC_T encoding,
+                                        const rpigrafx_frame_config_t *fcp,
+                                        rpigrafx_frame_config_t *lowres_fcp)
+{
+    const struct isps_config *icfg = NULL;
+    struct lowres_config *lcfg = NULL;
+    struct callback_context *ctx = NULL;
+    int ret = 0;
+
+    if (fcp->camera_number < 0) {
+        print_error("Graph outputs have no isp output[1]");
+        ret = 1;
+        goto end;
+    }
+    icfg = &isps_config[fcp->camera_number][fcp->splitter_output_port_index];
+    lcfg = &lowres_config[fcp->camera_number][fcp->splitter_output_port_index];
+    if (width > icfg->width || height > icfg->height) {
+        print_error("Low resolution output %dx%d exceeds %dx%d of output %d,%d",
+                    width, height, icfg->width, icfg->height,
+                    fcp->camera_number, fcp->splitter_output_port_index);
+        ret = 1;
+        goto end;
+    }
+
+    ctx = priv_rpigrafx_mmal_context_create();
+    if (ctx == NULL) {
+        ret = 1;
+        goto end;
+    }
+    lcfg->is_used = !0;
+    lcfg->width = width;
+    lcfg->height = height;
+    lcfg->encoding = encoding;
+    lcfg->ctx = ctx;
+
+    /* Per-output features are keyed by camera; this frame has none. */
+    lowres_fcp->camera_number = -1;
+    lowres_fcp->splitter_output_port_index = fcp->splitter_output_port_index;
+    lowres_fcp->is_zero_copy_rendering = 0;
+    lowres_fcp->ctx = ctx;
+
+end:
+    return ret;
+}
+
 int rpigrafx_config_camera_port(const int32_t camera_number,
                                 const rpigrafx_camera_port_t camera_port)
 {
@@ -300,10 +657,17 @@ int rpigrafx_config_camera_port(const int32_t camera_number,
         case RPIGRAFX_CAMERA_PORT_PREVIEW:
             cfg->camera_output_port_index = CAMERA_PREVIEW_PORT;
             cfg->use_camera_capture_port = 0;
+            cfg->is_capture_streaming = 0;
             break;
         case RPIGRAFX_CAMERA_PORT_CAPTURE:
             cfg->camera_output_port_index = CAMERA_CAPTURE_PORT;
             cfg->use_camera_capture_port = !0;
+            cfg->is_capture_streaming = 0;
+            break;
+        case RPIGRAFX_CAMERA_PORT_CAPTURE_STREAM:
+            cfg->camera_output_port_index = CAMERA_CAPTURE_PORT;
+            cfg->use_camera_capture_port = !0;
+            cfg->is_capture_streaming = !0;
             break;
         default:
             print_error("Unknown rpigrafx_camera_port_t value: %d\n",
@@ -341,8 +705,154 @@ int rpigrafx_config_camera_frame_render(const _Bool is_fullscreen,
     return ret;
 }
 
+int rpigrafx_config_camera_frame_render_transform(const MMAL_DISPLAYTRANSFORM_T transform,
+                                                  rpigrafx_frame_config_t *fcp)
+{
+    struct renders_config *rcfg = NULL;
+    int ret = 0;
+
+    if (fcp->camera_number < 0) {
+        print_error("Transforms of graph renders are not supported");
+        ret = 1;
+        goto end;
+    }
+    rcfg = &renders_config[fcp->camera_number][fcp->splitter_output_port_index];
+    rcfg->has_transform = !0;
+    rcfg->transform = transform;
+
+end:
+    return ret;
+}
+
+int rpigrafx_config_camera_orientation(const int32_t camera_number,
+                                       const int32_t rotation,
+                                       const _Bool is_hflipped,
+                                       const _Bool is_vflipped)
+{
+    struct cameras_config *cfg = NULL;
+    int ret = 0;
+
+    if (camera_number < 0 || camera_number >= num_cameras
+            || priv_rpigrafx_replay_is_used(camera_number)) {
+        print_error("Camera %d has no sensor to orient", camera_number);
+        ret = 1;
+        goto end;
+    }
+    if (rotation != 0 && rotation != 90 && rotation != 180 && rotation != 270) {
+        print_error("Rotation(%d) must be 0, 90, 180 or 270", rotation);
+        ret = 1;
+        goto end;
+    }
+    cfg = &cameras_config[camera_number];
+    cfg->rotation = rotation;
+    cfg->mirror = is_hflipped && is_vflipped ? MMAL_PARAM_MIRROR_BOTH
+                  : is_hflipped ? MMAL_PARAM_MIRROR_HORIZONTAL
+                  : is_vflipped ? MMAL_PARAM_MIRROR_VERTICAL
+                  : MMAL_PARAM_MIRROR_NONE;
+
+end:
+    return ret;
+}
+
+int rpigrafx_config_camera_frame_rate_divisor(const unsigned divisor,
+                                              rpigrafx_frame_config_t *fcp)
+{
+    int ret = 0;
+
+    if (divisor == 0) {
+        print_error("Rate divisor of output %d,%d must not be zero",
+                    fcp->camera_number, fcp->splitter_output_port_index);
+        ret = 1;
+        goto end;
+    }
+
+    __atomic_store_n(&decimations_config[fcp->camera_number][fcp->splitter_output_port_index].divisor,
+                     divisor, __ATOMIC_RELAXED);
+
+end:
+    return ret;
+}
+
+int rpigrafx_config_camera_frame_depth(const unsigned buffer_num,
+                                       rpigrafx_frame_config_t *fcp)
+{
+    int ret = 0;
+
+    if (fcp->camera_number < 0) {
+        print_error("Depth of graph outputs is set on the graph");
+        ret = 1;
+        goto end;
+    }
+    isps_config[fcp->camera_number][fcp->splitter_output_port_index].buffer_num = buffer_num;
+
+end:
+    return ret;
+}
+
+int rpigrafx_config_camera_frame_scaler(const rpigrafx_scaler_t scaler,
+                                        rpigrafx_frame_config_t *fcp)
+{
+    int ret = 0;
+
+    if (fcp->camera_number < 0) {
+        print_error("Scalers of graph outputs are set on the graph");
+        ret = 1;
+        goto end;
+    }
+    if (scaler < RPIGRAFX_SCALER_AUTO || scaler > RPIGRAFX_SCALER_NONE) {
+        print_error("Unknown scaler %d", scaler);
+        ret = 1;
+        goto end;
+    }
+    isps_config[fcp->camera_number][fcp->splitter_output_port_index].scaler = scaler;
+
+end:
+    return ret;
+}
+
+int rpigrafx_config_camera_frame_cached(const _Bool is_cached,
+                                        rpigrafx_frame_config_t *fcp)
+{
+    int ret = 0;
+
+    if (fcp->camera_number < 0) {
+        print_error("Only camera outputs can be cached");
+        ret = 1;
+        goto end;
+    }
+    if (encoders_config[fcp->camera_number][fcp->splitter_output_port_index].is_used) {
+        print_error("Encoded output %d,%d cannot be cached",
+                    fcp->camera_number, fcp->splitter_output_port_index);
+        ret = 1;
+        goto end;
+    }
+    isps_config[fcp->camera_number][fcp->splitter_output_port_index].is_cached = is_cached;
+
+end:
+    return ret;
+}
+
+static MMAL_STATUS_T set_orientation(MMAL_PORT_T *port, const int i)
+{
+    MMAL_PARAMETER_MIRROR_T mirror = {
+        .hdr = {
+            .id = MMAL_PARAMETER_MIRROR,
+            .size = sizeof(mirror)
+        },
+        .value = cameras_config[i].mirror
+    };
+    MMAL_STATUS_T status;
+
+    status = mmal_port_parameter_set_int32(port, MMAL_PARAMETER_ROTATION,
+                                           cameras_config[i].rotation);
+    if (status != MMAL_SUCCESS)
+        return status;
+    return mmal_port_parameter_set(port, &mirror.hdr);
+}
+
 static int setup_cp_camera(const int i,
                            const int32_t width, const int32_t height,
+                           const MMAL_FOURCC_T encoding,
                            const _Bool setup_preview_port_for_null)
 {
     const unsigned camera_output_port_index = cameras_config[i].camera_output_port_index;
@@ -380,6 +890,38 @@ static int setup_cp_camera(const int i,
             ret = 1;
             goto end;
         }
+
+        /*
+         * Timestamp grouped cameras with the shared STC to pair frames, and
+         * presenting cameras to map pts to the display clock.
+         */
+        if (cameras_config[i].group_leader >= 0
+                || priv_rpigrafx_present_is_camera_used(i)) {
+            MMAL_PARAMETER_CAMERA_CONFIG_T camera_config = {
+                .hdr = {
+                    .id = MMAL_PARAMETER_CAMERA_CONFIG,
+                    .size = sizeof(camera_config)
+                },
+                .max_stills_w = width,
+                .max_stills_h = height,
+                .stills_yuv422 = 0,
+                .one_shot_stills = 0,
+                .max_preview_video_w = width,
+                .max_preview_video_h = height,
+                .num_preview_video_frames = 3,
+                .stills_capture_circular_buffer_height = 0,
+                .fast_preview_resume = 0,
+                .use_stc_timestamp = MMAL_PARAM_TIMESTAMP_MODE_RAW_STC
+            };
+
+            status = mmal_port_parameter_set(control, &camera_config.hdr);
+            if (status != MMAL_SUCCESS) {
+                print_error("Setting config of camera %d failed: 0x%08x",
+                            i, status);
+                ret = 1;
+                goto end;
+            }
+        }
     }
     if (setup_preview_port_for_null) {
         MMAL_PORT_T *output = mmal_util_get_port(cp_cameras[i],
@@ -400,6 +942,14 @@ static int setup_cp_camera(const int i,
             goto end;
         }
 
+        status = set_orientation(output, i);
+        if (status != MMAL_SUCCESS) {
+            print_error("Setting orientation of camera %d failed: 0x%08x",
+                        i, status);
+            ret = 1;
+            goto end;
+        }
+
         status = mmal_port_parameter_set_boolean(output,
                                             MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
         if (status != MMAL_SUCCESS) {
@@ -420,13 +970,21 @@ static int setup_cp_camera(const int i,
             goto end;
         }
 
-        status = config_port(output, MMAL_ENCODING_RGB24, width, height);
+        status = config_port(output, encoding, width, height);
         if (status != MMAL_SUCCESS) {
             print_error("Setting format of camera %d failed: 0x%08x", i, status);
             ret = 1;
             goto end;
         }
 
+        status = set_orientation(output, i);
+        if (status != MMAL_SUCCESS) {
+            print_error("Setting orientation of camera %d failed: 0x%08x",
+                        i, status);
+            ret = 1;
+            goto end;
+        }
+
         status = mmal_port_parameter_set_boolean(output,
                                             MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
         if (status != MMAL_SUCCESS) {
@@ -620,7 +1178,9 @@ static int setup_cp_isp(const int i, const int j,
     MMAL_STATUS_T status;
     int ret = 0;
 
-    status = mmal_component_create("vc.ril.isp", &cp_isps[i][j]);
+    status = mmal_component_create(isps_config[i][j].scaler_used == RPIGRAFX_SCALER_RESIZE
+                                   ? "vc.ril.resize" : "vc.ril.isp",
+                                   &cp_isps[i][j]);
     if (status != MMAL_SUCCESS) {
         print_error("Creating isp component %d,%d failed: 0x%08x", i, j, status);
         ret = 1;
@@ -662,6 +1222,25 @@ static int setup_cp_isp(const int i, const int j,
             goto end;
         }
 
+        if (isps_config[i][j].is_slice) {
+            /* The isp scales only the rows of its band. */
+            const struct isps_config *icfg = &isps_config[i][j];
+            const int32_t y0 = (int32_t) ((int64_t) icfg->slice_y * height
+                                          / icfg->frame_height) & ~1;
+            const int32_t y1 = (int32_t) ((int64_t) (icfg->slice_y + icfg->height)
+                                          * height / icfg->frame_height);
+
+            input->format->es->video.crop.y = y0;
+            input->format->es->video.crop.height = y1 - y0;
+            status = mmal_port_format_commit(input);
+            if (status != MMAL_SUCCESS) {
+                print_error("Setting crop of " \
+                            "isp %d input %d failed: 0x%08x", i, j, status);
+                ret = 1;
+                goto end;
+            }
+        }
+
         status = mmal_port_parameter_set_boolean(input,
                                             MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
         if (status != MMAL_SUCCESS) {
@@ -692,8 +1271,13 @@ static int setup_cp_isp(const int i, const int j,
             goto end;
         }
 
+        /*
+         * Without zero-copy, VCHIQ DMAs each frame to a cached ARM buffer
+         * and invalidates it; sending it to render cleans it likewise.
+         */
         status = mmal_port_parameter_set_boolean(output,
-                                            MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+                                            MMAL_PARAMETER_ZERO_COPY,
+                                            !isps_config[i][j].is_cached);
         if (status != MMAL_SUCCESS) {
             print_error("Setting zero-copy on " \
                         "isp %d output %d failed: 0x%08x", i, j, status);
@@ -701,12 +1285,49 @@ static int setup_cp_isp(const int i, const int j,
             goto end;
         }
     }
+    if (lowres_config[i][j].is_used) {
+        MMAL_PORT_T *output = mmal_util_get_port(cp_isps[i][j],
+                                                 MMAL_PORT_TYPE_OUTPUT, 1);
+
+        if (output == NULL) {
+            print_error("Getting output port 1 of isp %d,%d failed", i, j);
+            ret = 1;
+            goto end;
+        }
+
+        status = config_port(output,
+                             lowres_config[i][j].encoding,
+                             lowres_config[i][j].width,
+                             lowres_config[i][j].height);
+        if (status != MMAL_SUCCESS) {
+            print_error("Setting format of " \
+                        "isp %d,%d output 1 failed: 0x%08x", i, j, status);
+            ret = 1;
+            goto end;
+        }
+        output->buffer_num = MMAL_MAX(LOWRES_BUFFER_NUM, output->buffer_num_min);
+        output->buffer_size = MMAL_MAX(output->buffer_size_recommended,
+                                       output->buffer_size_min);
+
+        status = mmal_port_parameter_set_boolean(output,
+                                            MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+        if (status != MMAL_SUCCESS) {
+            print_error("Setting zero-copy on " \
+                        "isp %d,%d output 1 failed: 0x%08x", i, j, status);
+            ret = 1;
+            goto end;
+        }
+    }
     status = mmal_component_enable(cp_isps[i][j]);
     if (status != MMAL_SUCCESS) {
         print_error("Enabling isp component %d,%d failed: 0x%08x", i, j, status);
         ret = 1;
         goto end;
     }
+    if (lowres_config[i][j].is_used)
+        if ((ret = priv_rpigrafx_mmal_enable_port_to_context(cp_isps[i][j]->output[1],
+                                                              lowres_config[i][j].ctx)))
+            goto end;
 
 end:
     return ret;
@@ -762,6 +1383,10 @@ static int setup_cp_render(const int i, const int j)
             goto end;
         }
 
+        if (renders_config[i][j].has_transform) {
+            renders_config[i][j].region.transform = renders_config[i][j].transform;
+            renders_config[i][j].region.set |= MMAL_DISPLAY_SET_TRANSFORM;
+        }
         status = mmal_util_set_display_region(input, &renders_config[i][j].region);
         if (status != MMAL_SUCCESS) {
             print_error("Setting region of " \
@@ -771,7 +1396,8 @@ static int setup_cp_render(const int i, const int j)
         }
 
         status = mmal_port_parameter_set_boolean(input,
-                                            MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+                                            MMAL_PARAMETER_ZERO_COPY,
+                                            !isps_config[i][j].is_cached);
         if (status != MMAL_SUCCESS) {
             print_error("Setting zero-copy on " \
                         "isp %d input %d failed: 0x%08x", i, j, status);
@@ -790,10 +1416,166 @@ end:
     return ret;
 }
 
+static int setup_cp_encoder(const int i, const int j)
+{
+    struct encoders_config *ecfg = &encoders_config[i][j];
+    MMAL_STATUS_T status;
+    int ret = 0;
+
+    status = mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER,
+                                   &cp_encoders[i][j]);
+    if (status != MMAL_SUCCESS) {
+        print_error("Creating encoder component %d,%d failed: 0x%08x",
+                    i, j, status);
+        ret = 1;
+        goto end;
+    }
+    {
+        MMAL_PORT_T *control = mmal_util_get_port(cp_encoders[i][j],
+                                                  MMAL_PORT_TYPE_CONTROL, 0);
+
+        if (control == NULL) {
+            print_error("Getting control port of encoder %d,%d failed", i, j);
+            ret = 1;
+            goto end;
+        }
+
+        status = mmal_port_enable(control, callback_control);
+        if (status != MMAL_SUCCESS) {
+            print_error("Enabling control port of " \
+                        "encoder %d,%d failed: 0x%08x", i, j, status);
+            ret = 1;
+            goto end;
+        }
+    }
+    {
+        MMAL_PORT_T *input = mmal_util_get_port(cp_encoders[i][j],
+                                                MMAL_PORT_TYPE_INPUT, 0);
+
+        if (input == NULL) {
+            print_error("Getting input port of encoder %d,%d failed", i, j);
+            ret = 1;
+            goto end;
+        }
+
+        status = config_port(input,
+                             isps_config[i][j].encoding,
+                             isps_config[i][j].width,
+                             isps_config[i][j].height);
+        if (status != MMAL_SUCCESS) {
+            print_error("Setting format of " \
+                        "encoder %d input %d failed: 0x%08x", i, j, status);
+            ret = 1;
+            goto end;
+        }
+
+        status = mmal_port_parameter_set_boolean(input,
+                                            MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+        if (status != MMAL_SUCCESS) {
+            print_error("Setting zero-copy on " \
+                        "encoder %d input %d failed: 0x%08x", i, j, status);
+            ret = 1;
+            goto end;
+        }
+    }
+    {
+        MMAL_PORT_T *input = cp_encoders[i][j]->input[0];
+        MMAL_PORT_T *output = mmal_util_get_port(cp_encoders[i][j],
+                                                 MMAL_PORT_TYPE_OUTPUT, 0);
+        MMAL_PARAMETER_VIDEO_PROFILE_T profile = {
+            .hdr = {
+                .id = MMAL_PARAMETER_PROFILE,
+                .size = sizeof(profile)
+            },
+            .profile = {
+                {
+                    .profile = MMAL_VIDEO_PROFILE_H264_HIGH,
+                    .level = MMAL_VIDEO_LEVEL_H264_4
+                }
+            }
+        };
+
+        if (output == NULL) {
+            print_error("Getting output port of encoder %d,%d failed", i, j);
+            ret = 1;
+            goto end;
+        }
+
+        mmal_format_copy(output->format, input->format);
+        output->format->encoding = MMAL_ENCODING_H264;
+        output->format->bitrate = ecfg->bitrate;
+        output->buffer_size = MMAL_MAX(output->buffer_size_recommended,
+                                       output->buffer_size_min);
+        output->buffer_num = MMAL_MAX(output->buffer_num_recommended,
+                                      output->buffer_num_min);
+        status = mmal_port_format_commit(output);
+        if (status != MMAL_SUCCESS) {
+            print_error("Setting format of " \
+                        "encoder %d output %d failed: 0x%08x", i, j, status);
+            ret = 1;
+            goto end;
+        }
+
+        status = mmal_port_parameter_set(output, &profile.hdr);
+        if (status != MMAL_SUCCESS) {
+            print_error("Setting profile of " \
+                        "encoder %d output %d failed: 0x%08x", i, j, status);
+            ret = 1;
+            goto end;
+        }
+
+        if (ecfg->intra_period != 0) {
+            status = mmal_port_parameter_set_uint32(output,
+                                                    MMAL_PARAMETER_INTRAPERIOD,
+                                                    ecfg->intra_period);
+            if (status != MMAL_SUCCESS) {
+                print_error("Setting intra period of " \
+                            "encoder %d output %d failed: 0x%08x", i, j, status);
+                ret = 1;
+                goto end;
+            }
+        }
+
+        /* Repeat SPS/PPS on every I-frame so that a stream can be joined. */
+        status = mmal_port_parameter_set_boolean(output,
+                                    MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER,
+                                    MMAL_TRUE);
+        if (status != MMAL_SUCCESS) {
+            print_error("Setting inline header on " \
+                        "encoder %d output %d failed: 0x%08x", i, j, status);
+            ret = 1;
+            goto end;
+        }
+
+        status = mmal_port_parameter_set_boolean(output,
+                                            MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+        if (status != MMAL_SUCCESS) {
+            print_error("Setting zero-copy on " \
+                        "encoder %d output %d failed: 0x%08x", i, j, status);
+            ret = 1;
+            goto end;
+        }
+    }
+    status = mmal_component_enable(cp_encoders[i][j]);
+    if (status != MMAL_SUCCESS) {
+        print_error("Enabling encoder component %d,%d failed: 0x%08x",
+                    i, j, status);
+        ret = 1;
+        goto end;
+    }
+    if ((ret = priv_rpigrafx_mmal_enable_port_to_context(cp_encoders[i][j]->output[0],
+                                                          ctxs[i][j])))
+        goto end;
+
+end:
+    return ret;
+}
+
 static int connect_ports(const int i, const int len)
 {
     int j;
     struct cameras_config *cfg = &cameras_config[i];
+    const _Bool is_replay = priv_rpigrafx_replay_is_used(i);
     MMAL_STATUS_T status;
     int ret = 0;
 
@@ -811,29 +1593,53 @@ static int connect_ports(const int i, const int len)
         }
     }
 
-    status = mmal_connection_create(&conn_camera_splitters[i],
-                                    cp_cameras[i]->output[cfg->camera_output_port_index],
-                                    cp_splitters[i]->input[0],
-                                    MMAL_CONNECTION_FLAG_TUNNELLING);
-    if (status != MMAL_SUCCESS) {
-        print_error("Connecting " \
-                    "camera and splitter ports %d failed: 0x%08x", i, status);
-        ret = 1;
-        goto end;
-    }
-    for (j = 0; j < len; j ++) {
-        status = mmal_connection_create(&conn_splitters_isps[i][j],
-                                        cp_splitters[i]->output[j],
-                                        cp_isps[i][j]->input[0],
+    if (!is_replay && cfg->has_splitter) {
+        status = mmal_connection_create(&conn_camera_splitters[i],
+                                        cp_cameras[i]->output[cfg->camera_output_port_index],
+                                        cp_splitters[i]->input[0],
                                         MMAL_CONNECTION_FLAG_TUNNELLING);
         if (status != MMAL_SUCCESS) {
             print_error("Connecting " \
-                        "splitter and isp ports %d,%d failed: 0x%08x", i, j, status);
+                        "camera and splitter ports %d failed: 0x%08x", i, status);
             ret = 1;
             goto end;
         }
+    }
+    for (j = 0; j < len; j ++) {
+        MMAL_PORT_T *output = cfg->has_splitter
+                              ? cp_splitters[i]->output[j]
+                              : cp_cameras[i]->output[cfg->camera_output_port_index];
+
+        if (HAS_SCALER(i, j)) {
+            status = mmal_connection_create(&conn_splitters_isps[i][j],
+                                            output,
+                                            cp_isps[i][j]->input[0],
+                                            IS_DECIMATING(i, j)
+                                            ? 0 : MMAL_CONNECTION_FLAG_TUNNELLING);
+            if (status != MMAL_SUCCESS) {
+                print_error("Connecting " \
+                            "splitter and isp ports %d,%d failed: 0x%08x", i, j, status);
+                ret = 1;
+                goto end;
+            }
+            output = cp_isps[i][j]->output[0];
+        }
+        if (encoders_config[i][j].is_used) {
+            status = mmal_connection_create(&conn_isps_encoders[i][j],
+                                            output,
+                                            cp_encoders[i][j]->input[0],
+                                            MMAL_CONNECTION_FLAG_TUNNELLING);
+            if (status != MMAL_SUCCESS) {
+                print_error("Connecting " \
+                            "isp and encoder ports %d,%d failed: 0x%08x",
+                            i, j, status);
+                ret = 1;
+                goto end;
+            }
+            continue;
+        }
         status = mmal_connection_create(&conn_isps_renders[i][j],
-                                        cp_isps[i][j]->output[0],
+                                        output,
                                         cp_renders[i][j]->input[0],
                                         0);
         if (status != MMAL_SUCCESS) {
@@ -845,15 +1651,53 @@ static int connect_ports(const int i, const int len)
     }
 
     for (j = 0; j < len; j ++) {
-        conn_isps_renders[i][j]->callback = callback_conn;
-        status = mmal_connection_enable(conn_isps_renders[i][j]);
-        if (status != MMAL_SUCCESS) {
-            print_error("Enabling connection between " \
-                        "splitter and isp %d,%d failed: 0x%08x", i, j, status);
-            ret = 1;
-            goto end;
+        if (encoders_config[i][j].is_used) {
+            conn_isps_encoders[i][j]->callback = callback_conn;
+            status = mmal_connection_enable(conn_isps_encoders[i][j]);
+            if (status != MMAL_SUCCESS) {
+                print_error("Enabling connection between " \
+                            "isp and encoder %d,%d failed: 0x%08x",
+                            i, j, status);
+                ret = 1;
+                goto end;
+            }
+        } else {
+            if (cfg->is_capture_streaming) {
+                struct callback_context *ctx = ctxs[i][j];
+
+                ctx->queue = mmal_queue_create();
+                if (ctx->queue == NULL) {
+                    print_error("Creating queue of output %d,%d failed", i, j);
+                    ret = 1;
+                    goto end;
+                }
+                conn_isps_renders[i][j]->user_data = ctx;
+                conn_isps_renders[i][j]->callback = callback_conn_stream;
+            } else
+                conn_isps_renders[i][j]->callback = callback_conn;
+            ctxs[i][j]->conn = conn_isps_renders[i][j];
+            if (isps_config[i][j].buffer_num != 0) {
+                MMAL_CONNECTION_T *conn = conn_isps_renders[i][j];
+
+                conn->out->buffer_num = conn->in->buffer_num =
+                    MMAL_MAX(isps_config[i][j].buffer_num,
+                             conn->out->buffer_num_min);
+            }
+            status = mmal_connection_enable(conn_isps_renders[i][j]);
+            if (status != MMAL_SUCCESS) {
+                print_error("Enabling connection between " \
+                            "splitter and isp %d,%d failed: 0x%08x", i, j, status);
+                ret = 1;
+                goto end;
+            }
         }
-        conn_splitters_isps[i][j]->callback = callback_conn;
+        if (!HAS_SCALER(i, j))
+            continue;
+        if (IS_DECIMATING(i, j)) {
+            conn_splitters_isps[i][j]->user_data = &decimations_config[i][j];
+            conn_splitters_isps[i][j]->callback = callback_conn_decimate;
+        } else
+            conn_splitters_isps[i][j]->callback = callback_conn;
         status = mmal_connection_enable(conn_splitters_isps[i][j]);
         if (status != MMAL_SUCCESS) {
             print_error("Enabling connection between " \
@@ -872,23 +1716,43 @@ static int connect_ports(const int i, const int len)
             goto end;
         }
     }
-    conn_camera_splitters[i]->callback = callback_conn;
-    status = mmal_connection_enable(conn_camera_splitters[i]);
-    if (status != MMAL_SUCCESS) {
-        print_error("Enabling connection between " \
-                    "camera and splitter %d,%d failed: 0x%08x", i, j, status);
-        ret = 1;
-        goto end;
+    if (!is_replay && cfg->has_splitter) {
+        conn_camera_splitters[i]->callback = callback_conn;
+        status = mmal_connection_enable(conn_camera_splitters[i]);
+        if (status != MMAL_SUCCESS) {
+            print_error("Enabling connection between " \
+                        "camera and splitter %d,%d failed: 0x%08x", i, j, status);
+            ret = 1;
+            goto end;
+        }
     }
 
     for (j = 0; j < len; j ++) {
         MMAL_BUFFER_HEADER_T *header = NULL;
         MMAL_CONNECTION_T *conn = conn_isps_renders[i][j];
+
+        /* Encoder outputs have no isp-render connection to prime. */
+        if (!encoders_config[i][j].is_used) {
+            while ((header = mmal_queue_get(conn->pool->queue)) != NULL) {
+                status = mmal_port_send_buffer(conn->out, header);
+                if (status != MMAL_SUCCESS) {
+                    print_error("Sending pool buffer to "
+                                "isp-render conn %d,%d failed: 0x%08x",
+                                i, j, status);
+                    ret = 1;
+                    goto end;
+                }
+            }
+        }
+        if (!HAS_SCALER(i, j) || !IS_DECIMATING(i, j))
+            continue;
+        conn = conn_splitters_isps[i][j];
         while ((header = mmal_queue_get(conn->pool->queue)) != NULL) {
             status = mmal_port_send_buffer(conn->out, header);
             if (status != MMAL_SUCCESS) {
                 print_error("Sending pool buffer to "
-                            "isp-render conn %d,%d failed: 0x%08x", status);
+                            "splitter-isp conn %d,%d failed: 0x%08x",
+                            i, j, status);
                 ret = 1;
                 goto end;
             }
@@ -899,105 +1763,907 @@ end:
     return ret;
 }
 
-int rpigrafx_finish_config()
+static int start_capture_stream(const int i)
 {
-    int i, j;
+    struct cameras_config *cfg = &cameras_config[i];
+    MMAL_STATUS_T status;
     int ret = 0;
 
-    for (i = 0; i < num_cameras; i ++) {
-        int len;
-        /* Maximum width/height of the requested frames. */
-        int32_t max_width, max_height;
-        struct cameras_config *cfg = &cameras_config[i];
+    status = mmal_port_parameter_set_boolean(cp_cameras[i]->output[cfg->camera_output_port_index],
+                                             MMAL_PARAMETER_CAPTURE, MMAL_TRUE);
+    if (status != MMAL_SUCCESS) {
+        print_error("Starting capture stream of "
+                    "camera %d output %d failed: 0x%08x",
+                    i, cfg->camera_output_port_index, status);
+        ret = 1;
+        goto end;
+    }
 
-        if (!cameras_config[i].is_used)
-            continue;
+end:
+    return ret;
+}
 
-        len = splitters_config[i].next_output_idx;
+static void prune_topology(const int i, const int len)
+{
+    struct cameras_config *cfg = &cameras_config[i];
+    const MMAL_FOURCC_T encoding = isps_config[i][0].encoding;
 
-        max_width = max_height = 0;
-        for (j = 0; j < len; j ++) {
-            max_width  = MMAL_MAX(max_width,  isps_config[i][j].width);
-            max_height = MMAL_MAX(max_height, isps_config[i][j].height);
-        }
+    cfg->has_splitter = cfg->has_isp = !0;
 
-        if ((ret = setup_cp_camera(i, max_width, max_height,
-                                   cfg->use_camera_capture_port)))
-            goto end;
-        if ((ret = setup_cp_splitter(i, len, max_width, max_height)))
-            goto end;
-        if (cfg->use_camera_capture_port)
-            if ((ret = setup_cp_null(i, max_width, max_height)))
-                goto end;
-        for (j = 0; j < len; j ++) {
-            if ((ret = setup_cp_isp(i, j, max_width, max_height)))
+    /* Replay sources feed the splitter input. */
+    if (priv_rpigrafx_replay_is_used(i) || len != 1)
+        return;
+    cfg->has_splitter = 0;
+
+    /*
+     * The camera port scales and converts to these encodings by itself.
+     * Decimation drops headers in front of the isp and cached outputs need
+     * its output port, so keep it then.
+     */
+    if (!IS_DECIMATING(i, 0) && !lowres_config[i][0].is_used
+            && !isps_config[i][0].is_cached
+            && isps_config[i][0].scaler != RPIGRAFX_SCALER_ISP
+            && isps_config[i][0].scaler != RPIGRAFX_SCALER_RESIZE
+            && (encoding == MMAL_ENCODING_RGB24
+                || encoding == MMAL_ENCODING_BGR24
+                || encoding == MMAL_ENCODING_I420))
+        cfg->has_isp = 0;
+}
+
+/*
+ * Pick the scaler of output j fed with max_width x max_height RGB24 frames.
+ * vc.ril.resize only scales, so the isp is kept for conversions, crops and
+ * a second output; neither is needed for an RGB24 frame of the input size.
+ */
+static int resolve_scaler(const int i, const int j,
+                          const int32_t max_width, const int32_t max_height)
+{
+    struct isps_config *icfg = &isps_config[i][j];
+    const _Bool needs_isp = icfg->encoding != MMAL_ENCODING_RGB24
+                            || lowres_config[i][j].is_used || icfg->is_slice;
+    const _Bool needs_port = needs_isp || IS_DECIMATING(i, j) || icfg->is_cached
+                             || icfg->width != max_width
+                             || icfg->height != max_height;
+    int ret = 0;
+
+    switch (icfg->scaler) {
+        case RPIGRAFX_SCALER_AUTO:
+            icfg->scaler_used = needs_isp ? RPIGRAFX_SCALER_ISP
+                                : needs_port ? RPIGRAFX_SCALER_RESIZE
+                                : RPIGRAFX_SCALER_NONE;
+            break;
+        case RPIGRAFX_SCALER_RESIZE:
+            if (needs_isp) {
+                print_error("Output %d,%d needs the isp, not resize", i, j);
+                ret = 1;
                 goto end;
-            if ((ret = setup_cp_render(i, j)))
+            }
+            icfg->scaler_used = icfg->scaler;
+            break;
+        case RPIGRAFX_SCALER_NONE:
+            if (needs_port) {
+                print_error("Output %d,%d needs a scaler", i, j);
+                ret = 1;
                 goto end;
-        }
-        if ((ret = connect_ports(i, len)))
-            goto end;
+            }
+            icfg->scaler_used = icfg->scaler;
+            break;
+        case RPIGRAFX_SCALER_ISP:
+        default:
+            icfg->scaler_used = RPIGRAFX_SCALER_ISP;
+            break;
     }
 
 end:
     return ret;
 }
 
-int rpigrafx_capture_next_frame(rpigrafx_frame_config_t *fcp)
+/*
+ * Resolve the topology of camera i from the pending configuration.
+ * Used by both rpigrafx_plan_config and rpigrafx_finish_config.
+ */
+static int resolve_camera(const int i, const int len,
+                          int32_t *max_widthp, int32_t *max_heightp)
 {
-    struct callback_context *ctx = fcp->ctx;
-    struct cameras_config *cfg = &cameras_config[fcp->camera_number];
+    struct cameras_config *cfg = &cameras_config[i];
+    int32_t max_width = 0, max_height = 0;
+    int j;
     int ret = 0;
-    MMAL_BUFFER_HEADER_T *header = NULL;
-    MMAL_CONNECTION_T *conn = conn_isps_renders[fcp->camera_number][fcp->splitter_output_port_index];
 
-    if (cfg->use_camera_capture_port) {
-        MMAL_STATUS_T status;
+    if (cfg->group_leader >= 0 && cfg->group_leader != i) {
+        const struct cameras_config *leader = &cameras_config[cfg->group_leader];
 
-        status = mmal_port_parameter_set_boolean(cp_cameras[fcp->camera_number]->output[cfg->camera_output_port_index],
-                                                 MMAL_PARAMETER_CAPTURE, MMAL_TRUE);
-        if (status != MMAL_SUCCESS) {
-            print_error("Setting capture to "
-                        "camera %d output %d failed: 0x%08x\n",
-                        fcp->camera_number, cfg->camera_output_port_index,
-                        status);
-            ret = 1;
-            goto end;
-        }
+        cfg->camera_output_port_index = leader->camera_output_port_index;
+        cfg->use_camera_capture_port = leader->use_camera_capture_port;
+        cfg->is_capture_streaming = leader->is_capture_streaming;
     }
 
-    if (ctx->header != NULL && !ctx->is_header_passed_to_render) {
-        if (priv_rpigrafx_verbose)
-            WARN_HEADER("Releasing header ", ctx->header, "");
-        mmal_buffer_header_release(ctx->header);
+    /* Maximum width/height of the requested frames. */
+    for (j = 0; j < len; j ++) {
+        max_width  = MMAL_MAX(max_width,  isps_config[i][j].width);
+        max_height = MMAL_MAX(max_height, isps_config[i][j].frame_height);
     }
-    ctx->header = NULL;
-    ctx->is_header_passed_to_render = 0;
 
-retry:
+    prune_topology(i, len);
 
-    while ((header = mmal_queue_get(conn->pool->queue)) != NULL) {
-        if (priv_rpigrafx_verbose)
-            WARN_HEADER("Got header ", header, " from conn->pool->queue; " \
-                                               "Sending to conn->out");
-        mmal_port_send_buffer(conn->out, header);
+    if (priv_rpigrafx_replay_is_used(i)) {
+        /* The replay source takes the place of the camera. */
+        priv_rpigrafx_replay_get_size(i, &max_width, &max_height);
+        cfg->use_camera_capture_port = 0;
+        cfg->is_capture_streaming = 0;
     }
 
-    header = mmal_queue_wait(conn->queue);
-    if (priv_rpigrafx_verbose)
-        WARN_HEADER("Got header ", header, " from conn->queue");
-    /*
-     * camera[2] returns empty queue once every two headers.
-     * Retry until we get the full header.
-     */
-    if (header->length == 0) {
+    for (j = 0; j < len; j ++) {
+        if (!cfg->has_isp) {
+            isps_config[i][j].scaler_used = RPIGRAFX_SCALER_NONE;
+            continue;
+        }
+        if ((ret = resolve_scaler(i, j, max_width, max_height)))
+            goto end;
+    }
+
+    *max_widthp = max_width;
+    *max_heightp = max_height;
+
+end:
+    return ret;
+}
+
+/* Rough firmware defaults, used for planning only. */
+#define PLAN_BUFFER_NUM       3
+#define PLAN_H264_BUFFER_NUM  1
+#define PLAN_H264_BUFFER_SIZE (1 << 16)
+#define PLAN_OPAQUE_SIZE      128
+
+static uint32_t plan_frame_size(const MMAL_FOURCC_T encoding,
+                                const int32_t width, const int32_t height)
+{
+    const uint32_t pixels = VCOS_ALIGN_UP(width, 32) * VCOS_ALIGN_UP(height, 16);
+
+    switch (encoding) {
+        case MMAL_ENCODING_OPAQUE:
+            return PLAN_OPAQUE_SIZE;
+        case MMAL_ENCODING_I420:
+        case MMAL_ENCODING_YV12:
+            return pixels * 3 / 2;
+        case MMAL_ENCODING_RGBA:
+        case MMAL_ENCODING_BGRA:
+            return pixels * 4;
+        case MMAL_ENCODING_RGB24:
+        case MMAL_ENCODING_BGR24:
+        default:
+            return pixels * 3;
+    }
+}
+
+static int plan_add(rpigrafx_plan_t *plan,
+                    const int32_t camera_number, const int32_t output,
+                    const char *port,
+                    const uint32_t buffer_num, const uint32_t buffer_size,
+                    const _Bool is_mapped_to_arm)
+{
+    rpigrafx_plan_entry_t *e = NULL;
+
+    if (plan->num_entries == RPIGRAFX_PLAN_MAX_ENTRIES) {
+        print_error("Too many plan entries(%d)", plan->num_entries);
+        return 1;
+    }
+    e = &plan->entries[plan->num_entries ++];
+    e->camera_number = camera_number;
+    e->output = output;
+    snprintf(e->port, sizeof(e->port), "%s", port);
+    e->buffer_num = buffer_num;
+    e->buffer_size = buffer_size;
+    e->gpu_bytes = (size_t) buffer_num * buffer_size;
+    e->arm_bytes = is_mapped_to_arm ? e->gpu_bytes : 0;
+    plan->gpu_total += e->gpu_bytes;
+    plan->arm_total += e->arm_bytes;
+    plan->buffer_total += buffer_num;
+    return 0;
+}
+
+/* Free relocatable heap as reported by the firmware, e.g. "reloc=180M". */
+static size_t query_gpu_available()
+{
+    char buf[64];
+    unsigned long n;
+    char unit = '\0';
+    size_t size = 0;
+
+    /* The gencmd service is opened by bcm_host_init. */
+    if (vc_gencmd(buf, sizeof(buf), "get_mem reloc") == 0
+            && sscanf(buf, "reloc=%lu%c", &n, &unit) >= 1) {
+        size = n;
+        if (unit == 'K')
+            size <<= 10;
+        else if (unit == 'M')
+            size <<= 20;
+        else if (unit == 'G')
+            size <<= 30;
+    }
+    return size;
+}
+
+/*
+ * Planning resolves the topology in place like rpigrafx_finish_config, so
+ * the pending configuration is saved and restored around it.
+ */
+int rpigrafx_plan_config(rpigrafx_plan_t *plan)
+{
+    struct cameras_config saved_cameras[MAX_CAMERAS];
+    struct isps_config saved_isps[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
+    int i, j;
+    int ret = 0;
+
+    memcpy(saved_cameras, cameras_config, sizeof(saved_cameras));
+    memcpy(saved_isps, isps_config, sizeof(saved_isps));
+    memset(plan, 0, sizeof(*plan));
+
+    for (i = 0; i < MAX_CAMERAS; i ++) {
+        const struct cameras_config *cfg = &cameras_config[i];
+        const int len = splitters_config[i].next_output_idx;
+        int32_t max_width, max_height;
+        uint32_t size;
+
+        if (!cfg->is_used)
+            continue;
+
+        if ((ret = resolve_camera(i, len, &max_width, &max_height)))
+            goto end;
+
+        if (cfg->use_camera_capture_port)
+            if ((ret = plan_add(plan, i, -1, "camera preview",
+                                PLAN_BUFFER_NUM,
+                                plan_frame_size(MMAL_ENCODING_OPAQUE,
+                                                max_width, max_height), 0)))
+                goto end;
+        size = plan_frame_size(cfg->has_isp
+                               ? MMAL_ENCODING_RGB24 : isps_config[i][0].encoding,
+                               max_width, max_height);
+        if (priv_rpigrafx_replay_is_used(i)) {
+            if ((ret = plan_add(plan, i, -1, "replay", PLAN_BUFFER_NUM,
+                                size, !0)))
+                goto end;
+        } else if (cfg->has_splitter || cfg->has_isp) {
+            if ((ret = plan_add(plan, i, -1, "camera", PLAN_BUFFER_NUM,
+                                size, 0)))
+                goto end;
+        }
+
+        for (j = 0; j < len; j ++) {
+            const struct isps_config *icfg = &isps_config[i][j];
+            const _Bool is_decimated = IS_DECIMATING(i, j);
+            const _Bool is_encoded = encoders_config[i][j].is_used;
+
+            if (cfg->has_splitter)
+                if ((ret = plan_add(plan, i, j, "video_splitter",
+                                    PLAN_BUFFER_NUM,
+                                    plan_frame_size(MMAL_ENCODING_RGB24,
+                                                    max_width, max_height),
+                                    is_decimated)))
+                    goto end;
+            /* The last port before render or encoder. */
+            if ((ret = plan_add(plan, i, j,
+                                HAS_SCALER(i, j) ? scaler_names[icfg->scaler_used]
+                                : cfg->has_splitter ? "video_splitter"
+                                : "camera",
+                                icfg->buffer_num != 0 && !is_encoded
+                                ? icfg->buffer_num : PLAN_BUFFER_NUM,
+                                plan_frame_size(icfg->encoding,
+                                                icfg->width, icfg->height),
+                                !is_encoded)))
+                goto end;
+            if (lowres_config[i][j].is_used)
+                if ((ret = plan_add(plan, i, j, "isp output 1", LOWRES_BUFFER_NUM,
+                                    plan_frame_size(lowres_config[i][j].encoding,
+                                                    lowres_config[i][j].width,
+                                                    lowres_config[i][j].height),
+                                    !0)))
+                    goto end;
+            if (is_encoded)
+                if ((ret = plan_add(plan, i, j, "video_encode",
+                                    PLAN_H264_BUFFER_NUM, PLAN_H264_BUFFER_SIZE,
+                                    !0)))
+                    goto end;
+        }
+    }
+
+    plan->gpu_available = query_gpu_available();
+    if (plan->gpu_available != 0 && plan->gpu_total > plan->gpu_available) {
+        print_error("Configuration needs %zu bytes of GPU memory "
+                    "but only %zu bytes are available",
+                    plan->gpu_total, plan->gpu_available);
+        ret = 1;
+        goto end;
+    }
+
+end:
+    memcpy(cameras_config, saved_cameras, sizeof(saved_cameras));
+    memcpy(isps_config, saved_isps, sizeof(saved_isps));
+    return ret;
+}
+
+/*
+ * Components are set up by independent tasks: the chain of a camera
+ * (camera, splitter and null) and the branch of each output (scaler and
+ * render or encoder).  A task only makes synchronous VCHIQ round trips on
+ * its own components, so tasks run on threads of their own and the setup
+ * takes as long as the slowest task rather than the sum of them.  The
+ * ports of a camera are connected once all of its tasks are done.
+ */
+enum setup_step {
+    SETUP_CAMERA,
+    SETUP_SPLITTER,
+    SETUP_NULL,
+    SETUP_SCALER,
+    SETUP_SINK,
+    SETUP_CONNECT,
+    SETUP_STEP_MAX
+};
+
+static const char *setup_step_names[SETUP_STEP_MAX] = {
+    [SETUP_CAMERA]   = "camera",
+    [SETUP_SPLITTER] = "splitter",
+    [SETUP_NULL]     = "null",
+    [SETUP_SCALER]   = "scaler",
+    [SETUP_SINK]     = "sink",
+    [SETUP_CONNECT]  = "connect"
+};
+
+struct setup_task {
+    /* Output j of camera i, or the chain of camera i if j < 0. */
+    int i, j;
+    int len;
+    _Bool is_connecting;
+    int32_t max_width, max_height;
+    pthread_t thread;
+    _Bool is_threaded;
+    int ret;
+    /* Duration of each step in us, 0 if not run. */
+    int64_t times[SETUP_STEP_MAX];
+};
+
+static int64_t get_time()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static void setup_step_done(struct setup_task *t, const enum setup_step step,
+                            int64_t *startp)
+{
+    const int64_t now = get_time();
+
+    t->times[step] = MMAL_MAX(now - *startp, 1);
+    *startp = now;
+}
+
+static int run_setup_task(struct setup_task *t)
+{
+    const int i = t->i, j = t->j;
+    const struct cameras_config *cfg = &cameras_config[i];
+    int64_t start = get_time();
+    int ret = 0;
+
+    if (t->is_connecting) {
+        if ((ret = connect_ports(i, t->len)))
+            goto end;
+        setup_step_done(t, SETUP_CONNECT, &start);
+    } else if (j < 0) {
+        if (!priv_rpigrafx_replay_is_used(i)) {
+            if ((ret = setup_cp_camera(i, t->max_width, t->max_height,
+                                       cfg->has_isp
+                                       ? MMAL_ENCODING_RGB24
+                                       : isps_config[i][0].encoding,
+                                       cfg->use_camera_capture_port)))
+                goto end;
+            setup_step_done(t, SETUP_CAMERA, &start);
+        }
+        if (cfg->has_splitter) {
+            if ((ret = setup_cp_splitter(i, t->len, t->max_width, t->max_height)))
+                goto end;
+            setup_step_done(t, SETUP_SPLITTER, &start);
+        }
+        if (cfg->use_camera_capture_port) {
+            if ((ret = setup_cp_null(i, t->max_width, t->max_height)))
+                goto end;
+            setup_step_done(t, SETUP_NULL, &start);
+        }
+    } else {
+        if (HAS_SCALER(i, j)) {
+            if ((ret = setup_cp_isp(i, j, t->max_width, t->max_height)))
+                goto end;
+            setup_step_done(t, SETUP_SCALER, &start);
+        }
+        if (encoders_config[i][j].is_used)
+            ret = setup_cp_encoder(i, j);
+        else
+            ret = setup_cp_render(i, j);
+        if (ret)
+            goto end;
+        setup_step_done(t, SETUP_SINK, &start);
+    }
+
+end:
+    return ret;
+}
+
+static void* setup_thread(void *arg)
+{
+    struct setup_task *t = arg;
+
+    t->ret = run_setup_task(t);
+    return NULL;
+}
+
+/* Run tasks concurrently; a task whose thread cannot be created runs here. */
+static int run_setup_tasks(struct setup_task *tasks, const int num_tasks)
+{
+    int k;
+    int ret = 0;
+
+    for (k = 0; k < num_tasks; k ++) {
+        struct setup_task *t = &tasks[k];
+
+        t->is_threaded = num_tasks > 1
+                         && pthread_create(&t->thread, NULL, setup_thread, t) == 0;
+        if (!t->is_threaded)
+            t->ret = run_setup_task(t);
+    }
+    for (k = 0; k < num_tasks; k ++) {
+        if (tasks[k].is_threaded)
+            pthread_join(tasks[k].thread, NULL);
+        ret |= tasks[k].ret;
+    }
+    return ret;
+}
+
+static void report_setup_tasks(const struct setup_task *tasks,
+                               const int num_tasks, const int64_t total)
+{
+    int64_t sum = 0;
+    int k, step;
+
+    for (k = 0; k < num_tasks; k ++) {
+        const struct setup_task *t = &tasks[k];
+
+        for (step = 0; step < SETUP_STEP_MAX; step ++) {
+            if (t->times[step] == 0)
+                continue;
+            sum += t->times[step];
+            if (t->j < 0)
+                print_error("Setup of camera %d %s took %.1f ms",
+                            t->i, setup_step_names[step], t->times[step] * 1e-3);
+            else
+                print_error("Setup of camera %d output %d %s took %.1f ms",
+                            t->i, t->j, setup_step_names[step],
+                            t->times[step] * 1e-3);
+        }
+    }
+    print_error("Setup took %.1f ms in total, %.1f ms of steps",
+                total * 1e-3, sum * 1e-3);
+}
+
+int rpigrafx_finish_config()
+{
+    int i, j;
+    rpigrafx_plan_t plan;
+    struct setup_task tasks[MAX_CAMERAS * (NUM_SPLITTER_OUTPUTS + 2)];
+    int num_tasks = 0, num_setups;
+    const int64_t start = get_time();
+    int ret = 0;
+
+    /* Reject infeasible configurations before building anything. */
+    if ((ret = rpigrafx_plan_config(&plan)))
+        goto end;
+
+    /* Resolve all cameras first; members of a group read their leader. */
+    for (i = 0; i < MAX_CAMERAS; i ++) {
+        const int len = splitters_config[i].next_output_idx;
+        int32_t max_width, max_height;
+
+        if (!cameras_config[i].is_used)
+            continue;
+        if ((ret = resolve_camera(i, len, &max_width, &max_height)))
+            goto end;
+        for (j = -1; j < len; j ++)
+            tasks[num_tasks ++] = (struct setup_task) {
+                .i = i, .j = j, .len = len,
+                .max_width = max_width, .max_height = max_height
+            };
+    }
+    num_setups = num_tasks;
+    if ((ret = run_setup_tasks(tasks, num_setups)))
+        goto end;
+
+    for (i = 0; i < MAX_CAMERAS; i ++)
+        if (cameras_config[i].is_used)
+            tasks[num_tasks ++] = (struct setup_task) {
+                .i = i, .j = -1, .is_connecting = !0,
+                .len = splitters_config[i].next_output_idx
+            };
+    if ((ret = run_setup_tasks(tasks + num_setups, num_tasks - num_setups)))
+        goto end;
+
+    for (i = 0; i < MAX_CAMERAS; i ++) {
+        if (!cameras_config[i].is_used)
+            continue;
+        if (priv_rpigrafx_replay_is_used(i))
+            if ((ret = priv_rpigrafx_replay_start(i, cp_splitters[i]->input[0])))
+                goto end;
+        if (cameras_config[i].is_capture_streaming)
+            if ((ret = start_capture_stream(i)))
+                goto end;
+    }
+    if ((ret = priv_rpigrafx_present_start()))
+        goto end;
+
+    if (priv_rpigrafx_verbose)
+        report_setup_tasks(tasks, num_tasks, get_time() - start);
+
+end:
+    return ret;
+}
+
+int priv_rpigrafx_mmal_get_output_format(const rpigrafx_frame_config_t *fcp,
+                                         int32_t *widthp, int32_t *heightp,
+                                         MMAL_FOURCC_T *encodingp)
+{
+    const struct isps_config *icfg = NULL;
+    int ret = 0;
+
+    if (fcp->camera_number < 0 || fcp->camera_number >= MAX_CAMERAS) {
+        print_error("Output of camera %d has no fixed format",
+                    fcp->camera_number);
+        ret = 1;
+        goto end;
+    }
+    icfg = &isps_config[fcp->camera_number][fcp->splitter_output_port_index];
+    *widthp = icfg->width;
+    *heightp = icfg->height;
+    *encodingp = icfg->encoding;
+
+end:
+    return ret;
+}
+
+int priv_rpigrafx_mmal_set_slice(const rpigrafx_frame_config_t *fcp,
+                                  const int32_t slice_y,
+                                  const int32_t frame_height)
+{
+    struct isps_config *icfg = NULL;
+    int ret = 0;
+
+    if (fcp->camera_number < 0) {
+        print_error("Graph outputs cannot be sliced");
+        ret = 1;
+        goto end;
+    }
+    icfg = &isps_config[fcp->camera_number][fcp->splitter_output_port_index];
+    icfg->is_slice = !0;
+    icfg->slice_y = slice_y;
+    icfg->frame_height = frame_height;
+
+end:
+    return ret;
+}
+
+int priv_rpigrafx_mmal_set_adaptive(const rpigrafx_frame_config_t *fcp)
+{
+    int ret = 0;
+
+    if (fcp->camera_number < 0) {
+        print_error("Graph outputs cannot be adaptive");
+        ret = 1;
+        goto end;
+    }
+    decimations_config[fcp->camera_number][fcp->splitter_output_port_index].is_adaptive = !0;
+
+end:
+    return ret;
+}
+
+/* Change the sensor frame rate while the camera is running. */
+int priv_rpigrafx_mmal_set_camera_fps(const int32_t camera_number,
+                                      const double fps)
+{
+    const struct cameras_config *cfg = &cameras_config[camera_number];
+    MMAL_PARAMETER_FPS_RANGE_T range = {
+        .hdr = {
+            .id = MMAL_PARAMETER_FPS_RANGE,
+            .size = sizeof(range)
+        },
+        .fps_low  = { (int32_t) (fps * 256), 256 },
+        .fps_high = { (int32_t) (fps * 256), 256 }
+    };
+    MMAL_STATUS_T status;
+    int ret = 0;
+
+    if (priv_rpigrafx_replay_is_used(camera_number) || cp_cameras[camera_number] == NULL) {
+        print_error("Camera %d has no sensor rate to change", camera_number);
+        ret = 1;
+        goto end;
+    }
+    status = mmal_port_parameter_set(cp_cameras[camera_number]->output[cfg->camera_output_port_index],
+                                     &range.hdr);
+    if (status != MMAL_SUCCESS) {
+        print_error("Setting frame rate of camera %d failed: 0x%08x",
+                    camera_number, status);
+        ret = 1;
+        goto end;
+    }
+
+end:
+    return ret;
+}
+
+/* Current STC of a camera, the clock of the pts of its frames, in us. */
+int priv_rpigrafx_mmal_get_camera_stc(const int32_t camera_number,
+                                      int64_t *stcp)
+{
+    const struct cameras_config *cfg = &cameras_config[camera_number];
+    uint64_t stc;
+    MMAL_STATUS_T status;
+    int ret = 0;
+
+    if (cp_cameras[camera_number] == NULL) {
+        print_error("Camera %d is not set up", camera_number);
+        ret = 1;
+        goto end;
+    }
+    status = mmal_port_parameter_get_uint64(cp_cameras[camera_number]->output[cfg->camera_output_port_index],
+                                            MMAL_PARAMETER_SYSTEM_TIME, &stc);
+    if (status != MMAL_SUCCESS) {
+        print_error("Getting STC of camera %d failed: 0x%08x",
+                    camera_number, status);
+        ret = 1;
+        goto end;
+    }
+    *stcp = (int64_t) stc;
+
+end:
+    return ret;
+}
+
+int priv_rpigrafx_mmal_set_camera_group(const int32_t camera_number,
+                                        const int32_t leader)
+{
+    int ret = 0;
+
+    if (camera_number < 0 || camera_number >= num_cameras) {
+        print_error("camera_number(%d) exceeds num_cameras(%d)",
+                    camera_number, num_cameras);
+        ret = 1;
+        goto end;
+    }
+    cameras_config[camera_number].group_leader = leader;
+
+end:
+    return ret;
+}
+
+static void append(char *buf, const size_t size, size_t *offp,
+                   const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (*offp >= size)
+        return;
+    va_start(ap, fmt);
+    n = vsnprintf(buf + *offp, size - *offp, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        *offp += n;
+}
+
+int rpigrafx_get_topology(const int32_t camera_number,
+                          char *buf, const size_t size)
+{
+    struct cameras_config *cfg = NULL;
+    size_t off = 0;
+    int j, len;
+    int ret = 0;
+
+    if (camera_number < 0 || camera_number >= MAX_CAMERAS
+            || !cameras_config[camera_number].is_used) {
+        print_error("Camera %d is not configured", camera_number);
+        ret = 1;
+        goto end;
+    }
+    cfg = &cameras_config[camera_number];
+    len = splitters_config[camera_number].next_output_idx;
+
+    if (size > 0)
+        buf[0] = '\0';
+    if (cfg->use_camera_capture_port)
+        append(buf, size, &off, "camera [%d] --- null_sink\n",
+               CAMERA_PREVIEW_PORT);
+    for (j = 0; j < len; j ++) {
+        if (priv_rpigrafx_replay_is_used(camera_number))
+            append(buf, size, &off, "replay");
+        else
+            append(buf, size, &off, "camera [%u]", cfg->camera_output_port_index);
+        if (cfg->has_splitter)
+            append(buf, size, &off, " --- video_splitter [%d]", j);
+        if (HAS_SCALER(camera_number, j))
+            append(buf, size, &off, " --- %s",
+                   scaler_names[isps_config[camera_number][j].scaler_used]);
+        if (isps_config[camera_number][j].is_slice)
+            append(buf, size, &off, " (rows %d-%d)",
+                   isps_config[camera_number][j].slice_y,
+                   isps_config[camera_number][j].slice_y
+                   + isps_config[camera_number][j].height);
+        if (encoders_config[camera_number][j].is_used)
+            append(buf, size, &off, " --- video_encode --- ARM\n");
+        else
+            append(buf, size, &off, " --- ARM --- video_render\n");
+        if (lowres_config[camera_number][j].is_used)
+            append(buf, size, &off, "isp [1] --- ARM\n");
+    }
+    if (off >= size) {
+        print_error("Topology of camera %d exceeds the buffer", camera_number);
+        ret = 1;
+        goto end;
+    }
+
+end:
+    return ret;
+}
+
+static MMAL_QUEUE_T *get_frame_queue(struct callback_context *ctx)
+{
+    return ctx->queue != NULL ? ctx->queue : ctx->conn->queue;
+}
+
+/* Return the free headers of ctx to the port filling them. */
+static void send_free_headers(struct callback_context *ctx)
+{
+    MMAL_BUFFER_HEADER_T *header = NULL;
+
+    if (ctx->port != NULL) {
+        while ((header = mmal_queue_get(ctx->pool->queue)) != NULL) {
+            TRACE_HEADER(1, TRACE_CAPTURE_SEND, header);
+            mmal_port_send_buffer(ctx->port, header);
+        }
+    } else if (ctx->queue == NULL) {
+        while ((header = mmal_queue_get(ctx->conn->pool->queue)) != NULL) {
+            TRACE_HEADER(1, TRACE_CAPTURE_SEND, header);
+            mmal_port_send_buffer(ctx->conn->out, header);
+        }
+    }
+}
+
+/*
+ * Take the next frame of ctx, or NULL if none is queued and !is_waiting.
+ * Empty headers are already filtered by the callbacks of ports read by ARM
+ * and of streams.
+ */
+static MMAL_BUFFER_HEADER_T *get_header(struct callback_context *ctx,
+                                        const _Bool is_waiting)
+{
+    MMAL_QUEUE_T *queue = get_frame_queue(ctx);
+    MMAL_BUFFER_HEADER_T *header = NULL;
+
+    for (;;) {
+        send_free_headers(ctx);
+        header = is_waiting ? mmal_queue_wait(queue) : mmal_queue_get(queue);
+        /*
+         * camera[2] returns empty queue once every two headers.
+         * Retry until we get the full header.
+         */
+        if (header == NULL || ctx->queue != NULL || header->length != 0)
+            break;
+        TRACE_HEADER(1, TRACE_CAPTURE_EMPTY, header);
+        STATS_ADD(ctx, num_empty, 1);
         mmal_buffer_header_release(header);
-        goto retry;
+    }
+    if (header != NULL)
+        TRACE_HEADER(1, TRACE_CAPTURE_GOT, header);
+    return header;
+}
+
+/* Release the frame of ctx unless it is rendered and wait for the next. */
+static void capture_header(struct callback_context *ctx)
+{
+    if (ctx->header != NULL && !ctx->is_header_passed_to_render) {
+        TRACE_HEADER(1, TRACE_CAPTURE_RELEASE, ctx->header);
+        mmal_buffer_header_release(ctx->header);
+    }
+    ctx->header = NULL;
+    ctx->is_header_passed_to_render = 0;
+    ctx->header = get_header(ctx, !0);
+}
+
+/*
+ * Replace the frame of fcp until it is not older than pts, bypassing the
+ * gate, statistics and overload control of rpigrafx_capture_next_frame.
+ * Replaced frames count as dropped.
+ */
+void priv_rpigrafx_mmal_capture_until(rpigrafx_frame_config_t *fcp,
+                                      const int64_t pts)
+{
+    struct callback_context *ctx = fcp->ctx;
+
+    if (pts == MMAL_TIME_UNKNOWN)
+        return;
+    while (ctx->header != NULL && ctx->header->pts != MMAL_TIME_UNKNOWN
+           && ctx->header->pts < pts) {
+        STATS_ADD(ctx, num_dropped, 1);
+        capture_header(ctx);
+    }
+}
+
+/* Release the queued frames of fcp up to pts without waiting for more. */
+void priv_rpigrafx_mmal_drop_until(rpigrafx_frame_config_t *fcp,
+                                   const int64_t pts)
+{
+    struct callback_context *ctx = fcp->ctx;
+    MMAL_BUFFER_HEADER_T *header = NULL;
+
+    if (pts == MMAL_TIME_UNKNOWN)
+        return;
+    while ((header = get_header(ctx, 0)) != NULL) {
+        if (header->pts == MMAL_TIME_UNKNOWN || header->pts > pts) {
+            mmal_queue_put_back(get_frame_queue(ctx), header);
+            break;
+        }
+        TRACE_HEADER(1, TRACE_CAPTURE_RELEASE, header);
+        mmal_buffer_header_release(header);
+        STATS_ADD(ctx, num_dropped, 1);
+    }
+    send_free_headers(ctx);
+}
+
+int rpigrafx_capture_next_frame(rpigrafx_frame_config_t *fcp)
+{
+    struct callback_context *ctx = fcp->ctx;
+    /* Frames of a graph built by rpigrafx_graph_build have no camera. */
+    struct cameras_config *cfg = fcp->camera_number < 0
+                                 ? NULL : &cameras_config[fcp->camera_number];
+    int64_t gate_pts = MMAL_TIME_UNKNOWN;
+    int ret = 0;
+    unsigned backlog = 0;
+
+    if (cfg != NULL)
+        if ((ret = priv_rpigrafx_motion_wait(fcp, &gate_pts)))
+            goto end;
+
+    if (cfg != NULL && cfg->use_camera_capture_port && !cfg->is_capture_streaming) {
+        MMAL_STATUS_T status;
+
+        status = mmal_port_parameter_set_boolean(cp_cameras[fcp->camera_number]->output[cfg->camera_output_port_index],
+                                                 MMAL_PARAMETER_CAPTURE, MMAL_TRUE);
+        if (status != MMAL_SUCCESS) {
+            print_error("Setting capture to "
+                        "camera %d output %d failed: 0x%08x\n",
+                        fcp->camera_number, cfg->camera_output_port_index,
+                        status);
+            ret = 1;
+            goto end;
+        }
     }
 
-    ctx->header = header;
+    capture_header(ctx);
+    /* Skip the frames queued before the one the motion gate let through. */
+    priv_rpigrafx_mmal_capture_until(fcp, gate_pts);
 
 end:
+    if (ret == 0) {
+        MMAL_QUEUE_T *queue = get_frame_queue(ctx);
+        MMAL_POOL_T *pool = ctx->pool != NULL ? ctx->pool : ctx->conn->pool;
+
+        backlog = mmal_queue_length(queue);
+        STATS_ADD(ctx, num_captured, 1);
+        STATS_SET(ctx, queue_length, backlog);
+        STATS_SET(ctx, pool_length, mmal_queue_length(pool->queue));
+    }
+    if (ret == 0 && cfg != NULL)
+        ret = priv_rpigrafx_measure_update(fcp);
+    if (ret == 0 && cfg != NULL)
+        ret = priv_rpigrafx_overload_update(fcp, backlog);
     return ret;
 }
 
@@ -1025,6 +2691,27 @@ end:
     return ret;
 }
 
+uint32_t rpigrafx_get_frame_length(rpigrafx_frame_config_t *fcp)
+{
+    struct callback_context *ctx = fcp->ctx;
+
+    return ctx->header == NULL ? 0 : ctx->header->length;
+}
+
+uint32_t rpigrafx_get_frame_flags(rpigrafx_frame_config_t *fcp)
+{
+    struct callback_context *ctx = fcp->ctx;
+
+    return ctx->header == NULL ? 0 : ctx->header->flags;
+}
+
+int64_t rpigrafx_get_frame_pts(rpigrafx_frame_config_t *fcp)
+{
+    struct callback_context *ctx = fcp->ctx;
+
+    return ctx->header == NULL ? MMAL_TIME_UNKNOWN : ctx->header->pts;
+}
+
 int rpigrafx_render_frame(rpigrafx_frame_config_t *fcp)
 {
     struct callback_context *ctx = fcp->ctx;
@@ -1038,14 +2725,30 @@ int rpigrafx_render_frame(rpigrafx_frame_config_t *fcp)
         ret = 1;
         goto end;
     }
+    if (ctx->conn == NULL) {
+        print_error("Output %d,%d has no render to send frames to",
+                    fcp->camera_number, fcp->splitter_output_port_index);
+        ret = 1;
+        goto end;
+    }
+
+    if (priv_rpigrafx_present_is_used(fcp)) {
+        if ((ret = priv_rpigrafx_present_queue(fcp)))
+            goto end;
+        ctx->is_header_passed_to_render = !0;
+        goto end;
+    }
 
-    status = mmal_port_send_buffer(conn_isps_renders[fcp->camera_number][fcp->splitter_output_port_index]->in, fcp->ctx->header);
+    TRACE_HEADER(1, TRACE_RENDER_SEND, ctx->header);
+    status = mmal_port_send_buffer(ctx->conn->in, ctx->header);
     if (status != MMAL_SUCCESS) {
         print_error("Sending header to render failed: 0x%08x", status);
+        STATS_ERROR(ctx, status);
         goto end;
     }
 
     ctx->is_header_passed_to_render = !0;
+    STATS_ADD(ctx, num_rendered, 1);
 
 end:
     return ret;
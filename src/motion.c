@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * A motion gate adds a small I420 branch to the camera of a gated output:
+ * video_splitter [k] --- [0] isp [0] --- ARM
+ * Before each frame of the gated output, a frame of the branch is compared
+ * block by block with the luma of the last delivered frame.  Blocks whose
+ * mean absolute difference exceeds threshold are marked in the mask, and
+ * frames with fewer than min_blocks marked blocks are optionally skipped.
+ */
+
+static struct motion_gates_config {
+    _Bool is_used;
+    rpigrafx_frame_config_t fc;
+    int32_t width, height, pitch;
+    int32_t block_size;
+    uint32_t threshold;
+    unsigned min_blocks;
+    _Bool is_suppressing;
+
+    _Bool has_reference;
+    uint8_t *reference;
+    uint8_t *mask;
+    int32_t mask_width, mask_height;
+    uint32_t score;
+    uint64_t num_suppressed;
+} motion_gates_config[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
+
+/* Sum of absolute differences of a width x height block. */
+static uint32_t sad_block(const uint8_t *a, const uint8_t *b,
+                          const int32_t pitch,
+                          const int32_t width, const int32_t height)
+{
+    uint32_t sum = 0;
+    int32_t x, y;
+
+    for (y = 0; y < height; y ++, a += pitch, b += pitch) {
+        x = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+        {
+            /* 16-bit lanes hold rows of up to 2048 pixels. */
+            uint16x8_t acc = vdupq_n_u16(0);
+            uint32x4_t acc32;
+
+            for (; x + 16 <= width; x += 16)
+                acc = vpadalq_u8(acc, vabdq_u8(vld1q_u8(a + x), vld1q_u8(b + x)));
+            acc32 = vpaddlq_u16(acc);
+            sum += vgetq_lane_u32(acc32, 0) + vgetq_lane_u32(acc32, 1)
+                 + vgetq_lane_u32(acc32, 2) + vgetq_lane_u32(acc32, 3);
+        }
+#elif defined(__SSE2__)
+        {
+            __m128i acc = _mm_setzero_si128();
+
+            for (; x + 16 <= width; x += 16)
+                acc = _mm_add_epi64(acc,
+                        _mm_sad_epu8(_mm_loadu_si128((const __m128i*) (a + x)),
+                                     _mm_loadu_si128((const __m128i*) (b + x))));
+            sum += _mm_cvtsi128_si32(acc)
+                 + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+        }
+#endif
+        for (; x < width; x ++)
+            sum += abs(a[x] - b[x]);
+    }
+    return sum;
+}
+
+int rpigrafx_config_camera_frame_motion_gate(const int32_t width,
+                                             const int32_t height,
+                                             const int32_t block_size,
+                                             const uint32_t threshold,
+                                             const unsigned min_blocks,
+                                             const _Bool is_suppressing,
+                                             rpigrafx_frame_config_t *fcp)
+{
+    struct motion_gates_config *gcfg = NULL;
+    int ret = 0;
+
+    if (fcp->camera_number < 0) {
+        print_error("Motion gates are not supported on graph outputs");
+        ret = 1;
+        goto end;
+    }
+    if (block_size <= 0 || width < block_size || height < block_size) {
+        print_error("Block size(%d) does not fit in %dx%d",
+                    block_size, width, height);
+        ret = 1;
+        goto end;
+    }
+    gcfg = &motion_gates_config[fcp->camera_number][fcp->splitter_output_port_index];
+
+    if ((ret = rpigrafx_config_camera_frame(fcp->camera_number, width, height,
+                                            MMAL_ENCODING_I420, 0, &gcfg->fc)))
+        goto end;
+
+    gcfg->mask_width = width / block_size;
+    gcfg->mask_height = height / block_size;
+    gcfg->pitch = (width + 31) & ~31;
+    gcfg->reference = malloc(gcfg->pitch * height);
+    gcfg->mask = calloc(gcfg->mask_width * gcfg->mask_height, 1);
+    if (gcfg->reference == NULL || gcfg->mask == NULL) {
+        print_error("Failed to allocate motion gate of output %d,%d",
+                    fcp->camera_number, fcp->splitter_output_port_index);
+        free(gcfg->reference);
+        free(gcfg->mask);
+        gcfg->reference = gcfg->mask = NULL;
+        ret = 1;
+        goto end;
+    }
+    gcfg->width = width;
+    gcfg->height = height;
+    gcfg->block_size = block_size;
+    gcfg->threshold = threshold;
+    gcfg->min_blocks = min_blocks;
+    gcfg->is_suppressing = is_suppressing;
+    gcfg->has_reference = 0;
+    gcfg->score = 0;
+    gcfg->num_suppressed = 0;
+    gcfg->is_used = !0;
+
+end:
+    return ret;
+}
+
+static uint32_t update_mask(struct motion_gates_config *gcfg,
+                            const uint8_t *luma)
+{
+    const int32_t bs = gcfg->block_size;
+    const uint32_t limit = gcfg->threshold * bs * bs;
+    uint32_t score = 0;
+    int32_t bx, by;
+
+    for (by = 0; by < gcfg->mask_height; by ++) {
+        for (bx = 0; bx < gcfg->mask_width; bx ++) {
+            const size_t off = (size_t) by * bs * gcfg->pitch + bx * bs;
+            const _Bool is_changed = sad_block(luma + off, gcfg->reference + off,
+                                               gcfg->pitch, bs, bs) > limit;
+
+            gcfg->mask[by * gcfg->mask_width + bx] = is_changed;
+            score += is_changed;
+        }
+    }
+    return score;
+}
+
+/*
+ * Called by rpigrafx_capture_next_frame before capturing fcp.  *ptsp is set
+ * to the pts of the frame let through, or MMAL_TIME_UNKNOWN without a gate.
+ */
+int priv_rpigrafx_motion_wait(rpigrafx_frame_config_t *fcp, int64_t *ptsp)
+{
+    struct motion_gates_config *gcfg =
+        &motion_gates_config[fcp->camera_number][fcp->splitter_output_port_index];
+    const uint8_t *luma = NULL;
+    int ret = 0;
+
+    *ptsp = MMAL_TIME_UNKNOWN;
+    if (!gcfg->is_used)
+        goto end;
+
+    for (;;) {
+        if ((ret = rpigrafx_capture_next_frame(&gcfg->fc)))
+            goto end;
+        luma = rpigrafx_get_frame(&gcfg->fc);
+        if (luma == NULL) {
+            ret = 1;
+            goto end;
+        }
+
+        if (!gcfg->has_reference) {
+            /* The first frame is always delivered. */
+            memset(gcfg->mask, 1, gcfg->mask_width * gcfg->mask_height);
+            gcfg->score = gcfg->mask_width * gcfg->mask_height;
+            gcfg->has_reference = !0;
+        } else
+            gcfg->score = update_mask(gcfg, luma);
+
+        if (gcfg->score >= gcfg->min_blocks || !gcfg->is_suppressing)
+            break;
+        gcfg->num_suppressed ++;
+        /* Keep the gated output from backing up with suppressed frames. */
+        priv_rpigrafx_mmal_drop_until(fcp, rpigrafx_get_frame_pts(&gcfg->fc));
+    }
+    *ptsp = rpigrafx_get_frame_pts(&gcfg->fc);
+    if (gcfg->score >= gcfg->min_blocks)
+        memcpy(gcfg->reference, luma, gcfg->pitch * gcfg->height);
+
+end:
+    return ret;
+}
+
+int rpigrafx_get_frame_motion(rpigrafx_frame_config_t *fcp,
+                              const uint8_t **maskp,
+                              int32_t *mask_widthp, int32_t *mask_heightp,
+                              uint32_t *scorep, uint64_t *num_suppressedp)
+{
+    const struct motion_gates_config *gcfg = NULL;
+    int ret = 0;
+
+    if (fcp->camera_number < 0
+            || !motion_gates_config[fcp->camera_number][fcp->splitter_output_port_index].is_used) {
+        print_error("Output %d,%d has no motion gate",
+                    fcp->camera_number, fcp->splitter_output_port_index);
+        ret = 1;
+        goto end;
+    }
+    gcfg = &motion_gates_config[fcp->camera_number][fcp->splitter_output_port_index];
+    *maskp = gcfg->mask;
+    *mask_widthp = gcfg->mask_width;
+    *mask_heightp = gcfg->mask_height;
+    *scorep = gcfg->score;
+    if (num_suppressedp != NULL)
+        *num_suppressedp = gcfg->num_suppressed;
+
+end:
+    return ret;
+}
+
+int priv_rpigrafx_motion_finalize()
+{
+    int i, j;
+
+    for (i = 0; i < MAX_CAMERAS; i ++) {
+        for (j = 0; j < NUM_SPLITTER_OUTPUTS; j ++) {
+            struct motion_gates_config *gcfg = &motion_gates_config[i][j];
+
+            free(gcfg->reference);
+            free(gcfg->mask);
+            gcfg->reference = gcfg->mask = NULL;
+            gcfg->is_used = 0;
+        }
+    }
+    return 0;
+}
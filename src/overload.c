@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <string.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * Adaptive overload control of an output.  The lag of a captured frame is
+ * estimated as the frames still queued behind it times the frame interval
+ * measured from timestamps.  A lag staying high first doubles the rate
+ * divisor of the output and then halves the sensor rate of the camera,
+ * within the configured bounds; a lag staying low undoes the steps in
+ * reverse order.  Every step is logged as a trace event.
+ */
+
+static struct overloads_config {
+    _Bool is_used;
+    rpigrafx_overload_config_t cfg;
+    rpigrafx_overload_state_t state;
+    int64_t last_pts, interval;
+    unsigned num_high, num_low;
+} overloads_config[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
+
+int rpigrafx_config_camera_frame_overload(const rpigrafx_overload_config_t *ocfg,
+                                          rpigrafx_frame_config_t *fcp)
+{
+    struct overloads_config *o = NULL;
+    int ret = 0;
+
+    if (fcp->camera_number < 0) {
+        print_error("Overload control is not supported on graph outputs");
+        ret = 1;
+        goto end;
+    }
+    if (ocfg->lag_low > ocfg->lag_high || ocfg->hold_frames == 0
+            || ocfg->max_divisor == 0
+            || (ocfg->fps > 0 && (ocfg->min_fps <= 0 || ocfg->min_fps > ocfg->fps))) {
+        print_error("Invalid overload config of output %d,%d",
+                    fcp->camera_number, fcp->splitter_output_port_index);
+        ret = 1;
+        goto end;
+    }
+    if (ocfg->max_divisor > 1)
+        if ((ret = priv_rpigrafx_mmal_set_adaptive(fcp)))
+            goto end;
+
+    o = &overloads_config[fcp->camera_number][fcp->splitter_output_port_index];
+    memcpy(&o->cfg, ocfg, sizeof(o->cfg));
+    memset(&o->state, 0, sizeof(o->state));
+    o->state.divisor = 1;
+    o->state.fps = ocfg->fps;
+    o->last_pts = MMAL_TIME_UNKNOWN;
+    o->interval = 0;
+    o->num_high = o->num_low = 0;
+    o->is_used = !0;
+
+end:
+    return ret;
+}
+
+/* Steps are rare, so their events are recorded whether verbose or not. */
+static void log_step(const struct overloads_config *o,
+                     const rpigrafx_frame_config_t *fcp, const uint16_t id)
+{
+    priv_rpigrafx_trace(id, fcp, o->state.divisor,
+                        (uint32_t) (o->state.fps * 1000));
+    if (priv_rpigrafx_verbose)
+        print_error("Output %d,%d %s at lag %lld us: divisor %u, %.2f fps",
+                    fcp->camera_number, fcp->splitter_output_port_index,
+                    id == TRACE_OVERLOAD_DEGRADE ? "degraded" : "recovered",
+                    (long long) o->state.lag, o->state.divisor, o->state.fps);
+}
+
+static int degrade(struct overloads_config *o, rpigrafx_frame_config_t *fcp)
+{
+    rpigrafx_overload_state_t *st = &o->state;
+    int ret = 0;
+
+    if (st->divisor < o->cfg.max_divisor) {
+        st->divisor = MMAL_MIN(st->divisor * 2, o->cfg.max_divisor);
+        ret = rpigrafx_config_camera_frame_rate_divisor(st->divisor, fcp);
+    } else if (o->cfg.fps > 0 && st->fps > o->cfg.min_fps) {
+        st->fps = MMAL_MAX(st->fps / 2, o->cfg.min_fps);
+        ret = priv_rpigrafx_mmal_set_camera_fps(fcp->camera_number, st->fps);
+    } else
+        goto end;
+    st->num_degrades ++;
+    log_step(o, fcp, TRACE_OVERLOAD_DEGRADE);
+
+end:
+    return ret;
+}
+
+static int recover(struct overloads_config *o, rpigrafx_frame_config_t *fcp)
+{
+    rpigrafx_overload_state_t *st = &o->state;
+    int ret = 0;
+
+    if (o->cfg.fps > 0 && st->fps < o->cfg.fps) {
+        st->fps = MMAL_MIN(st->fps * 2, o->cfg.fps);
+        ret = priv_rpigrafx_mmal_set_camera_fps(fcp->camera_number, st->fps);
+    } else if (st->divisor > 1) {
+        st->divisor /= 2;
+        ret = rpigrafx_config_camera_frame_rate_divisor(st->divisor, fcp);
+    } else
+        goto end;
+    st->num_recovers ++;
+    log_step(o, fcp, TRACE_OVERLOAD_RECOVER);
+
+end:
+    return ret;
+}
+
+/*
+ * Called by rpigrafx_capture_next_frame after capturing fcp, with the
+ * number of frames left in its queue.
+ */
+int priv_rpigrafx_overload_update(rpigrafx_frame_config_t *fcp,
+                                  const unsigned backlog)
+{
+    struct overloads_config *o =
+        &overloads_config[fcp->camera_number][fcp->splitter_output_port_index];
+    const int64_t pts = rpigrafx_get_frame_pts(fcp);
+    int64_t lag;
+    int ret = 0;
+
+    if (!o->is_used)
+        goto end;
+
+    if (pts != MMAL_TIME_UNKNOWN && o->last_pts != MMAL_TIME_UNKNOWN
+            && pts > o->last_pts) {
+        if (o->interval == 0)
+            o->interval = pts - o->last_pts;
+        else
+            o->interval += (pts - o->last_pts - o->interval) / 8;
+    }
+    o->last_pts = pts;
+
+    lag = (int64_t) backlog * o->interval;
+    o->state.lag += (lag - o->state.lag) / 4;
+
+    if (o->state.lag > o->cfg.lag_high) {
+        o->num_low = 0;
+        if (++ o->num_high >= o->cfg.hold_frames) {
+            o->num_high = 0;
+            ret = degrade(o, fcp);
+        }
+    } else if (o->state.lag < o->cfg.lag_low) {
+        o->num_high = 0;
+        if (++ o->num_low >= o->cfg.hold_frames) {
+            o->num_low = 0;
+            ret = recover(o, fcp);
+        }
+    } else
+        o->num_high = o->num_low = 0;
+
+end:
+    return ret;
+}
+
+int rpigrafx_get_frame_overload(rpigrafx_frame_config_t *fcp,
+                                rpigrafx_overload_state_t *statep)
+{
+    int ret = 0;
+
+    if (fcp->camera_number < 0
+            || !overloads_config[fcp->camera_number][fcp->splitter_output_port_index].is_used) {
+        print_error("Output %d,%d has no overload control",
+                    fcp->camera_number, fcp->splitter_output_port_index);
+        ret = 1;
+        goto end;
+    }
+    memcpy(statep,
+           &overloads_config[fcp->camera_number][fcp->splitter_output_port_index].state,
+           sizeof(*statep));
+
+end:
+    return ret;
+}
+
+int priv_rpigrafx_overload_finalize()
+{
+    memset(overloads_config, 0, sizeof(overloads_config));
+    return 0;
+}
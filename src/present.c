@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <interface/mmal/mmal.h>
+#include <interface/mmal/util/mmal_connection.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * Timestamp-scheduled presentation.  rpigrafx_render_frame queues the
+ * frame of a presenting output with a target display time of its sensor
+ * pts plus a fixed delay, mapped from the camera STC to CLOCK_MONOTONIC.
+ * A presenter thread woken on each display vsync sends the newest frame
+ * due by the next vsync to video_render; frames superseded by a newer due
+ * frame or missing their vsync are dropped, so the display follows the
+ * sensor clock at a constant latency whatever the processing jitter.
+ */
+
+#define PRESENT_QUEUE_LEN 8
+/* Interval of STC resynchronization in us. */
+#define STC_SYNC_INTERVAL 1000000
+
+struct present_entry {
+    MMAL_BUFFER_HEADER_T *header;
+    int64_t target;
+};
+
+static struct presents_config {
+    _Bool is_used;
+    int64_t delay;
+    struct callback_context *ctx;
+    struct present_entry queue[PRESENT_QUEUE_LEN];
+    unsigned head, len;
+    rpigrafx_present_state_t state;
+} presents_config[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
+
+/* STC to CLOCK_MONOTONIC offsets of cameras in us. */
+static struct stcs_config {
+    _Bool is_synced;
+    int64_t offset, synced_at;
+} stcs_config[MAX_CAMERAS];
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static sem_t vsync_sem;
+static pthread_t thread;
+static _Bool is_running = 0;
+static int stop = 0;
+/* Written by the vsync callback only. */
+static int64_t last_vsync = 0, vsync_period = 16667;
+
+static int64_t get_time()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static void sync_stc(const int32_t camera_number)
+{
+    struct stcs_config *scfg = &stcs_config[camera_number];
+    int64_t t0, t1, stc;
+
+    if (priv_rpigrafx_replay_is_used(camera_number))
+        return;
+    t0 = get_time();
+    if (priv_rpigrafx_mmal_get_camera_stc(camera_number, &stc))
+        return;
+    t1 = get_time();
+    pthread_mutex_lock(&mutex);
+    scfg->offset = (t0 + t1) / 2 - stc;
+    scfg->synced_at = t1;
+    scfg->is_synced = !0;
+    pthread_mutex_unlock(&mutex);
+}
+
+/* Must be called with mutex held. */
+static void drop_head(struct presents_config *pcfg)
+{
+    struct present_entry *e = &pcfg->queue[pcfg->head];
+
+    TRACE_HEADER(1, TRACE_PRESENT_DROP, e->header);
+    mmal_buffer_header_release(e->header);
+    e->header = NULL;
+    pcfg->head = (pcfg->head + 1) % PRESENT_QUEUE_LEN;
+    pcfg->len --;
+    pcfg->state.num_dropped ++;
+    STATS_ADD(pcfg->ctx, num_dropped, 1);
+}
+
+static void present(struct presents_config *pcfg, const int64_t now,
+                    const int64_t period)
+{
+    struct present_entry e = { .header = NULL };
+    MMAL_STATUS_T status;
+
+    pthread_mutex_lock(&mutex);
+    pcfg->state.refresh_period = period;
+    /* Frames which missed their vsync are late. */
+    while (pcfg->len > 0 && pcfg->queue[pcfg->head].target + period < now)
+        drop_head(pcfg);
+    /* Of the frames due by the next vsync, show the newest. */
+    while (pcfg->len > 0 && pcfg->queue[pcfg->head].target <= now + period) {
+        if (pcfg->len > 1
+                && pcfg->queue[(pcfg->head + 1) % PRESENT_QUEUE_LEN].target <= now + period) {
+            drop_head(pcfg);
+            continue;
+        }
+        e = pcfg->queue[pcfg->head];
+        pcfg->queue[pcfg->head].header = NULL;
+        pcfg->head = (pcfg->head + 1) % PRESENT_QUEUE_LEN;
+        pcfg->len --;
+        break;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    if (e.header == NULL)
+        return;
+    TRACE_HEADER(1, TRACE_RENDER_SEND, e.header);
+    status = mmal_port_send_buffer(pcfg->ctx->conn->in, e.header);
+    if (status != MMAL_SUCCESS) {
+        print_error("Sending header to render failed: 0x%08x", status);
+        STATS_ERROR(pcfg->ctx, status);
+        mmal_buffer_header_release(e.header);
+        return;
+    }
+    pthread_mutex_lock(&mutex);
+    pcfg->state.num_presented ++;
+    pcfg->state.latency = now + period - (e.target - pcfg->delay);
+    pthread_mutex_unlock(&mutex);
+    STATS_ADD(pcfg->ctx, num_rendered, 1);
+}
+
+static void callback_vsync(void *arg)
+{
+    const int64_t now = get_time();
+
+    (void) arg;
+    if (last_vsync != 0 && now - last_vsync < 4 * vsync_period)
+        vsync_period += (now - last_vsync - vsync_period) / 16;
+    __atomic_store_n(&last_vsync, now, __ATOMIC_RELEASE);
+    sem_post(&vsync_sem);
+}
+
+static void *present_thread(void *arg)
+{
+    int i, j;
+
+    (void) arg;
+    rpigrafx_apply_thread_config(RPIGRAFX_THREAD_PRESENT);
+
+    for (;;) {
+        int64_t now, period;
+
+        while (sem_wait(&vsync_sem) && errno == EINTR)
+            ;
+        if (__atomic_load_n(&stop, __ATOMIC_RELAXED))
+            break;
+        now = __atomic_load_n(&last_vsync, __ATOMIC_ACQUIRE);
+        period = vsync_period;
+        {
+            const struct timespec expected = {
+                .tv_sec = now / 1000000,
+                .tv_nsec = now % 1000000 * 1000
+            };
+
+            priv_rpigrafx_thread_wakeup(RPIGRAFX_THREAD_PRESENT, &expected);
+        }
+
+        for (i = 0; i < MAX_CAMERAS; i ++) {
+            _Bool is_camera_used = 0;
+
+            for (j = 0; j < NUM_SPLITTER_OUTPUTS; j ++) {
+                if (!presents_config[i][j].is_used)
+                    continue;
+                is_camera_used = !0;
+                present(&presents_config[i][j], now, period);
+            }
+            if (is_camera_used && now - stcs_config[i].synced_at > STC_SYNC_INTERVAL)
+                sync_stc(i);
+        }
+    }
+    return NULL;
+}
+
+int rpigrafx_config_camera_frame_present(const int64_t delay,
+                                         rpigrafx_frame_config_t *fcp)
+{
+    struct presents_config *pcfg = NULL;
+    int ret = 0;
+
+    if (fcp->camera_number < 0) {
+        print_error("Scheduled presentation is not supported on graph outputs");
+        ret = 1;
+        goto end;
+    }
+    if (delay < 0) {
+        print_error("Presentation delay(%lld) must not be negative",
+                    (long long) delay);
+        ret = 1;
+        goto end;
+    }
+    pcfg = &presents_config[fcp->camera_number][fcp->splitter_output_port_index];
+    pcfg->is_used = !0;
+    pcfg->delay = delay;
+    memset(&pcfg->state, 0, sizeof(pcfg->state));
+
+end:
+    return ret;
+}
+
+_Bool priv_rpigrafx_present_is_used(const rpigrafx_frame_config_t *fcp)
+{
+    return fcp->camera_number >= 0
+           && presents_config[fcp->camera_number][fcp->splitter_output_port_index].is_used;
+}
+
+_Bool priv_rpigrafx_present_is_camera_used(const int32_t camera_number)
+{
+    int j;
+
+    for (j = 0; j < NUM_SPLITTER_OUTPUTS; j ++)
+        if (presents_config[camera_number][j].is_used)
+            return !0;
+    return 0;
+}
+
+/* Called by rpigrafx_finish_config after all the cameras are set up. */
+int priv_rpigrafx_present_start()
+{
+    int i, j, reti;
+    _Bool is_used = 0;
+    int ret = 0;
+
+    for (i = 0; i < MAX_CAMERAS; i ++)
+        for (j = 0; j < NUM_SPLITTER_OUTPUTS; j ++)
+            if (presents_config[i][j].is_used) {
+                is_used = !0;
+                sync_stc(i);
+            }
+    if (!is_used || is_running)
+        goto end;
+
+    sem_init(&vsync_sem, 0, 0);
+    __atomic_store_n(&stop, 0, __ATOMIC_RELAXED);
+    reti = pthread_create(&thread, NULL, present_thread, NULL);
+    if (reti != 0) {
+        print_error("Creating present thread failed: %s", strerror(reti));
+        sem_destroy(&vsync_sem);
+        ret = 1;
+        goto end;
+    }
+    is_running = !0;
+    if ((ret = priv_rpigrafx_dispmanx_set_vsync(callback_vsync, NULL)))
+        goto end;
+
+end:
+    return ret;
+}
+
+/* Called by rpigrafx_render_frame; the queue owns the header from now on. */
+int priv_rpigrafx_present_queue(rpigrafx_frame_config_t *fcp)
+{
+    struct presents_config *pcfg =
+        &presents_config[fcp->camera_number][fcp->splitter_output_port_index];
+    struct stcs_config *scfg = &stcs_config[fcp->camera_number];
+    struct callback_context *ctx = fcp->ctx;
+    const int64_t now = get_time();
+    const int64_t pts = ctx->header->pts;
+    int64_t target;
+
+    if (!is_running) {
+        print_error("Presentation of output %d,%d is not started",
+                    fcp->camera_number, fcp->splitter_output_port_index);
+        return 1;
+    }
+
+    pthread_mutex_lock(&mutex);
+    if (pts == MMAL_TIME_UNKNOWN)
+        target = now;
+    else {
+        /* Without an STC, the least observed offset bounds the pipeline. */
+        if (!scfg->is_synced || (priv_rpigrafx_replay_is_used(fcp->camera_number)
+                                 && now - pts < scfg->offset)) {
+            scfg->offset = now - pts;
+            scfg->is_synced = !0;
+        }
+        target = pts + scfg->offset;
+    }
+    pcfg->ctx = ctx;
+    if (pcfg->len == PRESENT_QUEUE_LEN)
+        drop_head(pcfg);
+    pcfg->queue[(pcfg->head + pcfg->len) % PRESENT_QUEUE_LEN] =
+        (struct present_entry) {
+            .header = ctx->header,
+            .target = target + pcfg->delay
+        };
+    pcfg->len ++;
+    pthread_mutex_unlock(&mutex);
+    return 0;
+}
+
+int rpigrafx_get_frame_present(rpigrafx_frame_config_t *fcp,
+                               rpigrafx_present_state_t *statep)
+{
+    int ret = 0;
+
+    if (!priv_rpigrafx_present_is_used(fcp)) {
+        print_error("Output %d,%d is not presenting",
+                    fcp->camera_number, fcp->splitter_output_port_index);
+        ret = 1;
+        goto end;
+    }
+    pthread_mutex_lock(&mutex);
+    memcpy(statep,
+           &presents_config[fcp->camera_number][fcp->splitter_output_port_index].state,
+           sizeof(*statep));
+    pthread_mutex_unlock(&mutex);
+
+end:
+    return ret;
+}
+
+/* Called before the display is closed; returns queued frames. */
+int priv_rpigrafx_present_finalize()
+{
+    int i, j;
+    int ret = 0;
+
+    if (is_running) {
+        ret = priv_rpigrafx_dispmanx_set_vsync(NULL, NULL);
+        __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+        sem_post(&vsync_sem);
+        pthread_join(thread, NULL);
+        sem_destroy(&vsync_sem);
+        is_running = 0;
+    }
+    for (i = 0; i < MAX_CAMERAS; i ++)
+        for (j = 0; j < NUM_SPLITTER_OUTPUTS; j ++)
+            while (presents_config[i][j].len > 0)
+                drop_head(&presents_config[i][j]);
+    memset(presents_config, 0, sizeof(presents_config));
+    memset(stcs_config, 0, sizeof(stcs_config));
+    last_vsync = 0;
+    vsync_period = 16667;
+    return ret;
+}
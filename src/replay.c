@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <interface/mmal/mmal.h>
+#include <interface/mmal/util/mmal_util.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * A replay source takes the place of vc.ril.camera and feeds RGB24 frames
+ * from ARM to the splitter input:
+ * ARM --- [0] video_splitter [0] --- [0] isp [0] --- [0] video_render
+ *                            ...
+ */
+
+static struct replays_config {
+    _Bool is_used;
+    int32_t width, height;
+    double fps;
+    rpigrafx_replay_read_t read;
+    void *arg;
+
+    /* Built-in file and memory sources. */
+    FILE *fp;
+    const uint8_t *frames;
+    size_t nframes, next_frame;
+
+    MMAL_PORT_T *port;
+    MMAL_POOL_T *pool;
+    pthread_t thread;
+    _Bool is_running;
+    int stop;
+} replays_config[MAX_CAMERAS];
+
+static int read_file(uint8_t *data, const int32_t pitch,
+                     const int32_t width, const int32_t height, void *arg)
+{
+    struct replays_config *rcfg = arg;
+    int32_t y;
+
+    for (y = 0; y < height; y ++) {
+        if (fread(data + y * pitch, width * 3, 1, rcfg->fp) == 1)
+            continue;
+        /* Loop the recording so that runs are repeatable. */
+        if (y != 0 || feof(rcfg->fp) == 0)
+            return 1;
+        rewind(rcfg->fp);
+        if (fread(data, width * 3, 1, rcfg->fp) != 1)
+            return 1;
+    }
+    return 0;
+}
+
+static int read_memory(uint8_t *data, const int32_t pitch,
+                       const int32_t width, const int32_t height, void *arg)
+{
+    struct replays_config *rcfg = arg;
+    const uint8_t *p = rcfg->frames
+                       + rcfg->next_frame * (size_t) width * height * 3;
+    int32_t y;
+
+    for (y = 0; y < height; y ++)
+        memcpy(data + y * pitch, p + (size_t) y * width * 3, width * 3);
+    rcfg->next_frame = (rcfg->next_frame + 1) % rcfg->nframes;
+    return 0;
+}
+
+static void callback_replay_input(MMAL_PORT_T *port,
+                                  MMAL_BUFFER_HEADER_T *header)
+{
+    (void) port;
+    mmal_buffer_header_release(header);
+}
+
+static void *replay_thread(void *arg)
+{
+    struct replays_config *rcfg = arg;
+    const int32_t pitch = VCOS_ALIGN_UP(rcfg->width, 32) * 3;
+    struct timespec next;
+    int64_t n;
+
+    rpigrafx_apply_thread_config(RPIGRAFX_THREAD_REPLAY);
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (n = 0; !__atomic_load_n(&rcfg->stop, __ATOMIC_RELAXED); n ++) {
+        MMAL_BUFFER_HEADER_T *header = NULL;
+        MMAL_STATUS_T status;
+
+        /* Wait for the downstream to return a buffer; this is the pacing
+         * when running as fast as possible. */
+        while ((header = mmal_queue_timedwait(rcfg->pool->queue, 100)) == NULL)
+            if (__atomic_load_n(&rcfg->stop, __ATOMIC_RELAXED))
+                goto end;
+
+        if (rcfg->read(header->data, pitch, rcfg->width, rcfg->height,
+                       rcfg->arg)) {
+            mmal_buffer_header_release(header);
+            break;
+        }
+        header->length = rcfg->port->buffer_size;
+        header->offset = 0;
+        header->flags = MMAL_BUFFER_HEADER_FLAG_FRAME_END;
+        header->pts = header->dts = rcfg->fps > 0
+                                    ? (int64_t) (n * 1e6 / rcfg->fps)
+                                    : (int64_t) next.tv_sec * 1000000
+                                      + next.tv_nsec / 1000;
+        TRACE_HEADER(1, TRACE_REPLAY_SEND, header);
+        status = mmal_port_send_buffer(rcfg->port, header);
+        if (status != MMAL_SUCCESS) {
+            print_error("Sending replay frame to %s failed: 0x%08x",
+                        rcfg->port->name, status);
+            mmal_buffer_header_release(header);
+            break;
+        }
+
+        if (rcfg->fps > 0) {
+            const long interval = (long) (1e9 / rcfg->fps);
+
+            next.tv_nsec += interval % 1000000000;
+            next.tv_sec  += interval / 1000000000 + next.tv_nsec / 1000000000;
+            next.tv_nsec %= 1000000000;
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+            priv_rpigrafx_thread_wakeup(RPIGRAFX_THREAD_REPLAY, &next);
+        } else
+            clock_gettime(CLOCK_MONOTONIC, &next);
+    }
+
+end:
+    return NULL;
+}
+
+int rpigrafx_config_camera_replay(const int32_t camera_number,
+                                  const int32_t width, const int32_t height,
+                                  const double fps,
+                                  rpigrafx_replay_read_t read, void *arg)
+{
+    struct replays_config *rcfg = NULL;
+    int ret = 0;
+
+    if (camera_number < 0 || camera_number >= MAX_CAMERAS) {
+        print_error("camera_number(%d) exceeds MAX_CAMERAS(%d)",
+                    camera_number, MAX_CAMERAS);
+        ret = 1;
+        goto end;
+    }
+    if (read == NULL) {
+        print_error("Replay source of camera %d has no read function",
+                    camera_number);
+        ret = 1;
+        goto end;
+    }
+
+    rcfg = &replays_config[camera_number];
+    /* A file of an earlier replay config of this camera is not read any more. */
+    if (rcfg->fp != NULL) {
+        fclose(rcfg->fp);
+        rcfg->fp = NULL;
+    }
+    rcfg->is_used = !0;
+    rcfg->width = width;
+    rcfg->height = height;
+    rcfg->fps = fps;
+    rcfg->read = read;
+    rcfg->arg = arg;
+
+end:
+    return ret;
+}
+
+int rpigrafx_config_camera_replay_file(const int32_t camera_number,
+                                       const int32_t width, const int32_t height,
+                                       const double fps, const char *path)
+{
+    struct replays_config *rcfg = NULL;
+    int ret = 0;
+
+    if ((ret = rpigrafx_config_camera_replay(camera_number, width, height, fps,
+                                             read_file, NULL)))
+        goto end;
+
+    rcfg = &replays_config[camera_number];
+    rcfg->arg = rcfg;
+    rcfg->fp = fopen(path, "rb");
+    if (rcfg->fp == NULL) {
+        print_error("Opening replay file %s failed: %s", path, strerror(errno));
+        rcfg->is_used = 0;
+        ret = 1;
+        goto end;
+    }
+
+end:
+    return ret;
+}
+
+int rpigrafx_config_camera_replay_memory(const int32_t camera_number,
+                                         const int32_t width, const int32_t height,
+                                         const double fps,
+                                         const void *frames, const size_t nframes)
+{
+    struct replays_config *rcfg = NULL;
+    int ret = 0;
+
+    if (nframes == 0) {
+        print_error("Replay source of camera %d has no frames", camera_number);
+        ret = 1;
+        goto end;
+    }
+    if ((ret = rpigrafx_config_camera_replay(camera_number, width, height, fps,
+                                             read_memory, NULL)))
+        goto end;
+
+    rcfg = &replays_config[camera_number];
+    rcfg->arg = rcfg;
+    rcfg->frames = frames;
+    rcfg->nframes = nframes;
+    rcfg->next_frame = 0;
+
+end:
+    return ret;
+}
+
+_Bool priv_rpigrafx_replay_is_used(const int32_t camera_number)
+{
+    if (camera_number < 0 || camera_number >= MAX_CAMERAS)
+        return 0;
+    return replays_config[camera_number].is_used;
+}
+
+void priv_rpigrafx_replay_get_size(const int32_t camera_number,
+                                   int32_t *widthp, int32_t *heightp)
+{
+    *widthp  = replays_config[camera_number].width;
+    *heightp = replays_config[camera_number].height;
+}
+
+int priv_rpigrafx_replay_start(const int32_t camera_number, MMAL_PORT_T *port)
+{
+    struct replays_config *rcfg = &replays_config[camera_number];
+    MMAL_STATUS_T status;
+    int reti;
+    int ret = 0;
+
+    port->buffer_num  = MMAL_MAX(port->buffer_num_recommended, 3);
+    port->buffer_size = MMAL_MAX(port->buffer_size_recommended,
+                                 port->buffer_size_min);
+    rcfg->pool = mmal_port_pool_create(port, port->buffer_num,
+                                       port->buffer_size);
+    if (rcfg->pool == NULL) {
+        print_error("Creating replay pool of camera %d failed", camera_number);
+        ret = 1;
+        goto end;
+    }
+
+    status = mmal_port_enable(port, callback_replay_input);
+    if (status != MMAL_SUCCESS) {
+        print_error("Enabling %s for replay failed: 0x%08x",
+                    port->name, status);
+        ret = 1;
+        goto end;
+    }
+    rcfg->port = port;
+
+    rcfg->stop = 0;
+    reti = pthread_create(&rcfg->thread, NULL, replay_thread, rcfg);
+    if (reti != 0) {
+        print_error("Creating replay thread of camera %d failed: %d",
+                    camera_number, reti);
+        ret = 1;
+        goto end;
+    }
+    rcfg->is_running = !0;
+
+end:
+    return ret;
+}
+
+int priv_rpigrafx_replay_finalize()
+{
+    int i;
+    int ret = 0;
+
+    for (i = 0; i < MAX_CAMERAS; i ++) {
+        struct replays_config *rcfg = &replays_config[i];
+
+        if (rcfg->is_running) {
+            __atomic_store_n(&rcfg->stop, 1, __ATOMIC_RELAXED);
+            pthread_join(rcfg->thread, NULL);
+            rcfg->is_running = 0;
+        }
+        if (rcfg->fp != NULL) {
+            fclose(rcfg->fp);
+            rcfg->fp = NULL;
+        }
+        rcfg->is_used = 0;
+    }
+
+    return ret;
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * Scheduling of threads which run library code.  Library-owned threads
+ * apply their class when they start; MMAL callback threads are not created
+ * by us, so they apply RPIGRAFX_THREAD_CALLBACK on their first callback.
+ */
+
+static struct threads_config {
+    int cpu;
+    int priority;
+    /* Wakeup jitter in ns. */
+    uint64_t num_wakeups;
+    int64_t jitter_max, jitter_sum;
+} threads_config[RPIGRAFX_THREAD_MAX] = {
+    [0 ... RPIGRAFX_THREAD_MAX - 1] = { .cpu = -1, .priority = 0 }
+};
+
+__thread _Bool priv_rpigrafx_thread_is_entered = 0;
+
+int rpigrafx_config_thread(const rpigrafx_thread_t thread,
+                           const int cpu, const int priority)
+{
+    int ret = 0;
+
+    if (thread < 0 || thread >= RPIGRAFX_THREAD_MAX) {
+        print_error("Unknown rpigrafx_thread_t value: %d", thread);
+        ret = 1;
+        goto end;
+    }
+    if (priority < 0 || priority > sched_get_priority_max(SCHED_FIFO)) {
+        print_error("SCHED_FIFO priority(%d) is out of range", priority);
+        ret = 1;
+        goto end;
+    }
+    threads_config[thread].cpu = cpu;
+    threads_config[thread].priority = priority;
+
+end:
+    return ret;
+}
+
+int rpigrafx_lock_memory()
+{
+    int ret = 0;
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+        print_error("Locking memory failed: %s", strerror(errno));
+        ret = 1;
+        goto end;
+    }
+
+end:
+    return ret;
+}
+
+int rpigrafx_apply_thread_config(const rpigrafx_thread_t thread)
+{
+    const struct threads_config *tcfg = NULL;
+    int reti;
+    int ret = 0;
+
+    if (thread < 0 || thread >= RPIGRAFX_THREAD_MAX) {
+        print_error("Unknown rpigrafx_thread_t value: %d", thread);
+        ret = 1;
+        goto end;
+    }
+    tcfg = &threads_config[thread];
+    priv_rpigrafx_thread_is_entered = !0;
+
+    if (tcfg->cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(tcfg->cpu, &set);
+        reti = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (reti != 0) {
+            print_error("Setting affinity of thread %d to cpu %d failed: %s",
+                        thread, tcfg->cpu, strerror(reti));
+            ret = 1;
+        }
+    }
+    if (tcfg->priority > 0) {
+        struct sched_param param = {
+            .sched_priority = tcfg->priority
+        };
+
+        reti = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (reti != 0) {
+            print_error("Setting SCHED_FIFO priority %d of thread %d failed: %s",
+                        tcfg->priority, thread, strerror(reti));
+            ret = 1;
+        }
+    }
+
+end:
+    return ret;
+}
+
+void priv_rpigrafx_thread_enter(const rpigrafx_thread_t thread)
+{
+    rpigrafx_apply_thread_config(thread);
+}
+
+/* Threads of a class, e.g. replay threads of cameras, share its stats. */
+static void add_jitter(struct threads_config *tcfg, const int64_t jitter)
+{
+    int64_t max = __atomic_load_n(&tcfg->jitter_max, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&tcfg->num_wakeups, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&tcfg->jitter_sum, jitter, __ATOMIC_RELAXED);
+    while (jitter > max
+           && !__atomic_compare_exchange_n(&tcfg->jitter_max, &max, jitter, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static int64_t get_time_ns()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+void priv_rpigrafx_thread_wakeup(const rpigrafx_thread_t thread,
+                                 const struct timespec *expected)
+{
+    add_jitter(&threads_config[thread],
+               get_time_ns() - ((int64_t) expected->tv_sec * 1000000000
+                                + expected->tv_nsec));
+}
+
+/*
+ * Frame callbacks are not woken by a timer; a frame is expected one sensor
+ * interval, the pts delta, after the previous frame of the same output.
+ * Signed errors would cancel out over a stream, so early and late
+ * arrivals both count as their absolute deviation.
+ */
+void priv_rpigrafx_thread_delivered(const rpigrafx_thread_t thread,
+                                    struct callback_context *ctx,
+                                    const int64_t pts)
+{
+    const int64_t now = get_time_ns();
+
+    if (pts != MMAL_TIME_UNKNOWN && ctx->last_pts != MMAL_TIME_UNKNOWN) {
+        const int64_t dev = now - ctx->last_time - (pts - ctx->last_pts) * 1000;
+
+        add_jitter(&threads_config[thread], dev < 0 ? -dev : dev);
+    }
+    ctx->last_pts = pts;
+    ctx->last_time = now;
+}
+
+int rpigrafx_get_thread_jitter(const rpigrafx_thread_t thread,
+                               uint64_t *num_wakeupsp,
+                               int64_t *jitter_maxp, int64_t *jitter_meanp)
+{
+    const struct threads_config *tcfg = NULL;
+    int ret = 0;
+
+    if (thread < 0 || thread >= RPIGRAFX_THREAD_MAX) {
+        print_error("Unknown rpigrafx_thread_t value: %d", thread);
+        ret = 1;
+        goto end;
+    }
+    tcfg = &threads_config[thread];
+    *num_wakeupsp = __atomic_load_n(&tcfg->num_wakeups, __ATOMIC_RELAXED);
+    *jitter_maxp  = __atomic_load_n(&tcfg->jitter_max, __ATOMIC_RELAXED);
+    *jitter_meanp = *num_wakeupsp == 0
+                    ? 0 : __atomic_load_n(&tcfg->jitter_sum, __ATOMIC_RELAXED)
+                          / (int64_t) *num_wakeupsp;
+
+end:
+    return ret;
+}
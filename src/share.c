@@ -0,0 +1,479 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * The publisher owns a ring of slots in a memfd, which is passed to each
+ * subscriber over a Unix socket.  Frames are written once by the publisher
+ * and read in place by every subscriber.
+ *
+ * The state word of a slot is SHARE_WRITING while the publisher fills it,
+ * and otherwise the number of readers.  The publisher only claims slots
+ * without readers, so a slow subscriber makes it skip that slot instead of
+ * blocking.  latest holds the sequence number and slot index of the newest
+ * frame, and futex is bumped after each publish to wake waiting readers.
+ */
+
+#define SHARE_MAGIC    "RPGSHR01"
+#define SHARE_WRITING  0x80000000u
+#define SHARE_MAX_SLOTS 255
+
+struct share_slot {
+    uint64_t seq;
+    uint32_t state;
+    uint32_t length, flags;
+    uint32_t reserved;
+    int64_t pts;
+};
+
+struct share_header {
+    char magic[8];
+    uint32_t num_slots, slot_size;
+    int32_t width, height;
+    MMAL_FOURCC_T encoding;
+    uint32_t futex;
+    /* seq << 8 | slot index. */
+    uint64_t latest;
+    uint64_t num_dropped;
+    uint64_t data_offset;
+    struct share_slot slots[];
+};
+
+struct rpigrafx_publisher {
+    char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+    int memfd, sock;
+    size_t size;
+    struct share_header *hdr;
+    pthread_t thread;
+    _Bool is_running;
+};
+
+struct rpigrafx_subscriber {
+    size_t size;
+    struct share_header *hdr;
+    uint64_t last_seq;
+};
+
+static int futex(uint32_t *uaddr, const int op, const uint32_t val,
+                 const struct timespec *timeout)
+{
+    return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+static uint8_t *slot_data(struct share_header *hdr, const unsigned slot)
+{
+    return (uint8_t*) hdr + hdr->data_offset + (size_t) slot * hdr->slot_size;
+}
+
+static int send_fd(const int sock, const int fd)
+{
+    char dummy = 0;
+    struct iovec iov = {
+        .iov_base = &dummy,
+        .iov_len = 1
+    };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } u;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = u.buf,
+        .msg_controllen = sizeof(u.buf)
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : 1;
+}
+
+static int recv_fd(const int sock)
+{
+    char dummy;
+    struct iovec iov = {
+        .iov_base = &dummy,
+        .iov_len = 1
+    };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } u;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = u.buf,
+        .msg_controllen = sizeof(u.buf)
+    };
+    struct cmsghdr *cmsg = NULL;
+    int fd = -1;
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+        return -1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET
+            || cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+static void *publisher_thread(void *arg)
+{
+    struct rpigrafx_publisher *pub = arg;
+    int client;
+
+    /* Returns when rpigrafx_publisher_destroy shuts the socket down. */
+    while ((client = accept4(pub->sock, NULL, NULL, SOCK_CLOEXEC)) >= 0 || errno == EINTR) {
+        if (client < 0)
+            continue;
+        if (send_fd(client, pub->memfd))
+            print_error("Sending memfd to subscriber failed: %s",
+                        strerror(errno));
+        close(client);
+    }
+    return NULL;
+}
+
+rpigrafx_publisher_t* rpigrafx_publisher_create(const char *path,
+                                                const int32_t width,
+                                                const int32_t height,
+                                                const MMAL_FOURCC_T encoding,
+                                                const uint32_t slot_size,
+                                                const unsigned num_slots)
+{
+    struct rpigrafx_publisher *pub = NULL;
+    struct sockaddr_un addr = {
+        .sun_family = AF_UNIX
+    };
+    const size_t page = sysconf(_SC_PAGESIZE);
+    size_t header_size, aligned_slot_size;
+    int reti;
+
+    if (num_slots == 0 || num_slots > SHARE_MAX_SLOTS) {
+        print_error("num_slots(%u) must be in 1..%d", num_slots, SHARE_MAX_SLOTS);
+        goto err;
+    }
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        print_error("Socket path %s is too long", path);
+        goto err;
+    }
+
+    pub = calloc(1, sizeof(*pub));
+    if (pub == NULL) {
+        print_error("Failed to allocate publisher");
+        goto err;
+    }
+    pub->memfd = pub->sock = -1;
+    strcpy(pub->path, path);
+
+    header_size = (sizeof(struct share_header)
+                   + num_slots * sizeof(struct share_slot) + page - 1) & ~(page - 1);
+    aligned_slot_size = (slot_size + page - 1) & ~(page - 1);
+    pub->size = header_size + num_slots * aligned_slot_size;
+
+    pub->memfd = memfd_create("rpigrafx-share", MFD_CLOEXEC);
+    if (pub->memfd < 0) {
+        print_error("memfd_create failed: %s", strerror(errno));
+        goto err;
+    }
+    if (ftruncate(pub->memfd, pub->size)) {
+        print_error("Resizing memfd to %zu bytes failed: %s",
+                    pub->size, strerror(errno));
+        goto err;
+    }
+    pub->hdr = mmap(NULL, pub->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    pub->memfd, 0);
+    if (pub->hdr == MAP_FAILED) {
+        pub->hdr = NULL;
+        print_error("Mapping memfd failed: %s", strerror(errno));
+        goto err;
+    }
+    memcpy(pub->hdr->magic, SHARE_MAGIC, sizeof(pub->hdr->magic));
+    pub->hdr->num_slots = num_slots;
+    pub->hdr->slot_size = aligned_slot_size;
+    pub->hdr->width = width;
+    pub->hdr->height = height;
+    pub->hdr->encoding = encoding;
+    pub->hdr->data_offset = header_size;
+
+    pub->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (pub->sock < 0) {
+        print_error("Creating socket failed: %s", strerror(errno));
+        goto err;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(pub->sock, (struct sockaddr*) &addr, sizeof(addr))
+            || listen(pub->sock, 8)) {
+        print_error("Listening on %s failed: %s", path, strerror(errno));
+        goto err;
+    }
+
+    reti = pthread_create(&pub->thread, NULL, publisher_thread, pub);
+    if (reti != 0) {
+        print_error("Creating publisher thread failed: %s", strerror(reti));
+        goto err;
+    }
+    pub->is_running = !0;
+
+    return pub;
+
+err:
+    if (pub != NULL)
+        rpigrafx_publisher_destroy(pub);
+    return NULL;
+}
+
+int rpigrafx_publisher_destroy(rpigrafx_publisher_t *pub)
+{
+    int ret = 0;
+
+    if (pub->sock >= 0) {
+        shutdown(pub->sock, SHUT_RDWR);
+        if (pub->is_running)
+            pthread_join(pub->thread, NULL);
+        close(pub->sock);
+        unlink(pub->path);
+    }
+    if (pub->hdr != NULL)
+        munmap(pub->hdr, pub->size);
+    if (pub->memfd >= 0)
+        close(pub->memfd);
+    free(pub);
+
+    return ret;
+}
+
+int rpigrafx_publish_frame(rpigrafx_publisher_t *pub,
+                           rpigrafx_frame_config_t *fcp)
+{
+    struct share_header *hdr = pub->hdr;
+    const void *data = rpigrafx_get_frame(fcp);
+    const uint32_t length = rpigrafx_get_frame_length(fcp);
+    const uint64_t seq = (__atomic_load_n(&hdr->latest, __ATOMIC_RELAXED) >> 8) + 1;
+    struct share_slot *s = NULL;
+    unsigned k, idx = 0;
+    int ret = 0;
+
+    if (data == NULL) {
+        ret = 1;
+        goto end;
+    }
+    if (length > hdr->slot_size) {
+        print_error("Frame length(%u) exceeds slot size(%u)",
+                    length, hdr->slot_size);
+        ret = 1;
+        goto end;
+    }
+
+    for (k = 0; k < hdr->num_slots; k ++) {
+        uint32_t expected = 0;
+
+        idx = (seq + k) % hdr->num_slots;
+        s = &hdr->slots[idx];
+        if (__atomic_compare_exchange_n(&s->state, &expected, SHARE_WRITING, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (k == hdr->num_slots) {
+        /* Every slot is being read. */
+        __atomic_fetch_add(&hdr->num_dropped, 1, __ATOMIC_RELAXED);
+        goto end;
+    }
+
+    priv_rpigrafx_copy(slot_data(hdr, idx), data, length);
+    s->length = length;
+    s->flags = rpigrafx_get_frame_flags(fcp);
+    s->pts = rpigrafx_get_frame_pts(fcp);
+    s->seq = seq;
+    __atomic_store_n(&s->state, 0, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&hdr->latest, seq << 8 | idx, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&hdr->futex, 1, __ATOMIC_RELEASE);
+    futex(&hdr->futex, FUTEX_WAKE, INT_MAX, NULL);
+
+end:
+    return ret;
+}
+
+rpigrafx_subscriber_t* rpigrafx_subscriber_create(const char *path)
+{
+    struct rpigrafx_subscriber *sub = NULL;
+    struct sockaddr_un addr = {
+        .sun_family = AF_UNIX
+    };
+    struct stat st;
+    int sock = -1, fd = -1;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        print_error("Socket path %s is too long", path);
+        goto err;
+    }
+    sub = calloc(1, sizeof(*sub));
+    if (sub == NULL) {
+        print_error("Failed to allocate subscriber");
+        goto err;
+    }
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        print_error("Creating socket failed: %s", strerror(errno));
+        goto err;
+    }
+    strcpy(addr.sun_path, path);
+    if (connect(sock, (struct sockaddr*) &addr, sizeof(addr))) {
+        print_error("Connecting to %s failed: %s", path, strerror(errno));
+        goto err;
+    }
+    fd = recv_fd(sock);
+    if (fd < 0) {
+        print_error("Receiving memfd from %s failed", path);
+        goto err;
+    }
+    if (fstat(fd, &st)) {
+        print_error("fstat on memfd failed: %s", strerror(errno));
+        goto err;
+    }
+    sub->size = st.st_size;
+    /* Writable for the reader counts. */
+    sub->hdr = mmap(NULL, sub->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (sub->hdr == MAP_FAILED) {
+        sub->hdr = NULL;
+        print_error("Mapping memfd failed: %s", strerror(errno));
+        goto err;
+    }
+    if (memcmp(sub->hdr->magic, SHARE_MAGIC, sizeof(sub->hdr->magic))) {
+        print_error("%s is not an rpigrafx publisher", path);
+        goto err;
+    }
+    sub->last_seq = __atomic_load_n(&sub->hdr->latest, __ATOMIC_ACQUIRE) >> 8;
+
+    close(fd);
+    close(sock);
+    return sub;
+
+err:
+    if (fd >= 0)
+        close(fd);
+    if (sock >= 0)
+        close(sock);
+    if (sub != NULL)
+        rpigrafx_subscriber_destroy(sub);
+    return NULL;
+}
+
+int rpigrafx_subscriber_destroy(rpigrafx_subscriber_t *sub)
+{
+    if (sub->hdr != NULL)
+        munmap(sub->hdr, sub->size);
+    free(sub);
+    return 0;
+}
+
+int rpigrafx_subscriber_next(rpigrafx_subscriber_t *sub,
+                             rpigrafx_shared_frame_t *frame,
+                             const int timeout_ms)
+{
+    struct share_header *hdr = sub->hdr;
+    struct timespec timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = timeout_ms % 1000 * 1000000
+    };
+    int ret = 0;
+
+    frame->data = NULL;
+
+    for (;;) {
+        /* Read futex before latest so that no wakeup is lost. */
+        const uint32_t f = __atomic_load_n(&hdr->futex, __ATOMIC_ACQUIRE);
+        const uint64_t latest = __atomic_load_n(&hdr->latest, __ATOMIC_ACQUIRE);
+        const uint64_t seq = latest >> 8;
+        const unsigned idx = latest & 0xff;
+        struct share_slot *s = &hdr->slots[idx];
+        uint32_t state;
+
+        if (seq <= sub->last_seq) {
+            if (futex(&hdr->futex, FUTEX_WAIT, f,
+                      timeout_ms < 0 ? NULL : &timeout)) {
+                if (errno == ETIMEDOUT)
+                    goto end;
+                if (errno != EAGAIN && errno != EINTR) {
+                    print_error("Waiting for frames failed: %s",
+                                strerror(errno));
+                    ret = 1;
+                    goto end;
+                }
+            }
+            continue;
+        }
+
+        state = __atomic_load_n(&s->state, __ATOMIC_RELAXED);
+        do {
+            if (state & SHARE_WRITING)
+                break;
+        } while (!__atomic_compare_exchange_n(&s->state, &state, state + 1, 1,
+                                              __ATOMIC_ACQUIRE,
+                                              __ATOMIC_RELAXED));
+        if (state & SHARE_WRITING)
+            continue;
+        /* The slot was reused before we got a reference to it. */
+        if (s->seq != seq) {
+            __atomic_fetch_sub(&s->state, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        frame->data = slot_data(hdr, idx);
+        frame->length = s->length;
+        frame->flags = s->flags;
+        frame->pts = s->pts;
+        frame->seq = seq;
+        frame->num_missed = seq - sub->last_seq - 1;
+        frame->width = hdr->width;
+        frame->height = hdr->height;
+        frame->encoding = hdr->encoding;
+        frame->slot = idx;
+        sub->last_seq = seq;
+        goto end;
+    }
+
+end:
+    return ret;
+}
+
+int rpigrafx_subscriber_release(rpigrafx_subscriber_t *sub,
+                                rpigrafx_shared_frame_t *frame)
+{
+    if (frame->data == NULL)
+        return 0;
+    __atomic_fetch_sub(&sub->hdr->slots[frame->slot].state, 1,
+                       __ATOMIC_RELEASE);
+    frame->data = NULL;
+    return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * The isp writes an output buffer as a whole, so a frame is split into
+ * bands of rows instead, each cropped from the splitter output and scaled
+ * by an isp of its own:
+ * video_splitter [k] --- [0] isp [0] --- ARM,  k = 0 .. num - 1
+ * The isps run concurrently on the same camera frame and the first band
+ * is ready after a fraction of the time of the whole frame, so row-based
+ * consumers start on it while the others are still being written.
+ */
+
+int rpigrafx_config_camera_frame_slices(const int32_t camera_number,
+                                        const int num,
+                                        const int32_t width, const int32_t height,
+                                        const MMAL_FOURCC_T encoding,
+                                        rpigrafx_frame_slices_t *fsp)
+{
+    int k;
+    int ret = 0;
+
+    if (num < 2 || num > RPIGRAFX_MAX_SLICES) {
+        print_error("Number of slices(%d) must be 2 to %d",
+                    num, RPIGRAFX_MAX_SLICES);
+        ret = 1;
+        goto end;
+    }
+    if (height < num * 16) {
+        print_error("height(%d) is too small for %d slices", height, num);
+        ret = 1;
+        goto end;
+    }
+
+    fsp->num = num;
+    fsp->next = 0;
+    fsp->pts = MMAL_TIME_UNKNOWN;
+    fsp->held = 0;
+    fsp->num_dropped = 0;
+    /* Keep the bands on 16-row boundaries of the isp. */
+    for (k = 0; k < num; k ++)
+        fsp->ys[k] = (height * k / num) & ~15;
+    fsp->ys[num] = height;
+
+    for (k = 0; k < num; k ++) {
+        if ((ret = rpigrafx_config_camera_frame(camera_number, width,
+                                                fsp->ys[k + 1] - fsp->ys[k],
+                                                encoding, 0, &fsp->fcs[k])))
+            goto end;
+        if ((ret = priv_rpigrafx_mmal_set_slice(&fsp->fcs[k], fsp->ys[k],
+                                                height)))
+            goto end;
+    }
+
+end:
+    return ret;
+}
+
+/*
+ * Bands are delivered in order.  The first band starts a frame; a later
+ * band older than it was left from a dropped frame and is replaced.  A
+ * later band newer than it means the frame lost that band: the band is
+ * held and delivery restarts from the first band of the newer frame.
+ */
+int rpigrafx_capture_next_slice(rpigrafx_frame_slices_t *fsp,
+                                rpigrafx_slice_t *slicep)
+{
+    int k = fsp->next;
+    rpigrafx_frame_config_t *fcp = NULL;
+    int64_t pts, restart_pts = MMAL_TIME_UNKNOWN;
+    int ret = 0;
+
+    for (;;) {
+        fcp = &fsp->fcs[k];
+        if (fsp->held & (1u << k))
+            fsp->held &= ~(1u << k);
+        else if ((ret = rpigrafx_capture_next_frame(fcp)))
+            goto end;
+        pts = rpigrafx_get_frame_pts(fcp);
+        if (k == 0) {
+            if (pts != MMAL_TIME_UNKNOWN && restart_pts != MMAL_TIME_UNKNOWN
+                    && pts < restart_pts) {
+                fsp->num_dropped ++;
+                continue;
+            }
+            fsp->pts = pts;
+            break;
+        }
+        if (pts == MMAL_TIME_UNKNOWN || fsp->pts == MMAL_TIME_UNKNOWN
+                || pts == fsp->pts)
+            break;
+        fsp->num_dropped ++;
+        if (pts > fsp->pts) {
+            fsp->held |= 1u << k;
+            restart_pts = pts;
+            k = 0;
+        }
+    }
+
+    slicep->data = rpigrafx_get_frame(fcp);
+    if (slicep->data == NULL) {
+        ret = 1;
+        goto end;
+    }
+    slicep->y = fsp->ys[k];
+    slicep->height = fsp->ys[k + 1] - fsp->ys[k];
+    slicep->index = k;
+    slicep->num = fsp->num;
+    slicep->pts = pts;
+    fsp->next = (k + 1) % fsp->num;
+
+end:
+    return ret;
+}
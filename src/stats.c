@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * Counters of each frame context.  They live in a static page until
+ * rpigrafx_stats_export moves them to a named shared memory segment, which
+ * rpigrafx-stats reads.  Counters such as num_dropped and num_errors are
+ * written by callback, application and library threads alike, so they are
+ * added to atomically; gauges are plain relaxed stores.
+ */
+
+static struct priv_rpigrafx_stats_page static_page = {
+    .magic = PRIV_RPIGRAFX_STATS_MAGIC
+};
+struct priv_rpigrafx_stats_page *priv_rpigrafx_stats_page = &static_page;
+static char shm_name[64];
+
+int priv_rpigrafx_stats_register()
+{
+    struct priv_rpigrafx_stats_page *page = priv_rpigrafx_stats_page;
+    struct priv_rpigrafx_stats_output *o = NULL;
+    uint32_t idx = page->num_outputs;
+
+    if (idx == PRIV_RPIGRAFX_STATS_MAX_OUTPUTS)
+        return -1;
+    o = &page->outputs[idx];
+    memset(o, 0, sizeof(*o));
+    o->camera_number = o->output = -1;
+    __atomic_store_n(&page->num_outputs, idx + 1, __ATOMIC_RELEASE);
+    return idx;
+}
+
+void priv_rpigrafx_stats_label(const int idx,
+                               const int32_t camera_number, const int32_t output)
+{
+    if (idx < 0)
+        return;
+    priv_rpigrafx_stats_page->outputs[idx].camera_number = camera_number;
+    priv_rpigrafx_stats_page->outputs[idx].output = output;
+}
+
+int rpigrafx_stats_export(const char *name)
+{
+    struct priv_rpigrafx_stats_page *page = NULL;
+    int fd = -1;
+    int ret = 0;
+
+    if (priv_rpigrafx_stats_page != &static_page) {
+        print_error("Statistics are already exported to %s", shm_name);
+        ret = 1;
+        goto end;
+    }
+    if (strlen(name) >= sizeof(shm_name)) {
+        print_error("Shared memory name %s is too long", name);
+        ret = 1;
+        goto end;
+    }
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        print_error("Opening shared memory %s failed: %s",
+                    name, strerror(errno));
+        ret = 1;
+        goto end;
+    }
+    if (ftruncate(fd, sizeof(*page))) {
+        print_error("Resizing shared memory %s failed: %s",
+                    name, strerror(errno));
+        shm_unlink(name);
+        ret = 1;
+        goto end;
+    }
+    page = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (page == MAP_FAILED) {
+        print_error("Mapping shared memory %s failed: %s",
+                    name, strerror(errno));
+        shm_unlink(name);
+        ret = 1;
+        goto end;
+    }
+
+    /* Increments racing with the switch may be lost. */
+    memcpy(page, &static_page, sizeof(*page));
+    page->pid = getpid();
+    strcpy(shm_name, name);
+    __atomic_store_n(&priv_rpigrafx_stats_page, page, __ATOMIC_RELEASE);
+
+end:
+    if (fd >= 0)
+        close(fd);
+    return ret;
+}
+
+int priv_rpigrafx_stats_finalize()
+{
+    struct priv_rpigrafx_stats_page *page = priv_rpigrafx_stats_page;
+
+    priv_rpigrafx_stats_page = &static_page;
+    if (page != &static_page) {
+        munmap(page, sizeof(*page));
+        shm_unlink(shm_name);
+    }
+    static_page.num_outputs = 0;
+    return 0;
+}
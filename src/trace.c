@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * Each thread that emits an event gets its own ring, so writers never
+ * contend.  Rings are pushed onto a lock-free list on first use and are
+ * never freed; rpigrafx_trace_dump() walks the list.
+ */
+
+#define TRACE_RING_SIZE 4096 /* Must be a power of two. */
+
+struct trace_ring {
+    struct trace_ring *next;
+    uint16_t thread;
+    uint32_t head;
+    struct priv_rpigrafx_trace_event events[TRACE_RING_SIZE];
+};
+
+static struct trace_ring *rings = NULL;
+static uint16_t num_rings = 0;
+static __thread struct trace_ring *ring = NULL;
+
+static struct trace_ring *trace_ring_create()
+{
+    struct trace_ring *r = calloc(1, sizeof(*r));
+
+    if (r == NULL)
+        return NULL;
+    r->thread = __atomic_fetch_add(&num_rings, 1, __ATOMIC_RELAXED);
+    r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    return r;
+}
+
+void priv_rpigrafx_trace(const uint16_t id, const void *ptr,
+                         const uint32_t length, const uint32_t flags)
+{
+    struct priv_rpigrafx_trace_event *e = NULL;
+    struct timespec t;
+    uint32_t head;
+
+    if (ring == NULL && (ring = trace_ring_create()) == NULL)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    head = ring->head;
+    e = &ring->events[head & (TRACE_RING_SIZE - 1)];
+    e->timestamp = (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+    e->ptr = (uint64_t) (uintptr_t) ptr;
+    e->length = length;
+    e->flags = flags;
+    e->id = id;
+    e->thread = ring->thread;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int rpigrafx_trace_dump(const char *path)
+{
+    const struct trace_ring *r = NULL;
+    FILE *fp = NULL;
+    int ret = 0;
+
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        print_error("Opening trace file %s failed", path);
+        ret = 1;
+        goto end;
+    }
+    if (fwrite(PRIV_RPIGRAFX_TRACE_MAGIC, 8, 1, fp) != 1) {
+        print_error("Writing trace file %s failed", path);
+        ret = 1;
+        goto end;
+    }
+
+    /* Events being written while dumping may be torn; they are diagnostics. */
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        const uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint32_t n = head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE;
+        uint32_t k;
+
+        for (k = head - n; k != head; k ++) {
+            if (fwrite(&r->events[k & (TRACE_RING_SIZE - 1)],
+                       sizeof(r->events[0]), 1, fp) != 1) {
+                print_error("Writing trace file %s failed", path);
+                ret = 1;
+                goto end;
+            }
+        }
+    }
+
+end:
+    if (fp != NULL && fclose(fp) != 0) {
+        print_error("Closing trace file %s failed", path);
+        ret = 1;
+    }
+    return ret;
+}
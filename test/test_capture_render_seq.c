@@ -63,10 +63,12 @@ static void usage()
             "  -c CAMERA_NUM      Use camera CAMERA_NUM (default: 0)\n"
             "  -P                 Use preview port (default)\n"
             "  -C                 Use capture port\n"
+            "  -T                 Use capture port in streaming mode\n"
             "  -w WIDTH\n"
             "  -h HEIGHT          Size of the capture frame\n"
             "                     Default is the size of the screen\n"
             "  -n NFRAMES         Capture and render NFRAMES frames (default: 20)\n"
+            "  -d DIVISOR         Deliver every DIVISOR-th camera frame (default: 1)\n"
             "\n"
             " Rendering options:\n"
             "\n"
@@ -86,6 +88,8 @@ static void usage()
             "  -S                 Save frame to \"%%08d.ppm\"\n"
             "  -R                 Disable rendering\n"
             "  -v [VERBOSE]       Be verbose or not (default: 1)\n"
+            "  -o                 Print the component topology after setup\n"
+            "  -t FILE            Dump trace events to FILE on exit\n"
             "  -?                 What you are doing\n"
            );
 }
@@ -94,12 +98,15 @@ int main(int argc, char *argv[])
 {
     int opt;
     int i, camera_num = 0, nframes = 20, width, height;
+    unsigned divisor = 1;
     int render_fullscreen = 1, render_layer = 5;
     int render_x = 0, render_y = 0, render_width, render_height;
     uint32_t interval = 0;
     int mb = -1;
     _Bool get_frame = 0, on_off_qpu = 0, save_frame = 0, no_render = 0;
+    _Bool print_topology = 0;
     int verbose = 1;
+    const char *trace_file = NULL;
     rpigrafx_camera_port_t camera_port = RPIGRAFX_CAMERA_PORT_PREVIEW;
     rpigrafx_frame_config_t fc;
     double start, time;
@@ -111,7 +118,7 @@ int main(int argc, char *argv[])
     render_width  = width;
     render_height = height;
 
-    while ((opt = getopt(argc, argv, "c:PCw:h:n:f::x:y:W:H:l:gs:qSRv::?")) != -1) {
+    while ((opt = getopt(argc, argv, "c:PCTw:h:n:d:f::x:y:W:H:l:gs:qSRv::ot:?")) != -1) {
         switch (opt) {
             case 'c':
                 camera_num = atoi(optarg);
@@ -122,6 +129,9 @@ int main(int argc, char *argv[])
             case 'C':
                 camera_port = RPIGRAFX_CAMERA_PORT_CAPTURE;
                 break;
+            case 'T':
+                camera_port = RPIGRAFX_CAMERA_PORT_CAPTURE_STREAM;
+                break;
             case 'w':
                 width  = atoi(optarg);
                 break;
@@ -131,6 +141,13 @@ int main(int argc, char *argv[])
             case 'n':
                 nframes = atoi(optarg);
                 break;
+            case 'd':
+                if (atoi(optarg) < 1) {
+                    fprintf(stderr, "error: DIVISOR must be at least 1\n");
+                    exit(EXIT_FAILURE);
+                }
+                divisor = atoi(optarg);
+                break;
             case 'f':
                 render_fullscreen = (optarg == 0) ? 1 : !!atoi(optarg);
                 break;
@@ -167,6 +184,12 @@ int main(int argc, char *argv[])
             case 'v':
                 verbose = (optarg == 0) ? 1 : !!atoi(optarg);
                 break;
+            case 'o':
+                print_topology = 1;
+                break;
+            case 't':
+                trace_file = optarg;
+                break;
             default:
                 if (opt != '?')
                     fprintf(stderr, "error: Unknown option: %c\n", opt);
@@ -188,11 +211,17 @@ int main(int argc, char *argv[])
     _check(rpigrafx_config_camera_frame(camera_num, width, height,
                                         MMAL_ENCODING_RGB24, 1, &fc));
     _check(rpigrafx_config_camera_port(camera_num, camera_port));
+    _check(rpigrafx_config_camera_frame_rate_divisor(divisor, &fc));
     _check(rpigrafx_config_camera_frame_render(render_fullscreen,
                                                render_x, render_y,
                                                render_width, render_height,
                                                render_layer, &fc));
     _check(rpigrafx_finish_config());
+    if (print_topology) {
+        char topology[0x200];
+        _check(rpigrafx_get_topology(camera_num, topology, sizeof(topology)));
+        fprintf(stderr, "%s", topology);
+    }
 
     start = get_time();
     for (i = 0; i < nframes; i ++) {
@@ -215,6 +244,8 @@ int main(int argc, char *argv[])
     }
     time = get_time() - start;
     fprintf(stderr, "%f [s], %f [frame/s]\n", time, nframes / time);
+    if (trace_file != NULL)
+        _check(rpigrafx_trace_dump(trace_file));
 
     if (!on_off_qpu)
         mailbox_qpu_enable(mb, 1);
@@ -0,0 +1,127 @@
+#include <rpigrafx.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#define _check(x) \
+    do { \
+        if ((x)) { \
+            fprintf(stderr, "Error at %s:%d:%s\n", __FILE__, __LINE__, __func__); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+static char *progname = NULL;
+
+static double get_time()
+{
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return (double) t.tv_sec + t.tv_usec * 1e-6;
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: %s [OPTION]...\n", progname);
+    fprintf(stderr,
+            "\n"
+            "  -c CAMERA_NUM      Use camera CAMERA_NUM (default: 0)\n"
+            "  -w WIDTH\n"
+            "  -h HEIGHT          Size of the encoded frame (default: 1280x720)\n"
+            "  -b BITRATE         Bitrate in bit/s (default: 4000000)\n"
+            "  -i INTRA_PERIOD    Distance between I-frames (default: 30)\n"
+            "  -n NFRAMES         Encode NFRAMES frames (default: 300)\n"
+            "  -o FILE            Write the H.264 stream to FILE (default: out.h264)\n"
+            "  -v [VERBOSE]       Be verbose or not (default: 1)\n"
+            "  -?                 What you are doing\n"
+           );
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    int i, camera_num = 0, nframes = 300, width = 1280, height = 720;
+    uint32_t bitrate = 4000000, intra_period = 30;
+    const char *fname = "out.h264";
+    int verbose = 1;
+    rpigrafx_frame_config_t fc;
+    FILE *fp = NULL;
+    size_t total = 0;
+    double start, time;
+
+    progname = argv[0];
+
+    while ((opt = getopt(argc, argv, "c:w:h:b:i:n:o:v::?")) != -1) {
+        switch (opt) {
+            case 'c':
+                camera_num = atoi(optarg);
+                break;
+            case 'w':
+                width  = atoi(optarg);
+                break;
+            case 'h':
+                height = atoi(optarg);
+                break;
+            case 'b':
+                bitrate = atoi(optarg);
+                break;
+            case 'i':
+                intra_period = atoi(optarg);
+                break;
+            case 'n':
+                nframes = atoi(optarg);
+                break;
+            case 'o':
+                fname = optarg;
+                break;
+            case 'v':
+                verbose = (optarg == 0) ? 1 : !!atoi(optarg);
+                break;
+            default:
+                if (opt != '?')
+                    fprintf(stderr, "error: Unknown option: %c\n", opt);
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc) {
+        fprintf(stderr, "error: Extra argument(s) after options.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    fp = fopen(fname, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "error: Failed to open %s: %s\n", fname,
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    rpigrafx_set_verbose(verbose);
+    _check(rpigrafx_config_camera_frame_h264(camera_num, width, height,
+                                             bitrate, intra_period, &fc));
+    _check(rpigrafx_finish_config());
+
+    start = get_time();
+    for (i = 0; i < nframes; ) {
+        uint32_t length;
+        _check(rpigrafx_capture_next_frame(&fc));
+        length = rpigrafx_get_frame_length(&fc);
+        if (fwrite(rpigrafx_get_frame(&fc), 1, length, fp) != length) {
+            fprintf(stderr, "error: Failed to write to %s\n", fname);
+            exit(EXIT_FAILURE);
+        }
+        total += length;
+        if (rpigrafx_get_frame_flags(&fc) & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
+            i ++;
+    }
+    time = get_time() - start;
+    fprintf(stderr, "%f [s], %f [frame/s], %f [bit/s]\n",
+            time, nframes / time, total * 8 / time);
+
+    fclose(fp);
+    return 0;
+}
@@ -0,0 +1,125 @@
+#include <rpigrafx.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#define _check(x) \
+    do { \
+        if ((x)) { \
+            fprintf(stderr, "Error at %s:%d:%s\n", __FILE__, __LINE__, __func__); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+static char *progname = NULL;
+static int width = 1280, height = 720;
+
+static double get_time()
+{
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return (double) t.tv_sec + t.tv_usec * 1e-6;
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: %s [OPTION]...\n", progname);
+    fprintf(stderr,
+            "\n"
+            "  -c CAMERA_NUM      Use camera CAMERA_NUM (default: 0)\n"
+            "  -w WIDTH\n"
+            "  -h HEIGHT          Size of the frame (default: 1280x720)\n"
+            "  -j WORKERS         Number of worker threads (default: 4)\n"
+            "  -t TILES           Tiles per frame (default: 8)\n"
+            "  -d DEPTH           Frames in flight (default: 4)\n"
+            "  -n NFRAMES         Process NFRAMES frames (default: 300)\n"
+            "  -v [VERBOSE]       Be verbose or not (default: 1)\n"
+            "  -?                 What you are doing\n"
+           );
+}
+
+/* Invert a horizontal band of the RGB24 frame. */
+static int invert(const rpigrafx_work_t *work, void *arg)
+{
+    const int pitch = ((width + 31) & ~31) * 3;
+    const int y0 = height * work->tile / work->num_tiles;
+    const int y1 = height * (work->tile + 1) / work->num_tiles;
+    uint8_t *p = work->data;
+    int x, y;
+
+    (void) arg;
+    for (y = y0; y < y1; y ++)
+        for (x = 0; x < width * 3; x ++)
+            p[y * pitch + x] = ~p[y * pitch + x];
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    int camera_num = 0, nframes = 300, num_workers = 4, num_tiles = 8, depth = 4;
+    int verbose = 1;
+    rpigrafx_frame_config_t fc;
+    rpigrafx_engine_t *e = NULL;
+    double start, time;
+
+    progname = argv[0];
+
+    while ((opt = getopt(argc, argv, "c:w:h:j:t:d:n:v::?")) != -1) {
+        switch (opt) {
+            case 'c':
+                camera_num = atoi(optarg);
+                break;
+            case 'w':
+                width  = atoi(optarg);
+                break;
+            case 'h':
+                height = atoi(optarg);
+                break;
+            case 'j':
+                num_workers = atoi(optarg);
+                break;
+            case 't':
+                num_tiles = atoi(optarg);
+                break;
+            case 'd':
+                depth = atoi(optarg);
+                break;
+            case 'n':
+                nframes = atoi(optarg);
+                break;
+            case 'v':
+                verbose = (optarg == 0) ? 1 : !!atoi(optarg);
+                break;
+            default:
+                if (opt != '?')
+                    fprintf(stderr, "error: Unknown option: %c\n", opt);
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc) {
+        fprintf(stderr, "error: Extra argument(s) after options.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    rpigrafx_set_verbose(verbose);
+    _check(rpigrafx_config_camera_frame(camera_num, width, height,
+                                        MMAL_ENCODING_RGB24, 1, &fc));
+    _check(rpigrafx_config_camera_frame_depth(depth + 1, &fc));
+    _check(rpigrafx_finish_config());
+
+    e = rpigrafx_engine_create(&fc, num_workers, num_tiles, depth, 1,
+                               invert, NULL);
+    _check(e == NULL);
+
+    start = get_time();
+    _check(rpigrafx_engine_run(e, nframes));
+    time = get_time() - start;
+    fprintf(stderr, "%f [s], %f [frame/s]\n", time, nframes / time);
+
+    _check(rpigrafx_engine_destroy(e));
+    return 0;
+}
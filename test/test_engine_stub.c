@@ -0,0 +1,158 @@
+/*
+ * Runs the worker engine on a stubbed capture without a camera and checks
+ * that every tile of every frame is processed once and that frames are
+ * finished in capture order, also when rendering fails halfway.
+ */
+
+#include "engine.c"
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#define _check(x) \
+    do { \
+        if ((x)) { \
+            fprintf(stderr, "Error at %s:%d:%s\n", __FILE__, __LINE__, __func__); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define NUM_HEADERS 16
+#define MAX_TILES 64
+
+static MMAL_BUFFER_HEADER_T headers[NUM_HEADERS];
+static _Bool is_header_used[NUM_HEADERS];
+static uint32_t tiles_done[NUM_HEADERS][MAX_TILES];
+static int num_tiles = 8;
+static int64_t next_pts = 0, next_finished_pts = 0;
+static int64_t render_fails_at = -1;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+int priv_rpigrafx_verbose = 0;
+
+void print_error_core(const char *file, const int line, const char *func,
+                      const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "%s:%d:%s: error: ", file, line, func);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+}
+
+int rpigrafx_apply_thread_config(const rpigrafx_thread_t thread)
+{
+    (void) thread;
+    return 0;
+}
+
+/* Checks the frame and returns its header to the stub pool. */
+static void finish(MMAL_BUFFER_HEADER_T *header)
+{
+    const int k = header - headers;
+    int t;
+
+    _check(header->pts != next_finished_pts);
+    next_finished_pts ++;
+    for (t = 0; t < num_tiles; t ++) {
+        _check(tiles_done[k][t] != 1);
+        tiles_done[k][t] = 0;
+    }
+    pthread_mutex_lock(&mutex);
+    _check(!is_header_used[k]);
+    is_header_used[k] = 0;
+    pthread_mutex_unlock(&mutex);
+}
+
+void mmal_buffer_header_release(MMAL_BUFFER_HEADER_T *header)
+{
+    finish(header);
+}
+
+int rpigrafx_capture_next_frame(rpigrafx_frame_config_t *fcp)
+{
+    struct callback_context *ctx = fcp->ctx;
+    int k;
+
+    if (ctx->header != NULL && !ctx->is_header_passed_to_render)
+        mmal_buffer_header_release(ctx->header);
+    ctx->header = NULL;
+    ctx->is_header_passed_to_render = 0;
+
+    pthread_mutex_lock(&mutex);
+    for (k = 0; k < NUM_HEADERS && is_header_used[k]; k ++)
+        ;
+    _check(k == NUM_HEADERS);
+    is_header_used[k] = !0;
+    pthread_mutex_unlock(&mutex);
+
+    headers[k].data = (uint8_t*) &tiles_done[k];
+    headers[k].length = sizeof(tiles_done[k]);
+    headers[k].pts = next_pts ++;
+    ctx->header = &headers[k];
+    return 0;
+}
+
+int rpigrafx_render_frame(rpigrafx_frame_config_t *fcp)
+{
+    struct callback_context *ctx = fcp->ctx;
+
+    /* As the library, leave the header to the caller on failure. */
+    if (ctx->header->pts == render_fails_at)
+        return 1;
+    finish(ctx->header);
+    ctx->is_header_passed_to_render = !0;
+    return 0;
+}
+
+/* Marks the tile as done after a random delay to shuffle completion. */
+static int work(const rpigrafx_work_t *w, void *arg)
+{
+    uint32_t *done = w->data;
+
+    (void) arg;
+    if (rand() % 4 == 0)
+        usleep(rand() % 200);
+    __atomic_add_fetch(&done[w->tile], 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct callback_context ctx = { .header = NULL };
+    rpigrafx_frame_config_t fc = { .ctx = &ctx };
+    rpigrafx_engine_t *e = NULL;
+    const uint64_t nframes = 1000;
+    int num_workers = 4, is_rendering, k;
+
+    (void) argc;
+    (void) argv;
+
+    for (is_rendering = 0; is_rendering <= 1; is_rendering ++) {
+        next_pts = next_finished_pts = 0;
+        ctx.header = NULL;
+        e = rpigrafx_engine_create(&fc, num_workers, num_tiles, 4,
+                                   is_rendering, work, NULL);
+        _check(e == NULL);
+        _check(rpigrafx_engine_run(e, nframes));
+        _check(rpigrafx_engine_destroy(e));
+        _check((uint64_t) next_finished_pts != nframes);
+    }
+
+    /* Every captured header is returned once after a render failure. */
+    next_pts = next_finished_pts = 0;
+    render_fails_at = nframes / 2;
+    ctx.header = NULL;
+    e = rpigrafx_engine_create(&fc, num_workers, num_tiles, 4, 1, work, NULL);
+    _check(e == NULL);
+    _check(!rpigrafx_engine_run(e, nframes));
+    _check(rpigrafx_engine_destroy(e));
+    _check(next_finished_pts != next_pts);
+    for (k = 0; k < NUM_HEADERS; k ++)
+        _check(is_header_used[k]);
+    printf("%llu frames of %d tiles on %d workers finished in order\n",
+           (unsigned long long) nframes, num_tiles, num_workers);
+
+    return 0;
+}
@@ -0,0 +1,52 @@
+#include <rpigrafx.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#define _check(x) \
+    do { \
+        if ((x)) { \
+            fprintf(stderr, "Error at %s:%d:%s\n", __FILE__, __LINE__, __func__); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define NUM_FCS 4
+
+static double get_time()
+{
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return (double) t.tv_sec + t.tv_usec * 1e-6;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, nframes = 100;
+    rpigrafx_graph_t *g = NULL;
+    rpigrafx_frame_config_t fcs[NUM_FCS];
+    double start, time;
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s GRAPH_FILE [NFRAMES]\n", argv[0]);
+        fprintf(stderr, "Frames of fcs[0] are captured and rendered.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (argc == 3)
+        nframes = atoi(argv[2]);
+
+    _check((g = rpigrafx_graph_create()) == NULL);
+    _check(rpigrafx_graph_load(g, argv[1], fcs, NUM_FCS));
+    _check(rpigrafx_graph_build(g));
+
+    start = get_time();
+    for (i = 0; i < nframes; i ++) {
+        _check(rpigrafx_capture_next_frame(&fcs[0]));
+        _check(rpigrafx_render_frame(&fcs[0]));
+    }
+    time = get_time() - start;
+    fprintf(stderr, "%f [s], %f [frame/s]\n", time, nframes / time);
+
+    _check(rpigrafx_graph_destroy(g));
+    return 0;
+}
@@ -0,0 +1,140 @@
+#include <rpigrafx.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define _check(x) \
+    do { \
+        if ((x)) { \
+            fprintf(stderr, "Error at %s:%d:%s\n", __FILE__, __LINE__, __func__); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+static char *progname = NULL;
+
+static double get_time()
+{
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return (double) t.tv_sec + t.tv_usec * 1e-6;
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: %s [OPTION]...\n", progname);
+    fprintf(stderr,
+            "\n"
+            "  -c CAMERA_NUM      Use camera CAMERA_NUM (default: 0)\n"
+            "  -w WIDTH\n"
+            "  -h HEIGHT          Size of the main I420 frame (default: 1920x1080)\n"
+            "  -W WIDTH\n"
+            "  -H HEIGHT          Size of the RGB24 branch (default: 320x240)\n"
+            "  -s SCALER          Scaler of the branch: auto, isp, resize or none\n"
+            "                     (default: auto)\n"
+            "  -n NFRAMES         Capture NFRAMES frames (default: 300)\n"
+            "  -v [VERBOSE]       Be verbose or not (default: 1)\n"
+            "  -?                 What you are doing\n"
+           );
+}
+
+static rpigrafx_scaler_t parse_scaler(const char *s)
+{
+    if (!strcmp(s, "auto"))
+        return RPIGRAFX_SCALER_AUTO;
+    else if (!strcmp(s, "isp"))
+        return RPIGRAFX_SCALER_ISP;
+    else if (!strcmp(s, "resize"))
+        return RPIGRAFX_SCALER_RESIZE;
+    else if (!strcmp(s, "none"))
+        return RPIGRAFX_SCALER_NONE;
+    fprintf(stderr, "error: Unknown scaler: %s\n", s);
+    usage();
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    int camera_num = 0, nframes = 300;
+    int width = 1920, height = 1080, branch_width = 320, branch_height = 240;
+    rpigrafx_scaler_t scaler = RPIGRAFX_SCALER_AUTO;
+    int verbose = 1;
+    rpigrafx_frame_config_t fc_main, fc_branch;
+    rpigrafx_plan_t plan;
+    char topology[1024];
+    double start, time_main = 0, time_branch = 0, t;
+    int i;
+
+    progname = argv[0];
+
+    while ((opt = getopt(argc, argv, "c:w:h:W:H:s:n:v::?")) != -1) {
+        switch (opt) {
+            case 'c':
+                camera_num = atoi(optarg);
+                break;
+            case 'w':
+                width  = atoi(optarg);
+                break;
+            case 'h':
+                height = atoi(optarg);
+                break;
+            case 'W':
+                branch_width  = atoi(optarg);
+                break;
+            case 'H':
+                branch_height = atoi(optarg);
+                break;
+            case 's':
+                scaler = parse_scaler(optarg);
+                break;
+            case 'n':
+                nframes = atoi(optarg);
+                break;
+            case 'v':
+                verbose = (optarg == 0) ? 1 : !!atoi(optarg);
+                break;
+            default:
+                if (opt != '?')
+                    fprintf(stderr, "error: Unknown option: %c\n", opt);
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc) {
+        fprintf(stderr, "error: Extra argument(s) after options.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    rpigrafx_set_verbose(verbose);
+    _check(rpigrafx_config_camera_frame(camera_num, width, height,
+                                        MMAL_ENCODING_I420, 0, &fc_main));
+    _check(rpigrafx_config_camera_frame(camera_num, branch_width, branch_height,
+                                        MMAL_ENCODING_RGB24, 0, &fc_branch));
+    _check(rpigrafx_config_camera_frame_scaler(scaler, &fc_branch));
+    _check(rpigrafx_plan_config(&plan));
+    _check(rpigrafx_finish_config());
+    _check(rpigrafx_get_topology(camera_num, topology, sizeof(topology)));
+    printf("%s", topology);
+
+    start = get_time();
+    for (i = 0; i < nframes; i ++) {
+        t = get_time();
+        _check(rpigrafx_capture_next_frame(&fc_main));
+        time_main += get_time() - t;
+        t = get_time();
+        _check(rpigrafx_capture_next_frame(&fc_branch));
+        time_branch += get_time() - t;
+    }
+    t = get_time() - start;
+
+    printf("GPU memory: %zu [B]\n", plan.gpu_total);
+    printf("throughput: %f [frame/s]\n", nframes / t);
+    printf("wait: main %f [ms/frame], branch %f [ms/frame]\n",
+           time_main / nframes * 1e3, time_branch / nframes * 1e3);
+
+    return 0;
+}
@@ -0,0 +1,134 @@
+#include <rpigrafx.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define _check(x) \
+    do { \
+        if ((x)) { \
+            fprintf(stderr, "Error at %s:%d:%s\n", __FILE__, __LINE__, __func__); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+static char *progname = NULL;
+
+static void usage()
+{
+    fprintf(stderr, "Usage: %s [OPTION]...\n", progname);
+    fprintf(stderr,
+            "\n"
+            "  -s                 Subscribe instead of publishing\n"
+            "  -p PATH            Socket path (default: /tmp/rpigrafx.sock)\n"
+            "  -c CAMERA_NUM      Publish camera CAMERA_NUM (default: 0)\n"
+            "  -w WIDTH\n"
+            "  -h HEIGHT          Size of the frame (default: 640x480)\n"
+            "  -n NFRAMES         Publish or read NFRAMES frames (default: 300)\n"
+            "  -v [VERBOSE]       Be verbose or not (default: 1)\n"
+            "  -?                 What you are doing\n"
+           );
+}
+
+static void publish(const char *path, const int camera_num,
+                    const int width, const int height, const int nframes)
+{
+    rpigrafx_frame_config_t fc;
+    rpigrafx_publisher_t *pub = NULL;
+    int i;
+
+    _check(rpigrafx_config_camera_frame(camera_num, width, height,
+                                        MMAL_ENCODING_RGB24, 1, &fc));
+    _check(rpigrafx_finish_config());
+    pub = rpigrafx_publisher_create(path, width, height, MMAL_ENCODING_RGB24,
+                                    ((width + 31) & ~31) * ((height + 15) & ~15) * 3,
+                                    4);
+    _check(pub == NULL);
+
+    for (i = 0; i < nframes; i ++) {
+        _check(rpigrafx_capture_next_frame(&fc));
+        _check(rpigrafx_publish_frame(pub, &fc));
+        _check(rpigrafx_render_frame(&fc));
+    }
+
+    _check(rpigrafx_publisher_destroy(pub));
+}
+
+static void subscribe(const char *path, const int nframes)
+{
+    rpigrafx_subscriber_t *sub = rpigrafx_subscriber_create(path);
+    rpigrafx_shared_frame_t frame;
+    uint64_t missed = 0;
+    int i;
+
+    _check(sub == NULL);
+    for (i = 0; i < nframes; i ++) {
+        _check(rpigrafx_subscriber_next(sub, &frame, 1000));
+        if (frame.data == NULL) {
+            fprintf(stderr, "Timed out\n");
+            break;
+        }
+        missed += frame.num_missed;
+        fprintf(stderr, "Frame #%llu: %dx%d, pts %lld\n",
+                (unsigned long long) frame.seq, frame.width, frame.height,
+                (long long) frame.pts);
+        _check(rpigrafx_subscriber_release(sub, &frame));
+    }
+    fprintf(stderr, "%d frames read, %llu missed\n",
+            i, (unsigned long long) missed);
+    _check(rpigrafx_subscriber_destroy(sub));
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    int camera_num = 0, nframes = 300, width = 640, height = 480;
+    const char *path = "/tmp/rpigrafx.sock";
+    int is_subscriber = 0;
+    int verbose = 1;
+
+    progname = argv[0];
+
+    while ((opt = getopt(argc, argv, "sp:c:w:h:n:v::?")) != -1) {
+        switch (opt) {
+            case 's':
+                is_subscriber = 1;
+                break;
+            case 'p':
+                path = optarg;
+                break;
+            case 'c':
+                camera_num = atoi(optarg);
+                break;
+            case 'w':
+                width  = atoi(optarg);
+                break;
+            case 'h':
+                height = atoi(optarg);
+                break;
+            case 'n':
+                nframes = atoi(optarg);
+                break;
+            case 'v':
+                verbose = (optarg == 0) ? 1 : !!atoi(optarg);
+                break;
+            default:
+                if (opt != '?')
+                    fprintf(stderr, "error: Unknown option: %c\n", opt);
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc) {
+        fprintf(stderr, "error: Extra argument(s) after options.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    rpigrafx_set_verbose(verbose);
+    if (is_subscriber)
+        subscribe(path, nframes);
+    else
+        publish(path, camera_num, width, height, nframes);
+    return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+/* Prints counters exported by rpigrafx_stats_export(). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "stats.h"
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [-i INTERVAL] [-n COUNT] NAME\n", progname);
+    fprintf(stderr,
+            "\n"
+            "  -i INTERVAL        Print every INTERVAL seconds (default: 1)\n"
+            "  -n COUNT           Print COUNT times, 0 for ever (default: 1)\n"
+           );
+}
+
+static void print_page(const struct priv_rpigrafx_stats_page *page)
+{
+    const uint32_t n = __atomic_load_n(&page->num_outputs, __ATOMIC_ACQUIRE);
+    uint32_t i;
+
+    printf("pid %d\n", page->pid);
+    printf("%6s %6s %10s %10s %8s %8s %5s %5s %6s %10s\n",
+           "camera", "output", "captured", "rendered", "empty", "dropped",
+           "queue", "pool", "errors", "status");
+    for (i = 0; i < n && i < PRIV_RPIGRAFX_STATS_MAX_OUTPUTS; i ++) {
+        const struct priv_rpigrafx_stats_output *o = &page->outputs[i];
+
+        printf("%6d %6d %10u %10u %8u %8u %5u %5u %6u 0x%08x\n",
+               o->camera_number, o->output,
+               __atomic_load_n(&o->num_captured, __ATOMIC_RELAXED),
+               __atomic_load_n(&o->num_rendered, __ATOMIC_RELAXED),
+               __atomic_load_n(&o->num_empty, __ATOMIC_RELAXED),
+               __atomic_load_n(&o->num_dropped, __ATOMIC_RELAXED),
+               __atomic_load_n(&o->queue_length, __ATOMIC_RELAXED),
+               __atomic_load_n(&o->pool_length, __ATOMIC_RELAXED),
+               __atomic_load_n(&o->num_errors, __ATOMIC_RELAXED),
+               __atomic_load_n(&o->last_status, __ATOMIC_RELAXED));
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    const struct priv_rpigrafx_stats_page *page = NULL;
+    int opt, fd, k;
+    int interval = 1, count = 1;
+
+    while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+        switch (opt) {
+            case 'i':
+                interval = atoi(optarg);
+                break;
+            case 'n':
+                count = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    fd = shm_open(argv[optind], O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "error: Failed to open %s: %s\n",
+                argv[optind], strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        fprintf(stderr, "error: Failed to map %s: %s\n",
+                argv[optind], strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (memcmp(page->magic, PRIV_RPIGRAFX_STATS_MAGIC, sizeof(page->magic))) {
+        fprintf(stderr, "error: %s is not an rpigrafx statistics page\n",
+                argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    for (k = 0; count == 0 || k < count; k ++) {
+        if (k != 0)
+            sleep(interval);
+        print_page(page);
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+/* Decodes a file written by rpigrafx_trace_dump(). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "trace.h"
+
+static const char *names[TRACE_ID_MAX] = {
+    [TRACE_CAPTURE_RELEASE]  = "capture_release",
+    [TRACE_CAPTURE_SEND]     = "capture_send",
+    [TRACE_CAPTURE_GOT]      = "capture_got",
+    [TRACE_CAPTURE_EMPTY]    = "capture_empty",
+    [TRACE_RENDER_SEND]      = "render_send",
+    [TRACE_CALLBACK_CONTROL] = "callback_control",
+    [TRACE_CALLBACK_CONN]    = "callback_conn",
+    [TRACE_STREAM_QUEUE]     = "stream_queue",
+    [TRACE_STREAM_EMPTY]     = "stream_empty",
+    [TRACE_DECIMATE_PASS]    = "decimate_pass",
+    [TRACE_DECIMATE_DROP]    = "decimate_drop",
+    [TRACE_PORT_OUTPUT]      = "port_output",
+    [TRACE_REPLAY_SEND]      = "replay_send",
+    [TRACE_OVERLOAD_DEGRADE] = "overload_degrade",
+    [TRACE_OVERLOAD_RECOVER] = "overload_recover",
+    [TRACE_PRESENT_DROP]     = "present_drop",
+};
+
+static int compare(const void *a, const void *b)
+{
+    const struct priv_rpigrafx_trace_event *x = a, *y = b;
+
+    return (x->timestamp > y->timestamp) - (x->timestamp < y->timestamp);
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *fp = NULL;
+    char magic[8];
+    struct priv_rpigrafx_trace_event *events = NULL;
+    size_t n = 0, cap = 0, k;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s TRACE_FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    fp = fopen(argv[1], "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "error: Failed to open %s\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    if (fread(magic, sizeof(magic), 1, fp) != 1
+            || memcmp(magic, PRIV_RPIGRAFX_TRACE_MAGIC, sizeof(magic))) {
+        fprintf(stderr, "error: %s is not a trace file\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    for (;;) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 4096;
+            events = realloc(events, cap * sizeof(*events));
+            if (events == NULL) {
+                fprintf(stderr, "error: Failed to allocate events\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (fread(&events[n], sizeof(*events), 1, fp) != 1)
+            break;
+        n ++;
+    }
+    fclose(fp);
+
+    qsort(events, n, sizeof(*events), compare);
+
+    printf("%12s %6s %-18s %-18s %10s %10s\n",
+           "time[us]", "thread", "event", "ptr", "length", "flags");
+    for (k = 0; k < n; k ++) {
+        const struct priv_rpigrafx_trace_event *e = &events[k];
+
+        printf("%12.3f %6u %-18s 0x%016" PRIx64 " %10" PRIu32 " 0x%08" PRIx32 "\n",
+               (e->timestamp - events[0].timestamp) * 1e-3,
+               e->thread,
+               e->id < TRACE_ID_MAX && names[e->id] ? names[e->id] : "?",
+               e->ptr, e->length, e->flags);
+    }
+
+    free(events);
+    return 0;
+}